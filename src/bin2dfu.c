@@ -20,12 +20,13 @@ Specification, UM0391.
 
 int main(int argc, char *argv[])
 {
+    int rv = 0;
     int binfile = open(argv[1], O_RDONLY);
     if (binfile == -1) {
         printf("Could not open %s\n", argv[1]);
         return -1;
     } else {
-        int dfufile = open(argv[2], O_RDWR | O_CREAT | O_TRUNC,
+        int dfufile = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC,
                            S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 
         if (dfufile == -1) {
@@ -35,13 +36,17 @@ int main(int argc, char *argv[])
             dfuse_file *dfusefile = dfuse_init(0xffff, 0x0483, 0x5740);
 
             dfuse_image *image = dfuse_addimage(dfusefile, argv[2], 0);
-            dfuse_readbin(dfusefile, image, binfile);
 
-            dfuse_writeprefix(dfusefile, dfufile);
-            dfuse_writeimages(dfusefile, dfufile);
-            dfuse_writesuffix(dfusefile, dfufile);
+            // a truncated file mustn't pass for a good one
+            if (dfuse_readbin(dfusefile, image, binfile) < 0) {
+                printf("Could not read %s\n", argv[1]);
+                rv = -3;
+            } else if (dfuse_write(dfusefile, dfufile) < 0) {
+                printf("Could not write %s\n", argv[2]);
+                rv = -3;
+            }
 
-            // 	printf("Checksum: <%x>\n", dfusefile->suffix->crc);
+            // 	printf("Checksum: <%x>\n", dfusefile->suffix.crc);
 
             dfuse_struct_cleanup(dfusefile);
 
@@ -51,5 +56,5 @@ int main(int argc, char *argv[])
         close(binfile);
     }
 
-    return 0;
+    return rv;
 }
\ No newline at end of file
@@ -21,58 +21,232 @@ DfuSe uses a CRC to verify the contents of the DfuSe file.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC32_CLMUL 1
+#endif
+
+#include "crc32.h"
+#include "crc32tab.h"
 
 #define CRCPOLYNOMIAL 0xedb88320
 
-/* crc_tab[] -- this crcTable is being build by chksum_crc32GenTab().
- *		so make sure, you call it before using the other
- *		functions!
+/* crc32_bytes() -- the classic loop, a byte and a table lookup
+ *		    at a time. crc is the internal (inverted) state.
+ */
+static u_int32_t crc32_bytes(u_int32_t crc, const unsigned char *block,
+                             unsigned long length)
+{
+    while (length--) {
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *block++) & 0xff];
+    }
+
+    return crc;
+}
+
+/* crc32_slice8() -- slicing-by-8, eight bytes and eight independent
+ *		     table lookups at a time. The lookups are for
+ *		     little endian words, big endian hosts take the
+ *		     byte loop.
+ */
+static u_int32_t crc32_slice8(u_int32_t crc, const unsigned char *block,
+                              unsigned long length)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u_int32_t one, two;
+
+    while (length >= 8) {
+        memcpy(&one, block, 4);
+        memcpy(&two, block + 4, 4);
+        one ^= crc;
+        crc = crc32_table[7][one & 0xff] ^
+              crc32_table[6][(one >> 8) & 0xff] ^
+              crc32_table[5][(one >> 16) & 0xff] ^
+              crc32_table[4][one >> 24] ^
+              crc32_table[3][two & 0xff] ^
+              crc32_table[2][(two >> 8) & 0xff] ^
+              crc32_table[1][(two >> 16) & 0xff] ^
+              crc32_table[0][two >> 24];
+        block += 8;
+        length -= 8;
+    }
+#endif
+
+    return crc32_bytes(crc, block, length);
+}
+
+#ifdef CRC32_CLMUL
+/* crc32_clmul() -- folds 64 bytes at a time into four 128 bit
+ *		    accumulators with carry-less multiplies, then
+ *		    folds those down and does a Barrett reduction to
+ *		    32 bits. length must be at least 64 and a multiple
+ *		    of 16. The constants are x^n mod P for the
+ *		    reflected polynomial, as in Intel's "Fast CRC
+ *		    Computation Using PCLMULQDQ Instruction".
+ */
+__attribute__((target("pclmul,sse4.1")))
+static u_int32_t crc32_clmul(u_int32_t crc, const unsigned char *block,
+                             unsigned long length)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(block + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(block + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(block + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(block + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    block += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)(block + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(block + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(block + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(block + 0x30)));
+        block += 64;
+        length -= 64;
+    }
+
+    // four accumulators into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // what is left, 16 bytes at a time
+    while (length >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)block));
+        block += 16;
+        length -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+/* crc32_has_clmul() -- whether the cpu has PCLMULQDQ (and SSE4.1),
+ *			asked once.
  */
-u_int32_t crc_tab[256];
+static int crc32_has_clmul(void)
+{
+    static int has = -1;
+
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("pclmul") &&
+              __builtin_cpu_supports("sse4.1");
+    }
 
-/* chksum_crc32() -- to a given block, this one calculates the
- *				crc32-checksum until the length is
- *				reached. the crc32-checksum will be
- *				the result.
+    return has;
+}
+#endif
+
+/* crc32_update() -- continues the crc32-checksum crc of the data
+ *		     before block with length more bytes. Blocks of
+ *		     64 bytes and more are folded with carry-less
+ *		     multiplies where the cpu can, everything else is
+ *		     sliced by 8.
  */
-u_int32_t chksum_crc32 (unsigned char *block, unsigned int length)
+u_int32_t crc32_update(u_int32_t crc, const unsigned char *block,
+                       unsigned long length)
 {
-   register unsigned long crc;
-   unsigned long i;
-
-   crc = 0xFFFFFFFF;
-   for (i = 0; i < length; i++)
-   {
-      crc = ((crc >> 8) & 0x00FFFFFF) ^ crc_tab[(crc ^ *block++) & 0xFF];
-   }
-   return (crc ^ 0xFFFFFFFF);
+    crc = ~crc;
+
+#ifdef CRC32_CLMUL
+    if (length >= 64 && crc32_has_clmul()) {
+        unsigned long folded = length & ~15UL;
+
+        crc = crc32_clmul(crc, block, folded);
+        block += folded;
+        length -= folded;
+    }
+#endif
+
+    return ~crc32_slice8(crc, block, length);
 }
 
-/* chksum_crc32gentab() --      to a global crc_tab[256], this one will
- *				calculate the crcTable for crc32-checksums.
- *				it is generated to the polynom [..]
+/* crc32_multmodp() -- multiplies a and b modulo the polynomial,
+ *		       both reflected, x^0 is the top bit.
  */
+static u_int32_t crc32_multmodp(u_int32_t a, u_int32_t b)
+{
+    u_int32_t m = 1U << 31, p = 0;
 
-void chksum_crc32gentab ()
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRCPOLYNOMIAL : b >> 1;
+    }
+
+    return p;
+}
+
+/* crc32_combine() -- the crc32 of two blocks one after the other,
+ *		      from their crcs and the length of the second.
+ *		      Appending length2 zero bytes multiplies by
+ *		      x^(8 * length2), which goes by the bits of
+ *		      length2 with the x^(2^n) table.
+ */
+u_int32_t crc32_combine(u_int32_t crc1, u_int32_t crc2,
+                        unsigned long length2)
 {
-   unsigned long crc, poly;
-   int i, j;
-
-   poly = CRCPOLYNOMIAL;
-   for (i = 0; i < 256; i++)
-   {
-      crc = i;
-      for (j = 8; j > 0; j--)
-      {
-	 if (crc & 1)
-	 {
-	    crc = (crc >> 1) ^ poly;
-	 }
-	 else
-	 {
-	    crc >>= 1;
-	 }
-      }
-      crc_tab[i] = crc;
-   }
+    u_int32_t p = 1U << 31;
+    unsigned int k = 3;
+
+    while (length2) {
+        if (length2 & 1) {
+            p = crc32_multmodp(crc32_x2n_table[k & 31], p);
+        }
+        length2 >>= 1;
+        k++;
+    }
+
+    return crc32_multmodp(p, crc1) ^ crc2;
 }
@@ -22,22 +22,20 @@ DfuSe uses a CRC to verify the contents of the DfuSe file.
 #ifndef __DFU_CRC32__
 #define __DFU_CRC32__
 
-/* crc_tab[] -- this crcTable is being build by chksum_crc32GenTab().
-*		so make sure, you call it before using the other
-*		functions!
+/* crc32_update() -- continues the crc32-checksum crc of the
+*		    data before block with length more bytes, so
+*		    data can be checksummed as it streams past.
+*		    start with crc = 0. The tables are static const,
+*		    generated by crc32gen.c, and the fastest way
+*		    the cpu has is picked at run time.
 */
-extern u_int32_t crc_tab[256];
+u_int32_t crc32_update (u_int32_t crc, const unsigned char *block,
+			unsigned long length);
 
-/* chksum_crc32gentab() --      to a global crc_tab[256], this one will
-*				calculate the crcTable for crc32-checksums.
-*				it is generated to the polynom [..]
+/* crc32_combine() -- the crc32-checksum of two blocks one after
+*		     the other, from the checksums of both and the
+*		     length of the second, without the data.
 */
-void chksum_crc32gentab ();
-
-/* chksum_crc32() -- to a given block, this one calculates the
-*				crc32-checksum until the length is
-*				reached. the crc32-checksum will be
-*				the result.
-*/
-u_int32_t chksum_crc32 (unsigned char *block, unsigned int length);
+u_int32_t crc32_combine (u_int32_t crc1, u_int32_t crc2,
+			 unsigned long length2);
 #endif
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+crc32gen.c :
+Builds the crc32 tables from the reflected polynomial 0xedb88320 and prints
+them as crc32tab.h. Regenerate the header with "make crc32tab"; "make check"
+fails if the checked-in one no longer matches.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CRCPOLYNOMIAL 0xedb88320
+
+static uint32_t crc32_table[8][256];
+static uint32_t crc32_x2n_table[32];
+
+/* multmodp() -- a(x) * b(x) modulo the polynomial, as in crc32.c.
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1U << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRCPOLYNOMIAL : b >> 1;
+    }
+    return p;
+}
+
+static void print_row(const uint32_t *v, int n, const char *indent)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (i % 6 == 0) {
+            printf("%s", indent);
+        }
+        printf("0x%08x", v[i]);
+        if (i == n - 1) {
+            printf("\n");
+        } else if (i % 6 == 5) {
+            printf(",\n");
+        } else {
+            printf(", ");
+        }
+    }
+}
+
+int main(void)
+{
+    uint32_t crc;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRCPOLYNOMIAL : crc >> 1;
+        }
+        crc32_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = (crc >> 8) ^ crc32_table[0][crc & 0xff];
+            crc32_table[k][n] = crc;
+        }
+    }
+    // x^1, then squared over and over
+    crc32_x2n_table[0] = 1U << 30;
+    for (n = 1; n < 32; n++) {
+        crc32_x2n_table[n] =
+            multmodp(crc32_x2n_table[n - 1], crc32_x2n_table[n - 1]);
+    }
+
+    printf("/*\n"
+           "crc32tab.h :\n"
+           "The tables of crc32.c, generated for the reflected polynomial "
+           "0xedb88320.\n"
+           "crc32_table[0][n] is the crc of the single byte n, and\n"
+           "crc32_table[k][n] = (crc32_table[k - 1][n] >> 8) ^\n"
+           "                    crc32_table[0][crc32_table[k - 1][n] & 0xff]\n"
+           "is the crc of n followed by k zero bytes, for slicing-by-8.\n"
+           "crc32_x2n_table[n] is x^(2^n) modulo the polynomial, for "
+           "crc32_combine().\n"
+           "Generated by crc32gen.c (make crc32tab), do not edit.\n"
+           "*/\n"
+           "\n"
+           "#ifndef __DFU_CRC32TAB__\n"
+           "#define __DFU_CRC32TAB__\n"
+           "\n"
+           "static const u_int32_t crc32_table[8][256] = {\n");
+    for (k = 0; k < 8; k++) {
+        printf("    {\n");
+        print_row(crc32_table[k], 256, "        ");
+        printf(k < 7 ? "    },\n" : "    }\n");
+    }
+    printf("};\n"
+           "\n"
+           "static const u_int32_t crc32_x2n_table[32] = {\n");
+    print_row(crc32_x2n_table, 32, "    ");
+    printf("};\n"
+           "#endif\n");
+    return 0;
+}
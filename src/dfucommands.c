@@ -12,78 +12,222 @@ DFU protocol used in the STM32 Bootloader, AN3156.
 */
 
 #include <stdio.h>
-#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <libusb-1.0/libusb.h>
+#include "dfulayout.h"
 #include "dfurequests.h"
 #include "dfucommands.h"
 
 /*
-        dfu_read_flash() fills membuf with length bytes from flash memory.
+        dfu_select_region() finds the memory region that holds length bytes at
+        address, checks that its sectors have the wanted attributes, and
+        switches the DFU interface to that region's alternate setting if
+        necessary.
 */
-int32_t dfu_read_flash(dfu_device *device, uint8_t *membuf, uint32_t length)
+int32_t dfu_select_region(dfu_device *device, uint32_t address,
+                          uint32_t length, uint8_t attributes)
 {
-    dfu_status status;
-    uint8_t finalpage[FLASH_PAGE_BYTES];
+    dfu_sector sector;
+    dfu_region *region;
+    uint64_t end = (uint64_t)address + length;
+    uint64_t sector_address;
 
-    int32_t max_page = ceil((float)length / FLASH_PAGE_BYTES);
+    // the device didn't publish a layout, so there is nothing to check
+    if (device->num_regions == 0) {
+        return 0;
+    }
 
-    // flash reads must be 2k, which is the flash block size on stm32
-    // read all but the final page
-    for (int i = 0; i < (max_page - 1); i++) {
-#if STMDFU_DEBUG_PRINTFS
-        printf("max_page: <%d>\n", i);
-#endif
-        if (0 > dfu_upload(device, i + 2, &membuf[i * FLASH_PAGE_BYTES],
-                           FLASH_PAGE_BYTES)) {
-            printf("max_page error\n");
-        }
+    if (dfu_layout_find_sector(device->regions, device->num_regions, address,
+                               &sector)) {
+        printf("dfu_select_region: no memory region at 0x%.8x\n", address);
+        return -1;
+    }
 
-        if (0 > dfu_get_status(device, &status)) {
-            printf("dfu_read_flash: dfu_get_status error\n");
+    region = sector.region;
+
+    if (end > dfu_region_end(region)) {
+        printf("dfu_select_region: 0x%.8x + %u runs past the end of <%s>\n",
+               address, length, region->name);
+        return -2;
+    }
+
+    for (sector_address = sector.address; sector_address < end;
+         sector_address = (uint64_t)sector.address + sector.size) {
+        if (dfu_layout_find_sector(region, 1, sector_address, &sector) ||
+            (sector.attributes & attributes) != attributes) {
+            printf("dfu_select_region: sector 0x%.8x of <%s> doesn't allow "
+                   "this operation\n",
+                   (uint32_t)sector_address, region->name);
+            return -3;
         }
+    }
 
-        if (status.bState == STATE_DFU_ERROR) {
-            if (status.bStatus == DFU_STATUS_ERROR_VENDOR) {
-                printf(
-                    "dfu_read_flash failed: flash read protection enabled\n");
-                return -1;
-            } else {
-                printf("dfu_read_flash failed: reason unknown\n");
-            }
+    if (region->alt_setting != device->altsetting) {
+        if (device->transport->set_altsetting(device, region->alt_setting)) {
+            printf("dfu_select_region: can't select alternate setting %d\n",
+                   region->alt_setting);
+            return -4;
         }
+        device->altsetting = region->alt_setting;
+    }
+
+    return 0;
+}
+
+/*
+        dfu_get_sector() looks up the flash sector that address belongs to.
+        Devices that don't publish a layout are assumed to have
+        FLASH_PAGE_BYTES pages that allow everything.
+*/
+int32_t dfu_get_sector(dfu_device *device, uint32_t address,
+                       dfu_sector *sector)
+{
+    if (device->num_regions) {
+        return dfu_layout_find_sector(device->regions, device->num_regions,
+                                      address, sector);
+    }
+
+    sector->address = address - address % FLASH_PAGE_BYTES;
+    sector->size = FLASH_PAGE_BYTES;
+    sector->attributes =
+        DFU_SECTOR_READABLE | DFU_SECTOR_ERASABLE | DFU_SECTOR_WRITEABLE;
+    sector->region = NULL;
+
+    return 0;
+}
+
+/*
+        dfu_read_flash_copy() is the dfu_read_flash_cb() callback of
+        dfu_read_flash(), it copies every block into the user's buffer.
+*/
+static int32_t dfu_read_flash_copy(void *arg, uint32_t offset, uint8_t *data,
+                                   uint32_t length)
+{
+    memcpy((uint8_t *)arg + offset, data, length);
+
+    return 0;
+}
+
+/*
+        dfu_read_flash() fills membuf with length bytes of memory starting at
+        address.
+*/
+int32_t dfu_read_flash(dfu_device *device, uint32_t address, uint8_t *membuf,
+                       uint32_t length)
+{
+    if (0 > dfu_read_flash_cb(device, address, length, dfu_read_flash_copy,
+                              membuf)) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+        dfu_read_flash_cb() reads length bytes of memory starting at address,
+        and hands every block to callback as soon as it has arrived. A
+        callback that returns < 0 stops the read, and that value is returned.
+        An upload that fails or comes back short is an error (-1).
+*/
+int32_t dfu_read_flash_cb(dfu_device *device, uint32_t address,
+                          uint32_t length, dfu_read_callback callback,
+                          void *arg)
+{
+    dfu_status status;
+    uint32_t block_size = device->transfer_size;
+    uint32_t max_page = (length + block_size - 1) / block_size;
+    uint32_t offset, size;
+    uint8_t *block;
+    uint32_t upload_address = 0;
+    int upload_error = 0;
+    int upload_got = 0;
+    int rv = 0;
+
+    if (max_page + DFUSE_FIRST_BLOCK > 0xffff) {
+        printf("dfu_read_flash: %u bytes is too much for one upload\n",
+               length);
+        return -1;
     }
 
-// read the final page
+    if (0 > dfu_select_region(device, address, length, DFU_SECTOR_READABLE)) {
+        return -1;
+    }
+
+    if (0 > dfu_set_address_pointer(device, address)) {
+        return -1;
+    }
+
+    dfu_make_idle(device, 0);
+
+    block = (uint8_t *)malloc(block_size);
+
+    // every block but the last one is a full wTransferSize, the bootloader
+    // works out the address of a block from its number and that size. The
+    // last one only asks for what is left of the user's request, so small
+    // regions (option bytes, OTP) aren't read past their end.
+    //
+    // the bootloader stays in dfuUPLOAD-IDLE between uploads, so blocks
+    // follow each other without a GETSTATUS in between. The status is only
+    // checked once the read is over, or when an upload fails or comes back
+    // short (e.g. because read protection is on)
+    for (uint32_t i = 0; i < max_page; i++) {
 #if STMDFU_DEBUG_PRINTFS
-    printf("final max_page: <%d>\n", (max_page - 1));
+        printf("max_page: <%d>\n", i);
 #endif
-    if (0 > dfu_upload(device, (max_page - 1) + 2, finalpage, FLASH_PAGE_BYTES)) {
-        printf("max_page error\n");
+        offset = i * block_size;
+        size = length - offset < block_size ? length - offset : block_size;
+
+        rv = dfu_upload(device, DFUSE_FIRST_BLOCK + i, block, size);
+        if (rv != (int)size) {
+            // an upload that comes back empty or short before the end
+            // would leave a hole in what the caller gets, it is an error
+            // like a failed one
+            upload_error = 1;
+            upload_got = rv;
+            upload_address = address + offset;
+            rv = -1;
+            break;
+        }
+
+        rv = callback(arg, offset, block, size);
+        if (0 > rv) {
+            break;
+        }
     }
 
+    // without a status the state isn't known, CLRSTATUS is sent as if it
+    // were dfuERROR
     if (0 > dfu_get_status(device, &status)) {
         printf("dfu_read_flash: dfu_get_status error\n");
-    }
-
-    if (status.bState == STATE_DFU_ERROR) {
+        status.bState = STATE_DFU_ERROR;
+        rv = -1;
+    } else if (status.bState == STATE_DFU_ERROR) {
         if (status.bStatus == DFU_STATUS_ERROR_VENDOR) {
             printf("dfu_read_flash failed: flash read protection enabled\n");
-            return -1;
         } else {
-            printf("dfu_read_flash failed: reason unknown\n");
+            printf("dfu_read_flash failed: %s\n",
+                   dfu_status_to_string(status.bStatus));
         }
+        rv = -1;
+    } else if (upload_error && upload_got < 0) {
+        printf("dfu_read_flash: dfu_upload error <%d>\n", upload_got);
+    } else if (upload_error) {
+        printf("dfu_read_flash: upload at 0x%.8x returned %d of %u bytes\n",
+               upload_address, upload_got, size);
     }
 
-    // fill up the user's buffer with bytes from
-    // the final page, ignoring bytes beyond the length
-    // of the user's request
-    int finalread = length - ((max_page - 1) * FLASH_PAGE_BYTES);
+    free(block);
 
-    for (int i = 0; i < finalread; i++) {
-        membuf[((max_page - 1) * FLASH_PAGE_BYTES) + i] = finalpage[i];
+    // back to dfuIDLE, downloads and commands aren't accepted in
+    // dfuUPLOAD-IDLE (or dfuERROR)
+    if (status.bState == STATE_DFU_ERROR) {
+        dfu_clear_status(device);
+    } else {
+        dfu_abort(device);
     }
 
-    return 1;
+    return rv < 0 ? rv : 0;
 }
 
 /*
@@ -93,21 +237,18 @@ int32_t dfu_read_flash(dfu_device *device, uint8_t *membuf, uint32_t length)
 */
 int32_t dfu_read_optbytes(dfu_device *device, uint8_t *membuf)
 {
-    dfu_status status;
-    int rv;
+    uint32_t address = OPTION_BYTES_ADDRESS;
 
-    dfu_set_address_pointer(device, OPTION_BYTES_ADDRESS);
-
-    dfu_make_idle(device, 0);
-
-    rv = dfu_upload(device, 2, membuf, 16);
-
-    if (0 > rv) {
-        printf("dfu_read_optbytes failed: control transfer error <%d>\n", rv);
+    // parts with a layout publish the option bytes as their own region
+    dfu_region *region = dfu_layout_find_region(
+        device->regions, device->num_regions, "Option Bytes");
+    if (region != NULL) {
+        address = dfu_region_start(region);
     }
 
-    if (0 > dfu_get_status(device, &status)) {
-        printf("dfu_read_optbytes: dfu_get_status error\n");
+    if (0 > dfu_read_flash(device, address, membuf, 16)) {
+        printf("dfu_read_optbytes failed\n");
+        return -1;
     }
 
     return 0;
@@ -135,19 +276,17 @@ int32_t dfu_get(dfu_device *device, uint8_t *data)
     return 1;
 }
 
-int32_t dfu_download_check(dfu_device *device)
+/*
+        dfu_download_check() waits for a download (data or command) to be
+        processed by the bootloader, and reports any error it ran into. op
+        and size tell the poll schedule what kind of operation is pending.
+*/
+int32_t dfu_download_check(dfu_device *device, int32_t op, uint32_t size)
 {
     dfu_status status;
-    if (0 > dfu_get_status(device, &status)) {
+    if (0 > dfu_poll_status(device, op, size, &status)) {
         printf("dfu_write_flash: dfu_get_status error\n");
-    }
-
-    if (status.bState == STATE_DFU_DOWNLOAD_BUSY) {
-        // printf("dfu_write_flash: not in STATE_DFU_DOWNLOAD_BUSY after "
-        //        "dfu_download\n");
-        if (0 > dfu_get_status(device, &status)) {
-            printf("dfu_write_flash: dfu_get_status error 2\n");
-        }
+        return -4;
     }
 
     if (status.bState == STATE_DFU_ERROR) {
@@ -168,75 +307,114 @@ int32_t dfu_download_check(dfu_device *device)
 }
 
 /*
-        dfu_write_flash() writes (in 2kB pages) the contents of membuf
-        to flash memory. The write begins at the location pointed to by
-        the address pointer (use dfu_set_address_pointer()).
+        dfu_write_block() is the dfu_write_callback of dfu_write_flash(), the
+        blocks are in membuf already.
 */
-int32_t dfu_write_flash(dfu_device *device, uint8_t *membuf, uint32_t length)
+static uint8_t *dfu_write_block(void *arg, uint32_t offset, uint8_t *block,
+                                uint32_t length)
 {
-    int rv;
-    uint8_t finalpage[FLASH_PAGE_BYTES];
+    return &((uint8_t *)arg)[offset];
+}
 
-    // round up the number of writes to the next 2kB page
-    int max_page = ceil((float)length / FLASH_PAGE_BYTES);
+/*
+        dfu_write_flash() writes (in wTransferSize blocks) the contents of
+        membuf to flash memory, starting at address. The sectors being written
+        must already be erased.
+*/
+int32_t dfu_write_flash(dfu_device *device, uint32_t address, uint8_t *membuf,
+                        uint32_t length)
+{
+    return dfu_write_flash_cb(device, address, length, dfu_write_block,
+                              membuf);
+}
 
-    // write all but the final page
-    for (int i = 0; i < (max_page - 1); i++) {
-#if STMDFU_DEBUG_PRINTFS
-        printf("page: <%d>\n", i);
-#endif
-        rv = dfu_download(device, i, &membuf[i * FLASH_PAGE_BYTES],
-                          FLASH_PAGE_BYTES);
-        if (0 > rv) {
-            printf("dfu_write_flash: dfu_download error <%d>\n", rv);
-        } else {
-            rv = dfu_download_check(device);
-        }
+/*
+        dfu_write_flash_cb() writes length bytes to flash memory starting at
+        address, in wTransferSize blocks that callback hands over one at a
+        time. The sectors being written must already be erased.
+*/
+int32_t dfu_write_flash_cb(dfu_device *device, uint32_t address,
+                           uint32_t length, dfu_write_callback callback,
+                           void *arg)
+{
+    int rv = 0;
+    uint8_t *block;
+    uint32_t block_size = device->transfer_size;
+    uint32_t finalsize = block_size;
+    uint32_t max_page = (length + block_size - 1) / block_size;
+    uint32_t offset, size;
+    uint8_t *data;
+    dfu_sector sector;
+
+    if (max_page + DFUSE_FIRST_BLOCK > 0xffff) {
+        printf("dfu_write_flash: %u bytes is too much for one download\n",
+               length);
+        return -1;
+    }
 
-        if (0 > rv) {
-            return rv;
-        }
+    if (0 > dfu_select_region(device, address, length, DFU_SECTOR_WRITEABLE)) {
+        return -1;
     }
 
-    // write the final page
-    // we fill the final page with whatever good data
-    // is left in membuf, and pad it to 2048 with 0xff
-    int finalwrite = length - ((max_page - 1) * FLASH_PAGE_BYTES);
+    // don't let the padding of the final block spill past the region
+    if (max_page &&
+        !dfu_layout_find_sector(device->regions, device->num_regions, address,
+                                &sector)) {
+        uint32_t final_address = address + (max_page - 1) * block_size;
+        uint32_t end = dfu_region_end(sector.region);
 
-    for (int i = 0; i < finalwrite; i++) {
-        finalpage[i] = membuf[((max_page - 1) * FLASH_PAGE_BYTES) + i];
+        if (end - final_address < block_size) {
+            finalsize = end - final_address;
+        }
     }
 
-    for (int i = finalwrite; i < FLASH_PAGE_BYTES; i++) {
-        finalpage[i] = 0xff;
+    if (0 > dfu_set_address_pointer(device, address)) {
+        return -1;
     }
 
+    dfu_make_idle(device, 0);
+
+    block = (uint8_t *)malloc(block_size);
+
+    for (uint32_t i = 0; i < max_page; i++) {
 #if STMDFU_DEBUG_PRINTFS
-    printf("final max_page: <%d>\n", (max_page - 1));
+        printf("page: <%d>\n", i);
 #endif
-    rv = dfu_download(device, (max_page - 1), finalpage, FLASH_PAGE_BYTES);
-    if (0 > rv) {
-        printf("dfu_write_flash: dfu_download error <%d>\n", rv);
-    } else {
-        rv = dfu_download_check(device);
-    }
+        offset = i * block_size;
+        size = length - offset < block_size ? length - offset : block_size;
 
-    if (0 > rv) {
-        return rv;
-    }
+        data = callback(arg, offset, block, size);
+        if (data == NULL) {
+            rv = -1;
+            break;
+        }
 
-    rv = dfu_download(device, max_page, NULL, 0);
-    if (0 > rv) {
-        printf("dfu_write_flash: dfu_download error <%d>\n", rv);
-    } else {
-        rv = dfu_download_check(device);
-    }
+        // we fill the final page with whatever good data
+        // is left, and pad it with 0xff
+        if (size < block_size) {
+            if (data != block) {
+                memcpy(block, data, size);
+            }
+            memset(&block[size], 0xff, finalsize - size);
+            size = finalsize;
+            data = block;
+        }
 
-    if (0 > rv) {
-        return rv;
+        rv = dfu_download(device, DFUSE_FIRST_BLOCK + i, data, size);
+        if (0 > rv) {
+            printf("dfu_write_flash: dfu_download error <%d>\n", rv);
+        } else {
+            rv = dfu_download_check(device, DFU_OP_PROGRAM, size);
+        }
+
+        if (0 > rv) {
+            break;
+        }
     }
 
-    return 0;
+    free(block);
+
+    return rv < 0 ? rv : 0;
 }
 
 /*
@@ -264,19 +442,10 @@ int32_t dfu_set_address_pointer(dfu_device *device, int32_t address)
         printf("dfu_set_address_pointer: dfu_download error <%d>\n", rv);
     }
 
-    if (0 > dfu_get_status(device, &status)) {
+    if (0 > dfu_poll_status(device, DFU_OP_SET_ADDRESS, 0, &status)) {
         printf("dfu_set_address_pointer: dfu_get_status error\n");
     }
 
-    if (status.bState != STATE_DFU_DOWNLOAD_BUSY) {
-        printf(
-            "dfu_set_address_pointer: wrong state after submitting address\n");
-    }
-
-    if (0 > dfu_get_status(device, &status)) {
-        printf("dfu_set_address_pointer: dfu_get_status error 2\n");
-    }
-
     if ((status.bState != STATE_DFU_ERROR) &&
         (status.bStatus != DFU_STATUS_ERROR_TARGET)) {
         // success
@@ -288,15 +457,29 @@ int32_t dfu_set_address_pointer(dfu_device *device, int32_t address)
 }
 
 /*
-        dfu_erase() erases a single page (2kB) of flash memory. The page that
-        address belongs to is the page that is erased.
+        dfu_erase() erases a single sector of flash memory. The sector that
+        address belongs to (according to the device's layout) is the sector
+        that is erased.
 */
 int32_t dfu_erase(dfu_device *device, int32_t address)
 {
     uint8_t command[5] = {0x41, 0, 0, 0, 0};
-    dfu_status status;
+    dfu_sector sector;
     int i;
 
+    if (0 > dfu_get_sector(device, address, &sector)) {
+        printf("dfu_erase: no sector at 0x%.8x\n", address);
+        return -1;
+    }
+
+    if (0 > dfu_select_region(device, sector.address, sector.size,
+                              DFU_SECTOR_ERASABLE)) {
+        return -1;
+    }
+
+    // the bootloader wants the start address of the sector
+    address = sector.address;
+
     uint8_t *addr = (uint8_t *)&address;
 
     for (i = 0; i < 4; i++) {
@@ -307,46 +490,225 @@ int32_t dfu_erase(dfu_device *device, int32_t address)
         printf("dfu_erase: dfu_download error\n");
     }
 
-    if (0 > dfu_get_status(device, &status)) {
-        printf("dfu_erase: dfu_get_status error\n");
+    // wait for the erase to finish, so the next command isn't refused
+    return dfu_download_check(device, DFU_OP_ERASE, sector.size);
+}
+
+/*
+        dfu_mass_erase() erases all pages of flash memory
+*/
+int32_t dfu_mass_erase(dfu_device *device)
+{
+    uint8_t command[1] = {0x41};
+    dfu_status status;
+
+    if (1 != dfu_download(device, 0, command, 1)) {
+        printf("dfu_erase_mass: dfu_download error\n");
+    }
+
+    // this can take tens of seconds, the poll schedule copes with that
+    if (0 > dfu_poll_status(device, DFU_OP_MASS_ERASE, 0, &status)) {
+        printf("dfu_erase_mass: dfu_get_status error\n");
+        return -1;
     }
 
     if (status.bState == STATE_DFU_ERROR) {
-        if (status.bStatus == DFU_STATUS_ERROR_TARGET) {
-            printf(
-                "dfu_write_flash failed: received address wrong/unsupported\n");
+        printf("dfu_erase_mass failed: %s\n",
+               dfu_status_to_string(status.bStatus));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+        dfu_erase_plan_init() sets up an empty erase plan.
+*/
+void dfu_erase_plan_init(dfu_erase_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*
+        dfu_erase_plan_add() adds the erasable sectors that length bytes at
+        address touch to an erase plan. The sector list is kept sorted, so
+        overlapping or repeated ranges only add each sector once.
+*/
+int32_t dfu_erase_plan_add(dfu_device *device, dfu_erase_plan *plan,
+                           uint32_t address, uint32_t length)
+{
+    dfu_sector sector;
+    uint64_t end = (uint64_t)address + length;
+    uint64_t next;
+    uint32_t i;
+
+    for (next = address; next < end;
+         next = (uint64_t)sector.address + sector.size) {
+        if (0 > dfu_get_sector(device, next, &sector)) {
+            printf("dfu_erase_plan_add: no sector at 0x%.8x\n",
+                   (uint32_t)next);
             return -1;
-        } else if (status.bStatus == DFU_STATUS_ERROR_VENDOR) {
-            printf("dfu_write_flash failed: flash read protection enabled\n");
-            return -2;
-        } else {
-            printf("dfu_write_flash failed: reason unknown\n");
-            return -3;
         }
-    } else {
-        // success
-        return 0;
+
+        if (!(sector.attributes & DFU_SECTOR_ERASABLE)) {
+            continue;
+        }
+
+        // find the place of the sector, from the back since ranges
+        // usually come in ascending order
+        i = plan->num_sectors;
+        while (i > 0 && plan->sectors[i - 1].address > sector.address) {
+            i--;
+        }
+
+        if (i > 0 && plan->sectors[i - 1].address == sector.address) {
+            continue;
+        }
+
+        if (plan->num_sectors == plan->max_sectors) {
+            plan->max_sectors = plan->max_sectors ? plan->max_sectors * 2 : 16;
+            plan->sectors = (dfu_sector *)realloc(
+                plan->sectors, plan->max_sectors * sizeof(dfu_sector));
+        }
+
+        memmove(&plan->sectors[i + 1], &plan->sectors[i],
+                (plan->num_sectors - i) * sizeof(dfu_sector));
+        plan->sectors[i] = sector;
+        plan->num_sectors++;
+        plan->bytes += sector.size;
     }
 
-    return 1;
+    return 0;
 }
 
 /*
-        dfu_mass_erase() erases all pages of flash memory
+        dfu_erase_plan_choose() decides between erasing the sectors of a plan
+        one by one and a mass erase. Erasing sector by sector costs the erase
+        time of the sectors plus a command round trip each, a mass erase
+        costs one erase of the whole flash. Both come from what the device
+        has measured so far in dfu_poll_status(), or typical figures.
 */
-int32_t dfu_mass_erase(dfu_device *device)
+void dfu_erase_plan_choose(dfu_device *device, dfu_erase_plan *plan,
+                           uint32_t coverage)
+{
+    dfu_op_stats *erase = &device->op_stats[DFU_OP_ERASE];
+    dfu_op_stats *mass = &device->op_stats[DFU_OP_MASS_ERASE];
+    dfu_op_stats *command = &device->op_stats[DFU_OP_SET_ADDRESS];
+    uint64_t flash_bytes = 0, covered = 0, sectors = 0;
+    uint64_t us_per_kb, command_us, sector_cost, mass_cost;
+    dfu_region *region;
+    uint32_t i;
+
+    plan->mass_erase = 0;
+
+    region = dfu_layout_find_region(device->regions, device->num_regions,
+                                    "Internal Flash");
+    if (region == NULL) {
+        return;
+    }
+
+    for (i = 0; i < (uint32_t)region->num_runs; i++) {
+        dfu_sector_run *run = &region->runs[i];
+
+        if (run->attributes & DFU_SECTOR_ERASABLE) {
+            flash_bytes += (uint64_t)run->count * run->size;
+        }
+    }
+
+    for (i = 0; i < plan->num_sectors; i++) {
+        if (plan->sectors[i].region == region) {
+            covered += plan->sectors[i].size;
+            sectors++;
+        }
+    }
+
+    if (flash_bytes == 0 || covered * 100 < flash_bytes * coverage) {
+        return;
+    }
+
+    us_per_kb = erase->count ? erase->estimate_us : DFU_ERASE_US_PER_KB;
+    command_us = command->count ? command->total_us / command->count
+                                : DFU_ERASE_COMMAND_US;
+
+    sector_cost = covered / 1024 * us_per_kb + sectors * command_us;
+    mass_cost = mass->count ? mass->total_us / mass->count
+                            : flash_bytes / 1024 * us_per_kb;
+
+    plan->mass_erase = mass_cost < sector_cost;
+}
+
+/*
+        dfu_erase_plan_execute() erases what an erase plan lists, back-to-back.
+        With a mass erase, only the sectors outside the internal flash are
+        left to erase one by one.
+*/
+int32_t dfu_erase_plan_execute(dfu_device *device, dfu_erase_plan *plan)
+{
+    dfu_region *region = NULL;
+    uint32_t i;
+
+    if (plan->mass_erase) {
+        region = dfu_layout_find_region(device->regions, device->num_regions,
+                                        "Internal Flash");
+        if (0 > dfu_select_region(device, dfu_region_start(region), 0, 0) ||
+            0 > dfu_mass_erase(device)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < plan->num_sectors; i++) {
+        if (region != NULL && plan->sectors[i].region == region) {
+            continue;
+        }
+
+        if (0 > dfu_erase(device, plan->sectors[i].address)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+        dfu_erase_plan_free() deallocates the sector list of an erase plan.
+*/
+void dfu_erase_plan_free(dfu_erase_plan *plan)
+{
+    free(plan->sectors);
+    dfu_erase_plan_init(plan);
+}
+
+/*
+        dfu_leave_dfu_mode() tells the bootloader to leave DFU mode and start
+        the application at the beginning of internal flash, by pointing the
+        address pointer there and sending a zero length download.
+*/
+int32_t dfu_leave_dfu_mode(dfu_device *device)
 {
-    uint8_t command[1] = {0x41};
     dfu_status status;
+    uint32_t address = FLASH_START_ADDRESS;
+    int rv;
 
-    if (1 != dfu_download(device, 0, command, 1)) {
-        printf("dfu_erase_mass: dfu_download error\n");
+    dfu_region *region = dfu_layout_find_region(
+        device->regions, device->num_regions, "Internal Flash");
+    if (region != NULL) {
+        address = dfu_region_start(region);
     }
 
-    if (0 > dfu_get_status(device, &status)) {
-        printf("dfu_erase_mass: dfu_get_status error\n");
+    if (0 > dfu_select_region(device, address, 0, 0) ||
+        0 > dfu_set_address_pointer(device, address)) {
+        return -1;
+    }
+
+    rv = dfu_download(device, DFUSE_FIRST_BLOCK, NULL, 0);
+    if (0 > rv) {
+        printf("dfu_leave_dfu_mode: dfu_download error <%d>\n", rv);
+        return rv;
     }
 
+    // the bootloader manifests (and resets) once it has answered this
+    dfu_get_status(device, &status);
+
     return 0;
 }
 
@@ -401,7 +763,7 @@ int32_t dfu_make_idle(dfu_device *device, const int initial_abort)
 
         case STATE_APP_DETACH:
         case STATE_DFU_MANIFEST_WAIT_RESET:
-            libusb_reset_device(device->handle);
+            device->transport->reset(device);
             return 1;
         }
 
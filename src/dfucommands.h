@@ -15,12 +15,57 @@ protocol used in the STM32 Bootloader, AN3156.
 #define __DFU_COMMANDS__
 
 #define OPTION_BYTES_ADDRESS 0x1ffff800
+#define FLASH_START_ADDRESS 0x08000000
+
+/* page size assumed when the device doesn't publish a layout */
 #define FLASH_PAGE_BYTES 1024
 
+/* used when the device doesn't publish a DFU functional descriptor */
+#define DFU_DEFAULT_TRANSFER_SIZE 1024
+
+/*
+DfuSe block numbers 0 and 1 are reserved for commands, data starts at
+block 2. The bootloader reads/writes block n at
+    address pointer + (n - DFUSE_FIRST_BLOCK) * wTransferSize
+*/
+#define DFUSE_FIRST_BLOCK 2
+
+/*
+dfu_select_region() finds the memory region that holds length bytes at
+address, checks that its sectors have the wanted attributes, and switches the
+DFU interface to that region's alternate setting if necessary.
+*/
+int32_t dfu_select_region(dfu_device * device, uint32_t address,
+                          uint32_t length, uint8_t attributes);
+
+/*
+dfu_get_sector() looks up the flash sector that address belongs to.
+Devices that don't publish a layout are assumed to have FLASH_PAGE_BYTES
+pages that allow everything.
+*/
+int32_t dfu_get_sector(dfu_device * device, uint32_t address,
+                       dfu_sector * sector);
+
+/*
+dfu_read_callback is handed every block that dfu_read_flash_cb() reads, with
+its offset from the start of the read. Returning < 0 stops the read.
+*/
+typedef int32_t (*dfu_read_callback)(void *arg, uint32_t offset,
+                                     uint8_t *data, uint32_t length);
+
 /*
-dfu_read_flash() fills membuf with length bytes from flash memory.
+dfu_read_flash() fills membuf with length bytes of memory starting at address.
 */
-int32_t dfu_read_flash(dfu_device * device, uint8_t * membuf, uint32_t length);
+int32_t dfu_read_flash(dfu_device * device, uint32_t address, uint8_t * membuf,
+                       uint32_t length);
+
+/*
+dfu_read_flash_cb() reads length bytes of memory starting at address, and
+hands every block to callback as soon as it has arrived.
+*/
+int32_t dfu_read_flash_cb(dfu_device * device, uint32_t address,
+                          uint32_t length, dfu_read_callback callback,
+                          void * arg);
 
 /*
 dfu_read_optbytes() will fill membuf with the option bytes of
@@ -39,11 +84,31 @@ erase (0x41), read unprotect (0x92))
 int32_t dfu_get(dfu_device * device, uint8_t * data);
 
 /*
-dfu_write_flash() writes (in 2kB pages) the contents of membuf
-to flash memory. The write begins at the location pointed to by
-the address pointer (use dfu_set_address_pointer()).
+dfu_write_flash() writes (in wTransferSize blocks) the contents of membuf
+to flash memory, starting at address. The sectors being written must already
+be erased.
+*/
+int32_t dfu_write_flash(dfu_device * device, uint32_t address, uint8_t * membuf,
+                        uint32_t length);
+
+/*
+dfu_write_callback is asked by dfu_write_flash_cb() for the length bytes of
+the block at offset from the start of the write, just before the block goes
+out. It returns them where they are, or fills block (wTransferSize bytes)
+and returns that. Returning NULL stops the write.
+*/
+typedef uint8_t *(*dfu_write_callback)(void *arg, uint32_t offset,
+                                       uint8_t *block, uint32_t length);
+
+/*
+dfu_write_flash_cb() writes length bytes to flash memory starting at
+address, with one address pointer and one sequence of blocks, and gets the
+data of every block from callback. The sectors being written must already
+be erased.
 */
-int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length);
+int32_t dfu_write_flash_cb(dfu_device * device, uint32_t address,
+                           uint32_t length, dfu_write_callback callback,
+                           void * arg);
 
 /*
 dfu_set_address_pointer() sets the STM32 device's address pointer.
@@ -54,8 +119,16 @@ to where the address pointer points.
 int32_t dfu_set_address_pointer(dfu_device * device, int32_t address);
 
 /*
-dfu_erase() erases a single page (2kB) of flash memory. The page that
-address belongs to is the page that is erased.
+dfu_download_check() waits for a download (data or command) to be processed
+by the bootloader, and reports any error it ran into. op and size tell the
+poll schedule what kind of operation is pending (see dfu_poll_status()).
+*/
+int32_t dfu_download_check(dfu_device * device, int32_t op, uint32_t size);
+
+/*
+dfu_erase() erases a single sector of flash memory. The sector that
+address belongs to (according to the device's layout) is the sector
+that is erased.
 */
 int32_t dfu_erase(dfu_device * device, int32_t address);
 
@@ -64,9 +137,75 @@ dfu_mass_erase() erases all pages of flash memory
 */
 int32_t dfu_mass_erase(dfu_device * device);
 
+/*
+Figures the erase planner uses until it has measured the device itself. They
+are the typical sector erase time of an STM32F4 (~8ms per kB), and the time
+one erase command costs on top of it (download, address and status polls).
+*/
+#define DFU_ERASE_US_PER_KB 8000
+#define DFU_ERASE_COMMAND_US 5000
+
+/*
+A mass erase is only considered when the plan covers at least this share (in
+percent) of the internal flash, since it also wipes everything outside the
+image.
+*/
+#define DFU_MASS_ERASE_COVERAGE 75
+
+/*
+dfu_erase_plan is the list of sectors (sorted, without duplicates) that have
+to be erased before some memory ranges can be programmed, and whether a mass
+erase is the cheaper way to get there.
+*/
+typedef struct {
+    dfu_sector *sectors;
+    uint32_t num_sectors;
+    uint32_t max_sectors;
+    uint32_t bytes;
+    int32_t mass_erase;
+} dfu_erase_plan;
+
+/*
+dfu_erase_plan_init() sets up an empty erase plan.
+*/
+void dfu_erase_plan_init(dfu_erase_plan * plan);
+
+/*
+dfu_erase_plan_add() adds the erasable sectors that length bytes at address
+touch to an erase plan. Sectors that can't be erased (option bytes, OTP) are
+skipped, they are programmed as they are.
+*/
+int32_t dfu_erase_plan_add(dfu_device * device, dfu_erase_plan * plan,
+                           uint32_t address, uint32_t length);
+
+/*
+dfu_erase_plan_choose() decides between erasing the sectors of a plan one by
+one and a mass erase, from the erase times measured on the device (or the
+DFU_ERASE_... figures before there are any). A mass erase is only chosen if
+the plan covers at least coverage percent of the internal flash.
+*/
+void dfu_erase_plan_choose(dfu_device * device, dfu_erase_plan * plan,
+                           uint32_t coverage);
+
+/*
+dfu_erase_plan_execute() erases what an erase plan lists, back-to-back.
+*/
+int32_t dfu_erase_plan_execute(dfu_device * device, dfu_erase_plan * plan);
+
+/*
+dfu_erase_plan_free() deallocates the sector list of an erase plan.
+*/
+void dfu_erase_plan_free(dfu_erase_plan * plan);
+
+/*
+dfu_leave_dfu_mode() tells the bootloader to leave DFU mode and start
+the application at the beginning of internal flash, by pointing the
+address pointer there and sending a zero length download.
+*/
+int32_t dfu_leave_dfu_mode(dfu_device * device);
+
 /* unimplemented :
 int32_t dfu_read_unprotect(dfu_device * device);
-int32_t dfu_leave_dfu_mode(dfu_device * device);
 */
 
 /*
@@ -0,0 +1,443 @@
+/*
+dfuimage.{c,h} :
+Turns the files a firmware build produces into a dfuse file in memory, so
+that they can be flashed without being converted to a .dfu first. Besides
+dfuse files it reads Intel HEX, raw binaries (at a base address) and ELF
+executables (their PT_LOAD segments, at their load addresses).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "dfuse.h"
+#include "ihex.h"
+#include "dfuimage.h"
+
+enum { DFUIMAGE_DFUSE, DFUIMAGE_HEX, DFUIMAGE_BIN, DFUIMAGE_ELF };
+
+/*
+        one PT_LOAD segment of an ELF file: where it goes, and where its
+        data is in the file.
+*/
+typedef struct {
+    uint32_t address;
+    uint32_t offset;
+    uint32_t size;
+} dfuimage_segment;
+
+/*
+        dfuimage_map() maps the whole file at path read only. Returns NULL
+        (and says why) if it can't, or the file is empty or over 4GB.
+*/
+static uint8_t *dfuimage_map(const char *path, uint32_t *size)
+{
+    struct stat stat;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &stat)) {
+        printf("error opening <%s>\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    if (stat.st_size == 0 || stat.st_size > UINT32_MAX) {
+        printf("<%s> is %s\n", path, stat.st_size ? "too long" : "empty");
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("error mapping <%s>\n", path);
+        return NULL;
+    }
+
+    *size = stat.st_size;
+
+    return (uint8_t *)map;
+}
+
+/*
+        dfuimage_new() is an empty dfuse file with one image, named after
+        the file without its directory.
+*/
+static dfuse_file *dfuimage_new(const char *path, dfuse_image **image)
+{
+    dfuse_file *dfusefile = dfuse_init(0xffff, 0x0483, 0xdf11);
+    const char *name = strrchr(path, '/');
+    char target_name[255];
+
+    snprintf(target_name, sizeof(target_name), "%s",
+             name != NULL ? name + 1 : path);
+    *image = dfuse_addimage(dfusefile, target_name, 0);
+
+    return dfusefile;
+}
+
+/*
+        dfuimage_format() tells the format from the extension of path, and
+        if there isn't one it knows, from the first bytes of the file.
+        Returns -1 if it can't tell.
+*/
+static int dfuimage_format(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    uint8_t head[5] = { 0 };
+    int fd;
+
+    if (ext != NULL && strchr(ext, '/') == NULL) {
+        if (!strcasecmp(ext, ".dfu"))
+            return DFUIMAGE_DFUSE;
+        if (!strcasecmp(ext, ".hex") || !strcasecmp(ext, ".ihex"))
+            return DFUIMAGE_HEX;
+        if (!strcasecmp(ext, ".bin"))
+            return DFUIMAGE_BIN;
+        if (!strcasecmp(ext, ".elf"))
+            return DFUIMAGE_ELF;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening <%s>\n", path);
+        return -1;
+    }
+    if (read(fd, head, sizeof(head)) < 1) {
+        head[0] = 0;
+    }
+    close(fd);
+
+    if (!memcmp(head, "DfuSe", 5))
+        return DFUIMAGE_DFUSE;
+    if (!memcmp(head, ELFMAG, SELFMAG))
+        return DFUIMAGE_ELF;
+    if (head[0] == ':')
+        return DFUIMAGE_HEX;
+
+    printf("can't tell what <%s> is, name it .dfu, .hex, .bin or .elf\n",
+           path);
+
+    return -1;
+}
+
+/*
+        dfuimage_bin() makes a raw binary one element at address, straight
+        from the mapping.
+*/
+static dfuse_file *dfuimage_bin(const char *path, uint32_t address)
+{
+    dfuse_file *dfusefile;
+    dfuse_image *image;
+    uint8_t *map;
+    uint32_t size;
+
+    map = dfuimage_map(path, &size);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    if ((uint64_t)address + size > 0x100000000ULL) {
+        printf("<%s> doesn't fit above 0x%.8x\n", path, address);
+        munmap(map, size);
+        return NULL;
+    }
+
+    dfusefile = dfuimage_new(path, &image);
+    dfusefile->mapping = map;
+    dfusefile->mapping_size = size;
+    dfuse_addelement_view(dfusefile, image, address, size, map);
+
+    return dfusefile;
+}
+
+/*
+        dfuimage_hex() decodes an Intel HEX file the way hex2dfu does: its
+        extents are laid out in regions, and each region is an element.
+*/
+static dfuse_file *dfuimage_hex(const char *path)
+{
+    dfuse_file *dfusefile;
+    dfuse_image *image;
+    dfuse_image_element *el;
+    ihex_file hex;
+    ihex_region *regions;
+    int32_t num_regions, i, rv;
+    int overlaps;
+
+    if (ihex_open(&hex, path) < 0) {
+        return NULL;
+    }
+
+    num_regions = ihex_plan(&hex, 1, IHEX_MAX_GAP, 0, &overlaps, &regions);
+    if (num_regions <= 0) {
+        if (num_regions == 0) {
+            printf("<%s> has no data\n", path);
+        }
+        ihex_close(&hex);
+        return NULL;
+    }
+
+    dfusefile = dfuimage_new(path, &image);
+    for (i = 0, rv = 0; i < num_regions; i++) {
+        el = dfuse_addelement(dfusefile, image, regions[i].address,
+                              regions[i].size);
+        if (el == NULL) {
+            printf("out of memory for <%s>\n", path);
+            rv = -1;
+            break;
+        }
+        memset(el->data, 0xff, regions[i].size);
+        regions[i].data = el->data;
+    }
+
+    if (rv == 0) {
+        rv = ihex_decode(&hex, regions, num_regions);
+    }
+
+    free(regions);
+    ihex_close(&hex);
+
+    if (rv < 0) {
+        dfuse_struct_cleanup(dfusefile);
+        return NULL;
+    }
+
+    return dfusefile;
+}
+
+static int dfuimage_segment_cmp(const void *a, const void *b)
+{
+    const dfuimage_segment *x = (const dfuimage_segment *)a;
+    const dfuimage_segment *y = (const dfuimage_segment *)b;
+
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+        dfuimage_elf_segments() finds the PT_LOAD segments of an ELF file
+        that have data in the file. The load (physical) address is where a
+        segment is flashed, .data is kept in flash and copied to ram at
+        startup. What is only in memory (.bss) isn't flashed. Returns the
+        number of segments, or -1 with the reason in *error.
+*/
+static int dfuimage_elf_segments(const uint8_t *map, uint32_t size,
+                                 dfuimage_segment *segments,
+                                 const char **error)
+{
+    uint64_t phoff, offset, filesz, paddr;
+    uint32_t phentsize, phnum, type, i;
+    int n = 0, is64;
+
+    if (size < EI_NIDENT || memcmp(map, ELFMAG, SELFMAG)) {
+        *error = "no ELF header";
+        return -1;
+    }
+    if (map[EI_CLASS] != ELFCLASS32 && map[EI_CLASS] != ELFCLASS64) {
+        *error = "unknown ELF class";
+        return -1;
+    }
+    if (map[EI_DATA] != ELFDATA2LSB) {
+        *error = "not little endian";
+        return -1;
+    }
+    is64 = map[EI_CLASS] == ELFCLASS64;
+
+    if (is64) {
+        Elf64_Ehdr ehdr;
+
+        if (size < sizeof(ehdr)) {
+            *error = "ELF header cut short";
+            return -1;
+        }
+        memcpy(&ehdr, map, sizeof(ehdr));
+        phoff = ehdr.e_phoff;
+        phentsize = ehdr.e_phentsize;
+        phnum = ehdr.e_phnum;
+        if (phnum && phentsize < sizeof(Elf64_Phdr)) {
+            *error = "bad program header size";
+            return -1;
+        }
+    } else {
+        Elf32_Ehdr ehdr;
+
+        if (size < sizeof(ehdr)) {
+            *error = "ELF header cut short";
+            return -1;
+        }
+        memcpy(&ehdr, map, sizeof(ehdr));
+        phoff = ehdr.e_phoff;
+        phentsize = ehdr.e_phentsize;
+        phnum = ehdr.e_phnum;
+        if (phnum && phentsize < sizeof(Elf32_Phdr)) {
+            *error = "bad program header size";
+            return -1;
+        }
+    }
+
+    if (phoff > size || (uint64_t)phnum * phentsize > size - phoff) {
+        *error = "program headers past the end of the file";
+        return -1;
+    }
+
+    for (i = 0; i < phnum; i++) {
+        const uint8_t *ph = &map[phoff + (uint64_t)i * phentsize];
+
+        if (is64) {
+            Elf64_Phdr phdr;
+
+            memcpy(&phdr, ph, sizeof(phdr));
+            type = phdr.p_type;
+            offset = phdr.p_offset;
+            filesz = phdr.p_filesz;
+            paddr = phdr.p_paddr;
+        } else {
+            Elf32_Phdr phdr;
+
+            memcpy(&phdr, ph, sizeof(phdr));
+            type = phdr.p_type;
+            offset = phdr.p_offset;
+            filesz = phdr.p_filesz;
+            paddr = phdr.p_paddr;
+        }
+
+        if (type != PT_LOAD || filesz == 0) {
+            continue;
+        }
+        if (offset > size || filesz > size - offset) {
+            *error = "segment past the end of the file";
+            return -1;
+        }
+        if (paddr + filesz > 0x100000000ULL) {
+            *error = "segment past 4GB";
+            return -1;
+        }
+        if (n == DFUIMAGE_MAX_SEGMENTS) {
+            *error = "too many segments";
+            return -1;
+        }
+
+        segments[n].address = paddr;
+        segments[n].offset = offset;
+        segments[n].size = filesz;
+        n++;
+    }
+
+    qsort(segments, n, sizeof(dfuimage_segment), dfuimage_segment_cmp);
+    for (i = 1; i < n; i++) {
+        if (segments[i].address <
+            (uint64_t)segments[i - 1].address + segments[i - 1].size) {
+            *error = "segments overlap";
+            return -1;
+        }
+    }
+    if (n == 0) {
+        *error = "no loadable data";
+        return -1;
+    }
+
+    return n;
+}
+
+/*
+        dfuimage_elf() makes every PT_LOAD segment with data an element,
+        sorted by address, straight from the mapping.
+*/
+static dfuse_file *dfuimage_elf(const char *path)
+{
+    dfuimage_segment segments[DFUIMAGE_MAX_SEGMENTS];
+    dfuse_file *dfusefile;
+    dfuse_image *image;
+    const char *error;
+    uint8_t *map;
+    uint32_t size;
+    int i, n;
+
+    map = dfuimage_map(path, &size);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    n = dfuimage_elf_segments(map, size, segments, &error);
+    if (n < 0) {
+        printf("<%s> isn't a sound ELF file: %s\n", path, error);
+        munmap(map, size);
+        return NULL;
+    }
+
+    dfusefile = dfuimage_new(path, &image);
+    dfusefile->mapping = map;
+    dfusefile->mapping_size = size;
+    for (i = 0; i < n; i++) {
+        dfuse_addelement_view(dfusefile, image, segments[i].address,
+                              segments[i].size, &map[segments[i].offset]);
+    }
+
+    return dfusefile;
+}
+
+/*
+        dfuimage_load() splits off the @address of a binary, and reads the
+        file by its format.
+*/
+dfuse_file *dfuimage_load(const char *file)
+{
+    dfuse_file *dfusefile = NULL;
+    uint32_t address = DFUIMAGE_BIN_ADDRESS;
+    const char *at = strrchr(file, '@');
+    char *path = strdup(file);
+    char *end;
+    int format, based = 0;
+
+    // fw.bin@0x08004000, as long as what follows the @ is a number
+    if (at != NULL && at[1] != 0 && access(file, F_OK)) {
+        address = strtoul(at + 1, &end, 0);
+        if (*end == 0) {
+            path[at - file] = 0;
+            based = 1;
+        } else {
+            address = DFUIMAGE_BIN_ADDRESS;
+        }
+    }
+
+    format = dfuimage_format(path);
+    if (based && format >= 0 && format != DFUIMAGE_BIN) {
+        printf("only a raw binary takes an @address, <%s> has addresses "
+               "of its own\n", path);
+        format = -1;
+    }
+
+    switch (format) {
+    case DFUIMAGE_DFUSE:
+        dfusefile = dfuse_map(path);
+        break;
+    case DFUIMAGE_HEX:
+        dfusefile = dfuimage_hex(path);
+        break;
+    case DFUIMAGE_BIN:
+        dfusefile = dfuimage_bin(path, address);
+        break;
+    case DFUIMAGE_ELF:
+        dfusefile = dfuimage_elf(path);
+        break;
+    }
+
+    free(path);
+
+    return dfusefile;
+}
@@ -0,0 +1,28 @@
+/*
+dfuimage.{c,h} :
+Turns the files a firmware build produces into a dfuse file in memory, so
+that they can be flashed without being converted to a .dfu first. Besides
+dfuse files it reads Intel HEX, raw binaries (at a base address) and ELF
+executables (their PT_LOAD segments, at their load addresses).
+*/
+
+#ifndef __DFU_DFUIMAGE__
+#define __DFU_DFUIMAGE__
+
+/* where a raw binary goes if no address is given: the start of flash */
+#define DFUIMAGE_BIN_ADDRESS 0x08000000
+
+/* the most PT_LOAD segments an ELF file may have */
+#define DFUIMAGE_MAX_SEGMENTS 64
+
+/*
+dfuimage_load() reads file into a dfuse file in memory, with one image
+(alternate setting 0) that is named after the file. The format comes
+from the extension (.dfu, .hex/.ihex, .bin, .elf), or else from the
+content. A raw binary goes to DFUIMAGE_BIN_ADDRESS, or to the address
+after an @ (fw.bin@0x08004000). The data of binaries, ELF and dfuse files
+stays in a read only mapping of the file. Returns NULL, and says why, if
+the file can't be read or is broken.
+*/
+dfuse_file *dfuimage_load(const char *file);
+#endif
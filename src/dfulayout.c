@@ -0,0 +1,201 @@
+/*
+dfulayout.{c,h} :
+Parses the memory layout that STM's DfuSe bootloader publishes in the string
+descriptor of every DFU alternate setting, e.g.
+
+    @Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg
+
+into a table of memory regions and sector runs. The table lets the DFU commands
+size and align reads, writes and erases to the real sector geometry of the
+attached chip instead of assuming 1kB pages everywhere.
+
+More information on the layout string is available in the application note USB
+DFU protocol used in the STM32 Bootloader, AN3156.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dfulayout.h"
+
+/*
+        dfu_layout_parse() parses one DfuSe layout string into region. Returns
+        0 on success, or < 0 if the string isn't a DfuSe layout.
+*/
+int32_t dfu_layout_parse(dfu_region *region, const char *desc,
+                         uint8_t alt_setting)
+{
+    const char *p;
+    char *end;
+    int len;
+
+    memset(region, 0, sizeof(*region));
+    region->alt_setting = alt_setting;
+
+    if (desc[0] != '@') {
+        return -1;
+    }
+
+    // the name runs up to the first '/', minus any padding spaces
+    p = strchr(desc, '/');
+    if (p == NULL) {
+        return -1;
+    }
+
+    len = p - (desc + 1);
+    while (len > 0 && desc[len] == ' ') {
+        len--;
+    }
+    if (len >= DFU_REGION_NAME_LEN) {
+        len = DFU_REGION_NAME_LEN - 1;
+    }
+    memcpy(region->name, desc + 1, len);
+
+    // one or more "/<address>/<count>*<size><unit><attributes>,..." segments
+    while (*p == '/') {
+        uint32_t address = strtoul(p + 1, &end, 16);
+        if (end == p + 1 || *end != '/') {
+            return -2;
+        }
+        p = end;
+
+        do {
+            dfu_sector_run *run;
+            uint32_t count, size;
+
+            count = strtoul(p + 1, &end, 10);
+            if (end == p + 1 || *end != '*') {
+                return -3;
+            }
+            p = end + 1;
+
+            size = strtoul(p, &end, 10);
+            if (end == p) {
+                return -3;
+            }
+            p = end;
+
+            switch (*p) {
+            case 'M':
+                size *= 1024;
+                // fall through
+            case 'K':
+                size *= 1024;
+                // fall through
+            case 'B':
+            case ' ':
+                p++;
+                break;
+            }
+
+            if (*p < 'a' || *p > 'g') {
+                return -4;
+            }
+
+            if (region->num_runs == DFU_MAX_SECTOR_RUNS) {
+                return -5;
+            }
+
+            run = &region->runs[region->num_runs++];
+            run->address = address;
+            run->count = count;
+            run->size = size;
+            run->attributes = *p - 'a' + 1;
+
+            address += count * size;
+            p++;
+        } while (*p == ',');
+    }
+
+    if (region->num_runs == 0) {
+        return -6;
+    }
+
+    return 0;
+}
+
+/*
+        dfu_layout_find_sector() looks up the sector that address belongs to.
+        Returns 0 and fills sector on success, or -1 if no region covers
+        address.
+*/
+int32_t dfu_layout_find_sector(dfu_region *regions, int32_t num_regions,
+                               uint32_t address, dfu_sector *sector)
+{
+    int i, j;
+
+    for (i = 0; i < num_regions; i++) {
+        for (j = 0; j < regions[i].num_runs; j++) {
+            dfu_sector_run *run = &regions[i].runs[j];
+            uint32_t offset = address - run->address;
+
+            if (address >= run->address &&
+                offset < (uint64_t)run->count * run->size) {
+                sector->address = run->address + offset / run->size * run->size;
+                sector->size = run->size;
+                sector->attributes = run->attributes;
+                sector->region = &regions[i];
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+        dfu_layout_find_region() looks up a region by (the start of) its name.
+        Returns NULL if there is no such region.
+*/
+dfu_region *dfu_layout_find_region(dfu_region *regions, int32_t num_regions,
+                                   const char *name)
+{
+    int i;
+
+    for (i = 0; i < num_regions; i++) {
+        if (!strncmp(regions[i].name, name, strlen(name))) {
+            return &regions[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+        dfu_region_start() and dfu_region_end() return the first address of a
+        region, and the first address after it.
+*/
+uint32_t dfu_region_start(dfu_region *region)
+{
+    return region->runs[0].address;
+}
+
+uint32_t dfu_region_end(dfu_region *region)
+{
+    dfu_sector_run *last = &region->runs[region->num_runs - 1];
+
+    return last->address + last->count * last->size;
+}
+
+/*
+        dfu_layout_print() prints the region/sector table in a human readable
+        form.
+*/
+void dfu_layout_print(dfu_region *regions, int32_t num_regions)
+{
+    int i, j;
+
+    for (i = 0; i < num_regions; i++) {
+        printf("alt %d: %s\n", regions[i].alt_setting, regions[i].name);
+        for (j = 0; j < regions[i].num_runs; j++) {
+            dfu_sector_run *run = &regions[i].runs[j];
+            printf("    0x%.8x - 0x%.8x  %3u x %7u bytes  %c%c%c\n",
+                   run->address, run->address + run->count * run->size,
+                   run->count, run->size,
+                   (run->attributes & DFU_SECTOR_READABLE) ? 'r' : '-',
+                   (run->attributes & DFU_SECTOR_ERASABLE) ? 'e' : '-',
+                   (run->attributes & DFU_SECTOR_WRITEABLE) ? 'w' : '-');
+        }
+    }
+}
@@ -0,0 +1,94 @@
+/*
+dfulayout.{c,h} :
+Parses the memory layout that STM's DfuSe bootloader publishes in the string
+descriptor of every DFU alternate setting, e.g.
+
+    @Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg
+
+into a table of memory regions and sector runs. The table lets the DFU commands
+size and align reads, writes and erases to the real sector geometry of the
+attached chip instead of assuming 1kB pages everywhere.
+
+More information on the layout string is available in the application note USB
+DFU protocol used in the STM32 Bootloader, AN3156.
+*/
+
+#ifndef __DFU_LAYOUT__
+#define __DFU_LAYOUT__
+
+#define DFU_MAX_REGIONS 8
+#define DFU_MAX_SECTOR_RUNS 16
+#define DFU_REGION_NAME_LEN 64
+
+/*
+Sector attributes. The letter that ends each sector run in the layout string
+encodes these bits as 'a' + (attributes - 1).
+*/
+#define DFU_SECTOR_READABLE 0x01
+#define DFU_SECTOR_ERASABLE 0x02
+#define DFU_SECTOR_WRITEABLE 0x04
+
+/*
+a run of count equally sized sectors starting at address
+*/
+typedef struct {
+    uint32_t address;
+    uint32_t count;
+    uint32_t size;
+    uint8_t attributes;
+} dfu_sector_run;
+
+/*
+one memory region (internal flash, option bytes, OTP, ...) as published by
+one alternate setting of the DFU interface
+*/
+typedef struct {
+    char name[DFU_REGION_NAME_LEN];
+    uint8_t alt_setting;
+    int32_t num_runs;
+    dfu_sector_run runs[DFU_MAX_SECTOR_RUNS];
+} dfu_region;
+
+/*
+a single sector, as returned by dfu_layout_find_sector()
+*/
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    uint8_t attributes;
+    dfu_region *region;
+} dfu_sector;
+
+/*
+dfu_layout_parse() parses one DfuSe layout string into region. Returns 0 on
+success, or < 0 if the string isn't a DfuSe layout.
+*/
+int32_t dfu_layout_parse(dfu_region *region, const char *desc,
+                         uint8_t alt_setting);
+
+/*
+dfu_layout_find_sector() looks up the sector that address belongs to.
+Returns 0 and fills sector on success, or -1 if no region covers address.
+*/
+int32_t dfu_layout_find_sector(dfu_region *regions, int32_t num_regions,
+                               uint32_t address, dfu_sector *sector);
+
+/*
+dfu_layout_find_region() looks up a region by (the start of) its name.
+Returns NULL if there is no such region.
+*/
+dfu_region *dfu_layout_find_region(dfu_region *regions, int32_t num_regions,
+                                   const char *name);
+
+/*
+dfu_region_start() and dfu_region_end() return the first address of a region,
+and the first address after it.
+*/
+uint32_t dfu_region_start(dfu_region *region);
+uint32_t dfu_region_end(dfu_region *region);
+
+/*
+dfu_layout_print() prints the region/sector table in a human readable form.
+*/
+void dfu_layout_print(dfu_region *regions, int32_t num_regions);
+#endif
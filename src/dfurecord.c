@@ -0,0 +1,516 @@
+/*
+dfurecord.{c,h} :
+Records every request a dfu device is sent (control transfers, alternate
+setting changes and resets) together with its answer and timing into a
+session file, and plays a session file back as a transport. The replay
+checks that the host makes exactly the same requests, in the same order and
+with the same data, so that captures from real chips can be kept and run
+without the hardware to catch extra round trips and host side slowdowns.
+
+A session file is the magic, the transfer size, path and memory layout of
+the device, then one entry per request, little endian, ending with an END
+entry.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <libusb-1.0/libusb.h>
+#include "dfulayout.h"
+#include "dfurequests.h"
+#include "crc32.h"
+#include "dfurecord.h"
+
+static void put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = value >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+    put16(p, value & 0xffff);
+    put16(p + 2, value >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t dfurecord_diff_us(const struct timespec *end,
+                                  const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000LL +
+           (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+        dfurecord_write_entry() appends one entry, and the answer of an IN
+        transfer, to the session file.
+*/
+static void dfurecord_write_entry(dfurecord_session *session,
+                                  dfurecord_entry *entry)
+{
+    uint8_t buf[DFURECORD_ENTRY_LEN];
+
+    buf[0] = entry->kind;
+    buf[1] = entry->request_type;
+    buf[2] = entry->request;
+    buf[3] = 0;
+    put16(&buf[4], entry->wvalue);
+    put16(&buf[6], entry->length);
+    put32(&buf[8], entry->result);
+    put32(&buf[12], entry->duration_us);
+    put32(&buf[16], entry->gap_us);
+    put32(&buf[20], entry->crc);
+
+    fwrite(buf, 1, sizeof(buf), session->file);
+    if (entry->data != NULL) {
+        fwrite(entry->data, 1, entry->result, session->file);
+    }
+}
+
+/*
+        dfurecord_entry_differs() prints what the host did differently from
+        the recording.
+*/
+static int dfurecord_entry_differs(dfurecord_session *session,
+                                   dfurecord_entry *expected,
+                                   dfurecord_entry *got)
+{
+    if (expected != NULL && expected->kind == got->kind &&
+        expected->request_type == got->request_type &&
+        expected->request == got->request &&
+        expected->wvalue == got->wvalue && expected->length == got->length &&
+        expected->crc == got->crc) {
+        return 0;
+    }
+
+    printf("replay: request %u ", session->next + 1);
+    if (expected == NULL) {
+        printf("wasn't recorded");
+    } else {
+        printf("differs, recorded kind %u request %u wValue %u length %u",
+               expected->kind, expected->request, expected->wvalue,
+               expected->length);
+    }
+    printf(", got kind %u request %u wValue %u length %u%s\n", got->kind,
+           got->request, got->wvalue, got->length,
+           expected != NULL && expected->crc != got->crc &&
+                   expected->length == got->length ?
+               " (other data)" :
+               "");
+
+    session->diverged = 1;
+
+    return 1;
+}
+
+/*
+        dfurecord_request() handles one request of any kind. When recording
+        it is passed on to the device and written down, when replaying it is
+        checked against the recording and answered from it, after as long as
+        the device took.
+*/
+static int32_t dfurecord_request(dfu_device *device, dfurecord_entry *got,
+                                 uint8_t *data)
+{
+    dfurecord_session *session = (dfurecord_session *)device->transport_data;
+    dfurecord_entry *expected = NULL;
+    struct timespec now;
+    int32_t rv;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    got->gap_us = dfurecord_diff_us(&now, &session->last);
+
+    if (!(got->request_type & LIBUSB_ENDPOINT_IN) && got->length) {
+        got->crc = crc32_update(0, data, got->length);
+    }
+
+    if (session->replay) {
+        if (!session->diverged && session->next < session->num_entries) {
+            expected = &session->entries[session->next];
+        }
+        if (session->diverged ||
+            dfurecord_entry_differs(session, expected, got)) {
+            return LIBUSB_ERROR_IO;
+        }
+
+        session->next++;
+        if (expected->duration_us) {
+            struct timespec ts = {expected->duration_us / 1000000,
+                                  (expected->duration_us % 1000000) * 1000};
+            nanosleep(&ts, NULL);
+        }
+        rv = expected->result;
+        if (expected->data != NULL) {
+            memcpy(data, expected->data, rv);
+        }
+    } else {
+        device->transport = session->transport;
+        device->transport_data = session->transport_data;
+
+        if (got->kind == DFURECORD_ALTSETTING) {
+            rv = device->transport->set_altsetting(device, got->wvalue);
+        } else if (got->kind == DFURECORD_RESET) {
+            rv = device->transport->reset(device);
+        } else {
+            rv = device->transport->control(device, got->request_type,
+                                            got->request, got->wvalue, data,
+                                            got->length, DFU_TIMEOUT);
+        }
+
+        device->transport = &dfurecord_transport;
+        device->transport_data = session;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &session->last);
+    got->duration_us = dfurecord_diff_us(&session->last, &now);
+    session->bus_us += got->duration_us;
+
+    if (!session->replay) {
+        got->result = rv;
+        if ((got->request_type & LIBUSB_ENDPOINT_IN) && rv > 0) {
+            got->data = data;
+        }
+        dfurecord_write_entry(session, got);
+        session->next++;
+    }
+
+    return rv;
+}
+
+static int32_t dfurecord_control(dfu_device *device, uint8_t request_type,
+                                 uint8_t request, uint16_t wvalue,
+                                 uint8_t *data, uint16_t length,
+                                 uint32_t timeout)
+{
+    dfurecord_entry entry = {DFURECORD_CONTROL, request_type, request, wvalue,
+                             length};
+
+    (void)timeout;
+
+    return dfurecord_request(device, &entry, data);
+}
+
+static int32_t dfurecord_set_altsetting(dfu_device *device,
+                                        int32_t altsetting)
+{
+    dfurecord_entry entry = {DFURECORD_ALTSETTING, 0, 0, altsetting};
+
+    return dfurecord_request(device, &entry, NULL);
+}
+
+static int32_t dfurecord_reset(dfu_device *device)
+{
+    dfurecord_entry entry = {DFURECORD_RESET};
+
+    return dfurecord_request(device, &entry, NULL);
+}
+
+static void dfurecord_close(dfu_device *device)
+{
+    dfurecord_session *session = (dfurecord_session *)device->transport_data;
+
+    if (session->replay) {
+        free(session->entries);
+        free(session->buf);
+        free(session);
+        return;
+    }
+
+    // stopping the recording puts the real transport back
+    dfurecord_finish(device);
+    device->transport->close(device);
+}
+
+const dfu_transport dfurecord_transport = {
+    "record", dfurecord_control, dfurecord_set_altsetting, dfurecord_reset,
+    dfurecord_close};
+
+const dfu_transport dfurecord_replay_transport = {
+    "replay", dfurecord_control, dfurecord_set_altsetting, dfurecord_reset,
+    dfurecord_close};
+
+/*
+        dfurecord_start() writes the header of the session file and puts the
+        recorder in front of the device's transport.
+*/
+int32_t dfurecord_start(dfu_device *device, const char *path)
+{
+    dfurecord_session *session;
+    uint8_t buf[DFU_REGION_NAME_LEN + 2];
+    int32_t i, j;
+
+    session = (dfurecord_session *)calloc(1, sizeof(dfurecord_session));
+    session->file = fopen(path, "wb");
+    if (session->file == NULL) {
+        printf("can't create <%s>\n", path);
+        free(session);
+        return -1;
+    }
+    snprintf(session->path, sizeof(session->path), "%s", path);
+
+    fwrite(DFURECORD_MAGIC, 1, DFURECORD_MAGIC_LEN, session->file);
+    put16(&buf[0], device->transfer_size);
+    put16(&buf[2], device->num_regions);
+    fwrite(buf, 1, 4, session->file);
+    fwrite(device->path, 1, sizeof(device->path), session->file);
+
+    for (i = 0; i < device->num_regions; i++) {
+        dfu_region *region = &device->regions[i];
+
+        memcpy(buf, region->name, DFU_REGION_NAME_LEN);
+        buf[DFU_REGION_NAME_LEN] = region->alt_setting;
+        buf[DFU_REGION_NAME_LEN + 1] = region->num_runs;
+        fwrite(buf, 1, DFU_REGION_NAME_LEN + 2, session->file);
+
+        for (j = 0; j < region->num_runs; j++) {
+            put32(&buf[0], region->runs[j].address);
+            put32(&buf[4], region->runs[j].count);
+            put32(&buf[8], region->runs[j].size);
+            buf[12] = region->runs[j].attributes;
+            fwrite(buf, 1, 13, session->file);
+        }
+    }
+
+    session->transport = device->transport;
+    session->transport_data = device->transport_data;
+    clock_gettime(CLOCK_MONOTONIC, &session->start);
+    session->last = session->start;
+
+    device->transport = &dfurecord_transport;
+    device->transport_data = session;
+
+    return 0;
+}
+
+/*
+        dfurecord_parse() reads the header and the entries of a session file
+        that has been loaded into session->buf. Returns < 0 if it isn't one.
+*/
+static int32_t dfurecord_parse(dfurecord_session *session, long size,
+                               dfu_device *device)
+{
+    uint8_t *p = session->buf;
+    uint8_t *end = session->buf + size;
+    dfurecord_entry entry;
+    int32_t i, j;
+
+    if (size < DFURECORD_MAGIC_LEN + 4 + (long)sizeof(device->path) ||
+        memcmp(p, DFURECORD_MAGIC, DFURECORD_MAGIC_LEN)) {
+        return -1;
+    }
+    p += DFURECORD_MAGIC_LEN;
+
+    device->transfer_size = get16(p);
+    device->num_regions = get16(p + 2);
+    p += 4;
+    memcpy(device->path, p, sizeof(device->path));
+    device->path[sizeof(device->path) - 1] = 0;
+    p += sizeof(device->path);
+
+    if (device->num_regions > DFU_MAX_REGIONS) {
+        return -1;
+    }
+
+    for (i = 0; i < device->num_regions; i++) {
+        dfu_region *region = &device->regions[i];
+
+        if (end - p < DFU_REGION_NAME_LEN + 2) {
+            return -1;
+        }
+        memcpy(region->name, p, DFU_REGION_NAME_LEN);
+        region->name[DFU_REGION_NAME_LEN - 1] = 0;
+        region->alt_setting = p[DFU_REGION_NAME_LEN];
+        region->num_runs = p[DFU_REGION_NAME_LEN + 1];
+        p += DFU_REGION_NAME_LEN + 2;
+
+        if (region->num_runs > DFU_MAX_SECTOR_RUNS ||
+            end - p < region->num_runs * 13) {
+            return -1;
+        }
+        for (j = 0; j < region->num_runs; j++) {
+            region->runs[j].address = get32(p);
+            region->runs[j].count = get32(p + 4);
+            region->runs[j].size = get32(p + 8);
+            region->runs[j].attributes = p[12];
+            p += 13;
+        }
+    }
+
+    for (;;) {
+        if (end - p < DFURECORD_ENTRY_LEN) {
+            return -1;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.kind = p[0];
+        entry.request_type = p[1];
+        entry.request = p[2];
+        entry.wvalue = get16(&p[4]);
+        entry.length = get16(&p[6]);
+        entry.result = get32(&p[8]);
+        entry.duration_us = get32(&p[12]);
+        entry.gap_us = get32(&p[16]);
+        entry.crc = get32(&p[20]);
+        p += DFURECORD_ENTRY_LEN;
+
+        if (entry.kind == DFURECORD_END) {
+            session->end = entry;
+            return 0;
+        }
+
+        if ((entry.request_type & LIBUSB_ENDPOINT_IN) && entry.result > 0) {
+            if (entry.result > entry.length || end - p < entry.result) {
+                return -1;
+            }
+            entry.data = p;
+            p += entry.result;
+        }
+
+        session->entries = (dfurecord_entry *)realloc(
+            session->entries,
+            (session->num_entries + 1) * sizeof(dfurecord_entry));
+        session->entries[session->num_entries++] = entry;
+    }
+}
+
+/*
+        dfurecord_replay_open() loads a session file, and makes a device out
+        of it.
+*/
+int32_t dfurecord_replay_open(const char *path, dfu_device ***devices)
+{
+    dfurecord_session *session;
+    dfu_device *dfudev;
+    FILE *file;
+    long size;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("can't open <%s>\n", path);
+        return -1;
+    }
+
+    session = (dfurecord_session *)calloc(1, sizeof(dfurecord_session));
+    dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    session->buf = (uint8_t *)malloc(size > 0 ? size : 1);
+    if (size < 0 || fread(session->buf, 1, size, file) != (size_t)size ||
+        dfurecord_parse(session, size, dfudev)) {
+        printf("<%s> isn't a complete recorded session\n", path);
+        fclose(file);
+        free(session->entries);
+        free(session->buf);
+        free(session);
+        free(dfudev);
+        return -1;
+    }
+    fclose(file);
+
+    snprintf(session->path, sizeof(session->path), "%s", path);
+    session->replay = 1;
+    clock_gettime(CLOCK_MONOTONIC, &session->start);
+    session->last = session->start;
+
+    dfudev->transport = &dfurecord_replay_transport;
+    dfudev->transport_data = session;
+
+    *devices = (dfu_device **)calloc(2, sizeof(dfu_device *));
+    (*devices)[0] = dfudev;
+
+    return 1;
+}
+
+/*
+        dfurecord_print_replay() puts the times of a replay next to the ones
+        that were recorded.
+*/
+static void dfurecord_print_replay(dfurecord_session *session,
+                                   uint64_t wait_us, uint64_t host_us)
+{
+    uint64_t recorded_bus_us = 0, recorded_host_us;
+    uint32_t i;
+
+    for (i = 0; i < session->num_entries; i++) {
+        recorded_bus_us += session->entries[i].duration_us;
+    }
+    recorded_host_us = session->end.duration_us - recorded_bus_us;
+    recorded_host_us = recorded_host_us > session->end.gap_us ?
+                           recorded_host_us - session->end.gap_us :
+                           0;
+
+    printf("replayed %u of %u requests from <%s>%s\n", session->next,
+           session->num_entries, session->path,
+           session->diverged ? ", the host didn't match" : "");
+    printf("            requests  requests ms   wait ms   host ms\n");
+    printf("recorded  %10u %12.1f %9.1f %9.1f\n", session->num_entries,
+           recorded_bus_us / 1000.0, session->end.gap_us / 1000.0,
+           recorded_host_us / 1000.0);
+    printf("replayed  %10u %12.1f %9.1f %9.1f\n", session->next,
+           session->bus_us / 1000.0, wait_us / 1000.0, host_us / 1000.0);
+}
+
+/*
+        dfurecord_finish() ends the recording or replay on device. The time
+        of a session splits into the time spent in requests (the bus and the
+        device), the bwPollTimeout waits, and what is left, which is the
+        host's.
+*/
+int32_t dfurecord_finish(dfu_device *device)
+{
+    dfurecord_session *session = (dfurecord_session *)device->transport_data;
+    uint64_t session_us, wait_us = device->poll_wait_us;
+    uint64_t host_us;
+    dfurecord_entry end = {DFURECORD_END};
+
+    if (device->transport != &dfurecord_transport &&
+        device->transport != &dfurecord_replay_transport) {
+        return 0;
+    }
+
+    session_us = dfurecord_diff_us(&session->last, &session->start);
+    host_us = session_us - session->bus_us;
+    host_us = host_us > wait_us ? host_us - wait_us : 0;
+
+    if (!session->replay) {
+        end.duration_us = session_us;
+        end.gap_us = wait_us;
+        dfurecord_write_entry(session, &end);
+        fclose(session->file);
+
+        printf("recorded %u requests to <%s>: %.1f ms in requests, "
+               "%.1f ms waiting on the device, %.1f ms on the host\n",
+               session->next, session->path, session->bus_us / 1000.0,
+               wait_us / 1000.0, host_us / 1000.0);
+
+        device->transport = session->transport;
+        device->transport_data = session->transport_data;
+        free(session);
+
+        return 0;
+    }
+
+    if (!session->diverged && session->next < session->num_entries) {
+        printf("replay: the host stopped after %u of %u requests\n",
+               session->next, session->num_entries);
+        session->diverged = 1;
+    }
+
+    dfurecord_print_replay(session, wait_us, host_us);
+
+    return session->diverged ? -1 : 0;
+}
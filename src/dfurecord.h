@@ -0,0 +1,88 @@
+/*
+dfurecord.{c,h} :
+Records every request a dfu device is sent (control transfers, alternate
+setting changes and resets) together with its answer and timing into a
+session file, and plays a session file back as a transport. The replay
+checks that the host makes exactly the same requests, in the same order and
+with the same data, so that captures from real chips can be kept and run
+without the hardware to catch extra round trips and host side slowdowns.
+*/
+
+#ifndef __DFURECORD__
+#define __DFURECORD__
+
+#define DFURECORD_MAGIC "DFUREC01"
+#define DFURECORD_MAGIC_LEN 8
+#define DFURECORD_ENTRY_LEN 24
+
+/* the kinds of entries in a session file */
+#define DFURECORD_CONTROL 0
+#define DFURECORD_ALTSETTING 1
+#define DFURECORD_RESET 2
+#define DFURECORD_END 3
+
+/*
+one request and its answer. data is the answer of an IN transfer, crc the
+crc32 of what an OUT transfer sent. The END entry closes a session, it keeps
+how long the session took in duration_us and how long the host waited for
+the device (bwPollTimeout) in gap_us.
+*/
+typedef struct {
+    uint8_t kind;
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t wvalue;
+    uint16_t length;
+    int32_t result;
+    uint32_t duration_us;
+    uint32_t gap_us;
+    uint32_t crc;
+    uint8_t *data;
+} dfurecord_entry;
+
+/*
+dfurecord_session wraps the transport of a device while it is recorded, or
+is the transport of a replayed device. bus_us adds up the time spent in
+requests, which is the device's time, and the gaps in between are the
+host's, apart from the bwPollTimeout waits.
+*/
+typedef struct {
+    FILE *file;
+    char path[256];
+    int replay;
+    const dfu_transport *transport;
+    void *transport_data;
+    uint8_t *buf;
+    dfurecord_entry *entries;
+    uint32_t num_entries;
+    uint32_t next;
+    int diverged;
+    struct timespec start;
+    struct timespec last;
+    uint64_t bus_us;
+    dfurecord_entry end;
+} dfurecord_session;
+
+extern const dfu_transport dfurecord_transport;
+extern const dfu_transport dfurecord_replay_transport;
+
+/*
+dfurecord_start() starts recording everything that is sent to device into
+the file at path, on top of its current transport. Returns 0 on success, or
+< 0 if the file can't be written.
+*/
+int32_t dfurecord_start(dfu_device *device, const char *path);
+
+/*
+dfurecord_replay_open() opens the session file at path as a device, with
+the layout of the device that was recorded. Returns the number of devices
+(1) in a malloc'd array, or < 0 if the file isn't a session.
+*/
+int32_t dfurecord_replay_open(const char *path, dfu_device ***devices);
+
+/*
+dfurecord_finish() ends a recording or a replay and prints where the time
+went. Returns < 0 if the replay didn't see the recorded requests.
+*/
+int32_t dfurecord_finish(dfu_device *device);
+#endif
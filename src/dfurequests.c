@@ -36,8 +36,11 @@ Class Specification for Device Firmware Upgrade.
 #include <stdarg.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <libusb-1.0/libusb.h>
 #include <time.h>
+#include "dfulayout.h"
 #include "dfurequests.h"
 
 #if HAVE_CONFIG_H
@@ -45,6 +48,197 @@ Class Specification for Device Firmware Upgrade.
 #endif
 #include <sys/types.h>
 
+static const char *dfu_request_names[DFU_NUM_REQUESTS] = {
+    "DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE", "ABORT"
+};
+
+static const char *dfu_phase_names[DFU_NUM_PHASES] = {
+    "idle", "erase", "program", "verify", "read", "leave"
+};
+
+static void timespec_add_us( struct timespec *t, uint64_t us )
+{
+    t->tv_sec  += us / 1000000;
+    t->tv_nsec += (us % 1000000) * 1000;
+    if( t->tv_nsec >= 1000000000 ) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+static uint64_t timespec_diff_us( const struct timespec *a,
+                                  const struct timespec *b )
+{
+    return (b->tv_sec - a->tv_sec) * 1000000LL +
+           (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/* the trace ring, NULL while nothing is traced; the next event goes to
+ * dfu_trace_next modulo the size of the ring */
+static dfu_trace_event *dfu_trace_ring;
+static uint64_t dfu_trace_next;
+
+static uint64_t timespec_ns( const struct timespec *t )
+{
+    return t->tv_sec * 1000000000ULL + t->tv_nsec;
+}
+
+/*
+ *  Records one event in the trace ring. Several devices may be traced at
+ *  once from their own threads, so the slot is claimed atomically.
+ */
+static void dfu_trace_record( const void *device, uint8_t kind,
+                              uint8_t request, uint16_t wvalue,
+                              uint16_t length, int32_t result,
+                              uint8_t state, uint8_t status,
+                              const struct timespec *start,
+                              const struct timespec *end )
+{
+    uint64_t slot = __atomic_fetch_add( &dfu_trace_next, 1, __ATOMIC_RELAXED );
+    dfu_trace_event *event = &dfu_trace_ring[slot & (DFU_TRACE_EVENTS - 1)];
+
+    event->start_ns = timespec_ns( start );
+    event->end_ns   = timespec_ns( end );
+    event->device   = device;
+    event->kind     = kind;
+    event->request  = request;
+    event->wvalue   = wvalue;
+    event->length   = length;
+    event->result   = result;
+    event->state    = state;
+    event->status   = status;
+}
+
+/*
+ *  Maps a latency to its histogram bucket: the power of two, and the next
+ *  two bits below it.
+ */
+static uint32_t dfu_latency_bucket( uint32_t us )
+{
+    uint32_t msb = 31 - __builtin_clz( us | 1 );
+
+    if( us < 4 ) {
+        return us;
+    }
+
+    return msb * 4 + ((us >> (msb - 2)) & 3);
+}
+
+/*
+ *  The largest latency that falls into a histogram bucket.
+ */
+static uint32_t dfu_bucket_limit( uint32_t bucket )
+{
+    uint32_t msb = bucket / 4;
+
+    if( bucket < 8 ) {
+        return bucket;
+    }
+
+    return ((uint64_t)(5 + bucket % 4) << (msb - 2)) - 1;
+}
+
+/*
+ *  The libusb transport: requests are control transfers to the dfu
+ *  interface of an opened usb device.
+ */
+static int32_t dfu_libusb_control( dfu_device *device, uint8_t request_type,
+                                   uint8_t request, uint16_t wvalue,
+                                   uint8_t *data, uint16_t length,
+                                   uint32_t timeout )
+{
+    return libusb_control_transfer( device->handle, request_type, request,
+                                    wvalue, device->interface, data, length,
+                                    timeout );
+}
+
+static int32_t dfu_libusb_set_altsetting( dfu_device *device,
+                                          int32_t altsetting )
+{
+    return libusb_set_interface_alt_setting( device->handle,
+                                             device->interface, altsetting );
+}
+
+static int32_t dfu_libusb_reset( dfu_device *device )
+{
+    return libusb_reset_device( device->handle );
+}
+
+static void dfu_libusb_close( dfu_device *device )
+{
+    libusb_release_interface( device->handle, device->interface );
+    libusb_close( device->handle );
+}
+
+const dfu_transport dfu_libusb_transport = {
+    "usb",
+    dfu_libusb_control,
+    dfu_libusb_set_altsetting,
+    dfu_libusb_reset,
+    dfu_libusb_close
+};
+
+/*
+ *  Makes a DFU request as a class control transfer to the dfu interface,
+ *  and adds its latency and the bytes moved to the request statistics.
+ *
+ *  returns the result of libusb_control_transfer()
+ */
+static int32_t dfu_transfer( dfu_device *device, uint8_t direction,
+                             uint8_t request, uint16_t wvalue,
+                             uint8_t *data, uint16_t length )
+{
+    dfu_req_stats *stats = &device->req_stats[request];
+    struct timespec start, end;
+    uint32_t elapsed;
+    int32_t result;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    result = device->transport->control( device,
+          /* bmRequestType */ direction | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          /* bRequest      */ request,
+          /* wValue        */ wvalue,
+          /* Data          */ data,
+          /* wLength       */ length,
+                              DFU_TIMEOUT );
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    elapsed = timespec_diff_us( &start, &end );
+
+    if( (0 == stats->count) || (elapsed < stats->min_us) ) {
+        stats->min_us = elapsed;
+    }
+    if( elapsed > stats->max_us ) {
+        stats->max_us = elapsed;
+    }
+    stats->total_us += elapsed;
+    stats->buckets[dfu_latency_bucket( elapsed )]++;
+    stats->count++;
+
+    if( result < 0 ) {
+        stats->errors++;
+    } else {
+        stats->bytes += result;
+    }
+
+    if( NULL != dfu_trace_ring ) {
+        uint8_t state = 0xff, status = 0xff;
+
+        if( (DFU_GETSTATUS == request) && (6 == result) ) {
+            status = data[0];
+            state  = data[4];
+        } else if( (DFU_GETSTATE == request) && (1 == result) ) {
+            state = data[0];
+        }
+
+        dfu_trace_record( device, DFU_TRACE_REQUEST, request, wvalue, length,
+                          result, state, status, &start, &end );
+    }
+
+    return result;
+}
+
 /*
  *  DFU_DETACH Request (DFU Spec 1.1, Section 5.1)
  *
@@ -58,18 +252,11 @@ int32_t dfu_detach( dfu_device *device, const int32_t timeout )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) || (timeout < 0) ) {
+    if( (NULL == device) || (NULL == device->transport) || (timeout < 0) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_DETACH,
-          /* wValue        */ timeout,
-          /* wIndex        */ device->interface,
-          /* Data          */ NULL,
-          /* wLength       */ 0,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_OUT, DFU_DETACH, timeout, NULL, 0 );
 
     return result;
 }
@@ -89,7 +276,7 @@ int32_t dfu_download(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t
     int32_t result;
 
     /* Sanity checks */
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -101,14 +288,7 @@ int32_t dfu_download(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t
         return -3;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_DNLOAD,
-          /* wValue        */ wvalue,
-          /* wIndex        */ device->interface,
-          /* Data          */ data,
-          /* wLength       */ length,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_OUT, DFU_DNLOAD, wvalue, data, length );
 
     return result;
 }
@@ -128,7 +308,7 @@ int32_t dfu_upload(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t le
     int32_t result;
 
     /* Sanity checks */
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -136,14 +316,7 @@ int32_t dfu_upload(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t le
         return -2;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_UPLOAD,
-          /* wValue        */ wvalue,
-          /* wIndex        */ device->interface,
-          /* Data          */ data,
-          /* wLength       */ length,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_IN, DFU_UPLOAD, wvalue, data, length );
 
     return result;
 }
@@ -160,9 +333,8 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
 {
     unsigned char buffer[6];
     int32_t result;
-	struct timespec req;
-	
-    if( (NULL == device) || (NULL == device->handle) ) {
+
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -177,14 +349,7 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
 	status->bState        = -1;
 	status->iString       = -1;
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_GETSTATUS,
-          /* wValue        */ 0,
-          /* wIndex        */ device->interface,
-          /* Data          */ buffer,
-          /* wLength       */ 6,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_IN, DFU_GETSTATUS, 0, buffer, 6 );
 
     if( 6 == result ) {
         status->bStatus = buffer[0];
@@ -204,16 +369,6 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
 				);
 		#endif
 		
-		if (status->bwPollTimeout != 0)
-		{
-			req.tv_sec = 0;
-			req.tv_nsec = status->bwPollTimeout * 1000000;
-			if (0 > nanosleep(&req, NULL))
-			{
-				printf("dfu_get_status: nanosleep failed");
-			}
-		}
-				
     } else {
         if( 0 < result ) {
             /* There was an error, we didn't get the entire message. */
@@ -224,6 +379,407 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
     return 0;
 }
 
+static const char *dfu_op_names[DFU_NUM_OPS] = {
+    "set address", "erase", "mass erase", "program"
+};
+
+/*
+ *  Waits for a pending DNLOAD operation to finish by polling DFU_GETSTATUS.
+ *
+ *  The first GETSTATUS after a DNLOAD starts the operation, and the device
+ *  answers with dfuDNBUSY and the time it wants to be left alone for
+ *  (bwPollTimeout). That is a worst case, a sector erase usually takes a
+ *  fraction of it. So the next poll is scheduled by the moving estimate of
+ *  how long op has been taking, and bwPollTimeout is only used as upper
+ *  bound. If the estimate was short, polls follow in doubling steps. Polls
+ *  are never closer together than DFU_POLL_MIN_US.
+ *
+ *  device    - the dfu device to commmunicate with
+ *  op        - the kind of operation pending (DFU_OP_...)
+ *  size      - the number of bytes the operation covers, 0 if it has none
+ *  status    - the data structure to be populated with the final status
+ *
+ *  return the 0 if successful or < 0 on an error
+ */
+int32_t dfu_poll_status( dfu_device *device, int32_t op, uint32_t size,
+                         dfu_status *status )
+{
+    dfu_op_stats *stats;
+    struct timespec start, deadline, now, end;
+    uint64_t step, cap, elapsed, sample;
+    uint32_t units, polls = 1;
+    int32_t result;
+
+    if( (NULL == device) || (op < 0) || (op >= DFU_NUM_OPS) ) {
+        return -1;
+    }
+
+    stats = &device->op_stats[op];
+    units = size ? (size + 1023) / 1024 : 1;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    result = dfu_get_status( device, status );
+    if( 0 != result ) {
+        return result;
+    }
+
+    deadline = start;
+    step = (uint64_t)stats->estimate_us * units;
+
+    while( STATE_DFU_DOWNLOAD_BUSY == status->bState ) {
+        cap = (uint64_t)status->bwPollTimeout * 1000;
+
+        /* nothing learned yet, do what the device asks for */
+        if( (0 == step) || (step > cap) ) {
+            step = cap;
+        }
+
+        /* a device that asks for no wait at all still gets a moment, or
+         * it would be polled in a tight loop while it is busy */
+        if( step < DFU_POLL_MIN_US ) {
+            step = DFU_POLL_MIN_US;
+        }
+
+        timespec_add_us( &deadline, step );
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        if( (deadline.tv_sec > now.tv_sec) ||
+            ((deadline.tv_sec == now.tv_sec) &&
+             (deadline.tv_nsec > now.tv_nsec)) ) {
+            device->poll_wait_us += timespec_diff_us( &now, &deadline );
+        }
+        clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL );
+
+        if( NULL != dfu_trace_ring ) {
+            struct timespec woke;
+
+            clock_gettime( CLOCK_MONOTONIC, &woke );
+            dfu_trace_record( device, DFU_TRACE_SLEEP, op, 0, 0, 0, 0xff,
+                              0xff, &now, &woke );
+        }
+
+        result = dfu_get_status( device, status );
+        if( 0 != result ) {
+            return result;
+        }
+        polls++;
+
+        /* missed it, the operation should be about to finish, so poll
+         * again in short steps that double while it is still busy */
+        if( 2 == polls ) {
+            step = (step / 8 < DFU_POLL_MIN_US) ? DFU_POLL_MIN_US : step / 8;
+        } else {
+            step *= 2;
+        }
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    elapsed = timespec_diff_us( &start, &end );
+
+    /* done at the first scheduled poll means the operation may well have
+     * been quicker than the estimate, so let the estimate creep down until
+     * a poll is early */
+    sample = elapsed / units;
+    if( polls <= 2 ) {
+        sample -= sample / 4;
+    }
+
+    if( 0 == stats->count ) {
+        stats->estimate_us = sample;
+        stats->min_us = elapsed;
+    } else {
+        stats->estimate_us += ((int64_t)sample - stats->estimate_us) / 4;
+    }
+
+    if( elapsed < stats->min_us ) {
+        stats->min_us = elapsed;
+    }
+    if( elapsed > stats->max_us ) {
+        stats->max_us = elapsed;
+    }
+    stats->total_us += elapsed;
+    stats->polls += polls;
+    stats->count++;
+
+    return 0;
+}
+
+/*
+ *  Prints the latencies dfu_poll_status() has observed on a device.
+ *
+ *  device    - the dfu device whose statistics to print
+ */
+void dfu_print_op_stats( dfu_device *device )
+{
+    int32_t i;
+
+    printf( "%-12s %6s %6s %10s %10s %10s %10s\n", "operation", "count",
+            "polls", "total ms", "avg ms", "min ms", "max ms" );
+
+    for( i = 0; i < DFU_NUM_OPS; i++ ) {
+        dfu_op_stats *stats = &device->op_stats[i];
+
+        if( 0 == stats->count ) {
+            continue;
+        }
+
+        printf( "%-12s %6u %6u %10.1f %10.2f %10.2f %10.2f\n",
+                dfu_op_names[i], stats->count, stats->polls,
+                stats->total_us / 1000.0,
+                stats->total_us / 1000.0 / stats->count,
+                stats->min_us / 1000.0, stats->max_us / 1000.0 );
+    }
+}
+
+/*
+ *  Adds the time since start and the bytes moved to a phase of the run
+ *  report.
+ *
+ *  device    - the dfu device the phase ran on
+ *  phase     - the phase (DFU_PHASE_...)
+ *  start     - when the phase started (CLOCK_MONOTONIC)
+ *  bytes     - the number of bytes the phase moved, 0 if none
+ */
+void dfu_phase_add( dfu_device *device, int32_t phase,
+                    const struct timespec *start, uint32_t bytes )
+{
+    struct timespec end;
+
+    if( (NULL == device) || (phase < 0) || (phase >= DFU_NUM_PHASES) ) {
+        return;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    device->phase_stats[phase].total_us += timespec_diff_us( start, &end );
+    device->phase_stats[phase].bytes += bytes;
+    device->phase_stats[phase].count++;
+
+    if( NULL != dfu_trace_ring ) {
+        dfu_trace_record( device, DFU_TRACE_PHASE, phase, 0, 0, bytes, 0xff,
+                          0xff, start, &end );
+    }
+}
+
+/*
+ *  Starts recording into the trace ring.
+ *
+ *  return 0 if successful or < 0 if the ring can't be allocated
+ */
+int32_t dfu_trace_start( void )
+{
+    dfu_trace_event *ring;
+
+    ring = (dfu_trace_event *) calloc( DFU_TRACE_EVENTS,
+                                       sizeof(dfu_trace_event) );
+    if( NULL == ring ) {
+        return -1;
+    }
+
+    dfu_trace_next = 0;
+    dfu_trace_ring = ring;
+
+    return 0;
+}
+
+/*
+ *  Stops recording and frees the trace ring.
+ */
+void dfu_trace_stop( void )
+{
+    dfu_trace_event *ring = dfu_trace_ring;
+
+    dfu_trace_ring = NULL;
+    free( ring );
+}
+
+/*
+ *  Writes the trace ring in Chrome trace-event format and stops recording.
+ *  Timestamps are in us from the first event that is still in the ring,
+ *  every device gets a timeline (tid) of its own.
+ *
+ *  out       - where to write the trace to
+ *  devices   - the devices that were traced, to name their timelines
+ *  ndevices  - the number of devices
+ */
+void dfu_trace_write( FILE *out, dfu_device **devices, int32_t ndevices )
+{
+    dfu_trace_event *ring = dfu_trace_ring;
+    uint64_t first, i, origin = UINT64_MAX;
+    int32_t tid;
+
+    if( NULL == ring ) {
+        return;
+    }
+    dfu_trace_ring = NULL;
+
+    first = (dfu_trace_next > DFU_TRACE_EVENTS) ?
+                dfu_trace_next - DFU_TRACE_EVENTS : 0;
+
+    /* phases are recorded when they end, after the requests inside them */
+    for( i = first; i < dfu_trace_next; i++ ) {
+        if( ring[i & (DFU_TRACE_EVENTS - 1)].start_ns < origin ) {
+            origin = ring[i & (DFU_TRACE_EVENTS - 1)].start_ns;
+        }
+    }
+
+    fprintf( out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n" );
+
+    fprintf( out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+             "\"args\": {\"name\": \"stmdfu\"}}" );
+
+    for( tid = 0; tid < ndevices; tid++ ) {
+        fprintf( out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                 "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                 tid + 1, devices[tid]->path );
+    }
+
+    for( i = first; i < dfu_trace_next; i++ ) {
+        dfu_trace_event *event = &ring[i & (DFU_TRACE_EVENTS - 1)];
+
+        tid = 0;
+        while( (tid < ndevices) && (devices[tid] != event->device) ) {
+            tid++;
+        }
+
+        fprintf( out, ",\n{\"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                 "\"ts\": %.3f, \"dur\": %.3f, ",
+                 tid < ndevices ? tid + 1 : 0,
+                 (event->start_ns - origin) / 1000.0,
+                 (event->end_ns - event->start_ns) / 1000.0 );
+
+        if( DFU_TRACE_REQUEST == event->kind ) {
+            fprintf( out, "\"cat\": \"request\", \"name\": \"%s\", \"args\": "
+                     "{\"wValue\": %u, \"wLength\": %u, \"result\": %d",
+                     dfu_request_names[event->request], event->wvalue,
+                     event->length, event->result );
+            if( 0xff != event->state ) {
+                fprintf( out, ", \"state\": \"%s\"",
+                         dfu_state_to_string( event->state ) );
+            }
+            if( 0xff != event->status ) {
+                fprintf( out, ", \"status\": \"%s\"",
+                         dfu_status_to_string( event->status ) );
+            }
+            fprintf( out, "}}" );
+        } else if( DFU_TRACE_SLEEP == event->kind ) {
+            fprintf( out, "\"cat\": \"poll\", \"name\": \"wait %s\"}",
+                     dfu_op_names[event->request] );
+        } else {
+            fprintf( out, "\"cat\": \"phase\", \"name\": \"%s\", "
+                     "\"args\": {\"bytes\": %d}}",
+                     dfu_phase_names[event->request], event->result );
+        }
+    }
+
+    fprintf( out, "\n]}\n" );
+
+    free( ring );
+}
+
+/*
+ *  Clears the statistics of a device, but keeps the learned durations of
+ *  the operations, which dfu_poll_status() still needs.
+ *
+ *  device    - the dfu device whose statistics to clear
+ */
+void dfu_reset_stats( dfu_device *device )
+{
+    int32_t i;
+
+    for( i = 0; i < DFU_NUM_OPS; i++ ) {
+        uint32_t estimate_us = device->op_stats[i].estimate_us;
+
+        memset( &device->op_stats[i], 0, sizeof(dfu_op_stats) );
+        device->op_stats[i].estimate_us = estimate_us;
+    }
+
+    memset( device->req_stats, 0, sizeof(device->req_stats) );
+    memset( device->phase_stats, 0, sizeof(device->phase_stats) );
+    device->poll_wait_us = 0;
+}
+
+/*
+ *  Reads a percentile off the latency histogram of a request. The bucket
+ *  limit is an upper bound, so it is clamped to the largest latency seen.
+ */
+static uint32_t dfu_req_percentile( const dfu_req_stats *stats,
+                                    uint32_t percent )
+{
+    uint64_t wanted = ((uint64_t)stats->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    uint32_t i;
+
+    for( i = 0; i < DFU_LATENCY_BUCKETS; i++ ) {
+        seen += stats->buckets[i];
+        if( seen >= wanted ) {
+            break;
+        }
+    }
+
+    if( (i == DFU_LATENCY_BUCKETS) || (dfu_bucket_limit( i ) > stats->max_us) ) {
+        return stats->max_us;
+    }
+
+    return dfu_bucket_limit( i );
+}
+
+/*
+ *  Writes the statistics of a device as a JSON object.
+ *
+ *  out       - where to write the object to
+ *  device    - the dfu device whose statistics to write
+ */
+void dfu_write_report( FILE *out, dfu_device *device )
+{
+    int32_t i;
+
+    fprintf( out, "{\n      \"path\": \"%s\",\n", device->path );
+    fprintf( out, "      \"transfer_size\": %u,\n", device->transfer_size );
+    fprintf( out, "      \"poll_wait_ms\": %.3f,\n",
+             device->poll_wait_us / 1000.0 );
+
+    fprintf( out, "      \"phases\": {" );
+    for( i = 0; i < DFU_NUM_PHASES; i++ ) {
+        dfu_phase_stats *stats = &device->phase_stats[i];
+
+        fprintf( out, "%s\n        \"%s\": { \"count\": %u, \"ms\": %.3f, "
+                 "\"bytes\": %llu, \"kib_per_s\": %.1f }",
+                 i ? "," : "", dfu_phase_names[i], stats->count,
+                 stats->total_us / 1000.0, (unsigned long long)stats->bytes,
+                 stats->total_us ?
+                     stats->bytes / 1024.0 / (stats->total_us / 1e6) : 0.0 );
+    }
+    fprintf( out, "\n      },\n" );
+
+    fprintf( out, "      \"requests\": {" );
+    for( i = 0; i < DFU_NUM_REQUESTS; i++ ) {
+        dfu_req_stats *stats = &device->req_stats[i];
+
+        fprintf( out, "%s\n        \"%s\": { \"count\": %u, \"errors\": %u, "
+                 "\"bytes\": %llu, \"min_us\": %u, \"avg_us\": %.1f, "
+                 "\"p99_us\": %u, \"max_us\": %u }",
+                 i ? "," : "", dfu_request_names[i], stats->count,
+                 stats->errors, (unsigned long long)stats->bytes,
+                 stats->min_us,
+                 stats->count ? (double)stats->total_us / stats->count : 0.0,
+                 dfu_req_percentile( stats, 99 ), stats->max_us );
+    }
+    fprintf( out, "\n      },\n" );
+
+    fprintf( out, "      \"operations\": {" );
+    for( i = 0; i < DFU_NUM_OPS; i++ ) {
+        dfu_op_stats *stats = &device->op_stats[i];
+
+        fprintf( out, "%s\n        \"%s\": { \"count\": %u, \"polls\": %u, "
+                 "\"total_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f }",
+                 i ? "," : "", dfu_op_names[i], stats->count, stats->polls,
+                 stats->total_us / 1000.0, stats->min_us / 1000.0,
+                 stats->max_us / 1000.0 );
+    }
+    fprintf( out, "\n      }\n    }" );
+}
+
 /*
  *  DFU_CLRSTATUS Request (DFU Spec 1.1, Section 6.1.3)
  *
@@ -235,18 +791,11 @@ int32_t dfu_clear_status( dfu_device *device )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_CLRSTATUS,
-          /* wValue        */ 0,
-          /* wIndex        */ device->interface,
-          /* Data          */ NULL,
-          /* wLength       */ 0,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_OUT, DFU_CLRSTATUS, 0, NULL, 0 );
 
     return result;
 }
@@ -263,18 +812,11 @@ int32_t dfu_get_state( dfu_device *device )
     int32_t result;
     unsigned char buffer[1];
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_GETSTATE,
-          /* wValue        */ 0,
-          /* wIndex        */ device->interface,
-          /* Data          */ buffer,
-          /* wLength       */ 1,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_IN, DFU_GETSTATE, 0, buffer, 1 );
 
     /* Return the error if there is one. */
     if( result < 1 ) {
@@ -296,18 +838,11 @@ int32_t dfu_abort( dfu_device *device )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
-          /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-          /* bRequest      */ DFU_ABORT,
-          /* wValue        */ 0,
-          /* wIndex        */ device->interface,
-          /* Data          */ NULL,
-          /* wLength       */ 0,
-                              DFU_TIMEOUT );
+    result = dfu_transfer( device, LIBUSB_ENDPOINT_OUT, DFU_ABORT, 0, NULL, 0 );
 
     return result;
 }
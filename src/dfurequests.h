@@ -47,6 +47,9 @@ Class Specification for Device Firmware Upgrade.
 #define DFU_ITF_SUBCLASS 0x01
 #define DFU_ITF_PROTOCOL 0x02
 
+/* DFU functional descriptor (DFU Spec 1.1, Section 4.1.3) */
+#define DFU_FUNCTIONAL_DESCRIPTOR 0x21
+
 /* DFU commands */
 #define DFU_DETACH      0
 #define DFU_DNLOAD      1
@@ -104,10 +107,123 @@ typedef struct {
     uint8_t iString;
 } dfu_status;
 
+/* Operations whose duration dfu_poll_status() learns and keeps statistics of */
+#define DFU_OP_SET_ADDRESS  0
+#define DFU_OP_ERASE        1
+#define DFU_OP_MASS_ERASE   2
+#define DFU_OP_PROGRAM      3
+#define DFU_NUM_OPS         4
+
+/* Shortest wait (in us) between two polls of an operation that is still busy */
+#define DFU_POLL_MIN_US     1000
+
+/* Observed latencies of one kind of operation.
+ *
+ *  estimate_us is a moving average of the time the operation takes per kB
+ *  (per operation if it has no size), used to schedule the next poll.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t polls;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t estimate_us;
+} dfu_op_stats;
+
+/* DFU requests (bRequest) that dfu_transfer() keeps statistics of */
+#define DFU_NUM_REQUESTS    7
+
+/* Latency histogram of a request: four buckets per power of two of us,
+ * so a percentile read off it is within 25% */
+#define DFU_LATENCY_BUCKETS 128
+
+typedef struct {
+    uint32_t count;
+    uint32_t errors;
+    uint64_t bytes;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t buckets[DFU_LATENCY_BUCKETS];
+} dfu_req_stats;
+
+/* Phases of a command whose time (and throughput) the run report shows */
+#define DFU_PHASE_IDLE      0
+#define DFU_PHASE_ERASE     1
+#define DFU_PHASE_PROGRAM   2
+#define DFU_PHASE_VERIFY    3
+#define DFU_PHASE_READ      4
+#define DFU_PHASE_LEAVE     5
+#define DFU_NUM_PHASES      6
+
 typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint64_t bytes;
+} dfu_phase_stats;
+
+/* Kinds of events dfu_trace_...() record */
+#define DFU_TRACE_REQUEST   0
+#define DFU_TRACE_SLEEP     1
+#define DFU_TRACE_PHASE     2
+
+/* Events the trace ring holds, the oldest are overwritten (a power of 2) */
+#define DFU_TRACE_EVENTS    (1 << 18)
+
+/* One control transfer (or poll wait, or phase) on the trace timeline.
+ *
+ *  state and status are what a GETSTATUS/GETSTATE returned, 0xff if the
+ *  request returns neither.
+ */
+typedef struct {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    const void *device;
+    uint8_t kind;
+    uint8_t request;
+    uint16_t wvalue;
+    uint16_t length;
+    uint8_t state;
+    uint8_t status;
+    int32_t result;
+} dfu_trace_event;
+
+typedef struct dfu_device dfu_device;
+
+/* A transport carries the requests of a dfu device to it.
+ *
+ *  dfu_libusb_transport makes usb control transfers on the handle of the
+ *  device, the simulated stm32 bootloader of dfusim.c is the other one.
+ *  control() returns what libusb_control_transfer() would.
+ */
+typedef struct {
+    const char *name;
+    int32_t (*control)( dfu_device *device, uint8_t request_type,
+                        uint8_t request, uint16_t wvalue, uint8_t *data,
+                        uint16_t length, uint32_t timeout );
+    int32_t (*set_altsetting)( dfu_device *device, int32_t altsetting );
+    int32_t (*reset)( dfu_device *device );
+    void (*close)( dfu_device *device );
+} dfu_transport;
+
+extern const dfu_transport dfu_libusb_transport;
+
+struct dfu_device {
+	const dfu_transport *transport;
+	void *transport_data;
 	struct libusb_device_handle *handle;
 	int32_t interface;
-} dfu_device;
+	int32_t altsetting;
+	char path[32];
+	uint16_t transfer_size;
+	int32_t num_regions;
+	dfu_region regions[DFU_MAX_REGIONS];
+	dfu_op_stats op_stats[DFU_NUM_OPS];
+	dfu_req_stats req_stats[DFU_NUM_REQUESTS];
+	dfu_phase_stats phase_stats[DFU_NUM_PHASES];
+	uint64_t poll_wait_us;
+};
 
 /*
 *  DFU_DETACH Request (DFU Spec 1.1, Section 5.1)
@@ -154,6 +270,75 @@ int32_t dfu_upload(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t le
 */
 int32_t dfu_get_status( dfu_device *device, dfu_status *status );
 
+/*
+*  Waits for a pending DNLOAD operation to finish by polling DFU_GETSTATUS.
+*  The first poll is scheduled by the learned duration of op, capped by the
+*  bwPollTimeout the device asks for, then polls follow in growing steps
+*  while the device stays in dfuDNBUSY.
+*
+*  device    - the dfu device to commmunicate with
+*  op        - the kind of operation pending (DFU_OP_...)
+*  size      - the number of bytes the operation covers, 0 if it has none
+*  status    - the data structure to be populated with the final status
+*
+*  return the 0 if successful or < 0 on an error
+*/
+int32_t dfu_poll_status( dfu_device *device, int32_t op, uint32_t size,
+                         dfu_status *status );
+
+/*
+*  Prints the latencies dfu_poll_status() has observed on a device.
+*
+*  device    - the dfu device whose statistics to print
+*/
+void dfu_print_op_stats( dfu_device *device );
+
+/*
+*  Adds the time since start (CLOCK_MONOTONIC) and the bytes moved to a
+*  phase (DFU_PHASE_...) of the run report.
+*/
+void dfu_phase_add( dfu_device *device, int32_t phase,
+                    const struct timespec *start, uint32_t bytes );
+
+/*
+*  Clears the request, phase and operation statistics of a device, so the
+*  next report covers one command. The learned operation durations stay.
+*/
+void dfu_reset_stats( dfu_device *device );
+
+/*
+*  Writes the statistics of a device as a JSON object: time and throughput
+*  per phase, count, bytes and min/avg/p99/max latency per request, and the
+*  operations dfu_poll_status() has waited for.
+*
+*  out       - where to write the object to
+*  device    - the dfu device whose statistics to write
+*/
+void dfu_write_report( FILE *out, dfu_device *device );
+
+/*
+*  Starts recording every request, poll wait and phase of every device into
+*  a ring of DFU_TRACE_EVENTS events.
+*
+*  return 0 if successful or < 0 if the ring can't be allocated
+*/
+int32_t dfu_trace_start( void );
+
+/*
+*  Stops recording and frees the trace ring.
+*/
+void dfu_trace_stop( void );
+
+/*
+*  Writes the recorded events in Chrome trace-event format (for Perfetto or
+*  chrome://tracing), one timeline per device, and stops recording.
+*
+*  out       - where to write the trace to
+*  devices   - the devices that were traced, to name their timelines
+*  ndevices  - the number of devices
+*/
+void dfu_trace_write( FILE *out, dfu_device **devices, int32_t ndevices );
+
 /*
 *  DFU_CLRSTATUS Request (DFU Spec 1.1, Section 6.1.3)
 *
@@ -14,6 +14,9 @@ Specification, UM0391.
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdint.h>
 
 #include "dfuse.h"
 #include "crc32.h"
@@ -27,129 +30,258 @@ Specification, UM0391.
 #define HI(x) (x >> 8 & 0xFF)
 #define LO(x) (x & 0xFF)
 
+#define DFUSE_ALIGN(x)                                                     \
+    (((x) + DFUSE_ARENA_ALIGN - 1) & ~(size_t)(DFUSE_ARENA_ALIGN - 1))
+#define DFUSE_CHUNKHDR DFUSE_ALIGN(sizeof(dfuse_chunk))
+
+/*
+    where dfuse_parse() takes the headers from: the mapping of the
+    file, or a window of it that is read as needed
+*/
+typedef struct {
+    uint8_t *map;
+    int fd;
+    size_t window_start;
+    size_t window_len;
+    uint8_t window[DFUSE_SCAN_WINDOW];
+    int error;
+} dfuse_source;
+
+/*
+    dfuse_chunk_new() allocates a chunk of the arena with room for
+    size bytes.
+*/
+static dfuse_chunk *dfuse_chunk_new(size_t size)
+{
+    dfuse_chunk *chunk = (dfuse_chunk *)malloc(DFUSE_CHUNKHDR + size);
+
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+
+    return chunk;
+}
+
 /*
-    dfuse_init() allocates memory for the various dfuse structs
-    that make up the dfuse file, and populates fields that are
-    independent of the firmware image.
+    dfuse_alloc() carves size bytes from the arena of a dfuse file.
+    Small blocks come from the current chunk, or a new one when it is
+    full. Large ones (element data, mostly) get a chunk of their own,
+    put behind the current one so that what is left of it still gets
+    used.
+*/
+static void *dfuse_alloc(dfuse_file *dfusefile, size_t size)
+{
+    dfuse_chunk *chunk = dfusefile->arena;
+    void *p;
+
+    size = DFUSE_ALIGN(size);
+    if (chunk->size - chunk->used < size) {
+        if (size > DFUSE_ARENA_CHUNK / 4) {
+            chunk = dfuse_chunk_new(size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = dfusefile->arena->next;
+            dfusefile->arena->next = chunk;
+        } else {
+            chunk = dfuse_chunk_new(DFUSE_ARENA_CHUNK);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = dfusefile->arena;
+            dfusefile->arena = chunk;
+        }
+    }
+
+    p = (uint8_t *)chunk + DFUSE_CHUNKHDR + chunk->used;
+    chunk->used += size;
+
+    return p;
+}
+
+/*
+    dfuse_new() starts an arena, with an empty dfuse file at the
+    start of its first chunk.
+*/
+static dfuse_file *dfuse_new(void)
+{
+    dfuse_chunk *chunk = dfuse_chunk_new(DFUSE_ARENA_CHUNK);
+    dfuse_file *dfusefile;
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    dfusefile = (dfuse_file *)((uint8_t *)chunk + DFUSE_CHUNKHDR);
+    memset(dfusefile, 0, sizeof(dfuse_file));
+    chunk->used = DFUSE_ALIGN(sizeof(dfuse_file));
+    dfusefile->arena = chunk;
+
+    return dfusefile;
+}
+
+/*
+    dfuse_init() starts the arena of a dfuse file, and populates
+    fields that are independent of the firmware image.
 */
 dfuse_file *dfuse_init(uint32_t device_id, uint32_t vendor_id,
                        uint32_t product_id)
 {
-    // allocate memory
-    dfuse_file *dfusefile = (dfuse_file *)malloc(sizeof(dfuse_file));
-    dfusefile->prefix = (dfuse_prefix *)malloc(sizeof(dfuse_prefix));
-    dfusefile->prefix->targets = 0;
-    dfusefile->prefix->signature[0] = 'D';
-    dfusefile->prefix->signature[1] = 'f';
-    dfusefile->prefix->signature[2] = 'u';
-    dfusefile->prefix->signature[3] = 'S';
-    dfusefile->prefix->signature[4] = 'e';
-    dfusefile->prefix->version = 0x01;
-    dfusefile->prefix->dfu_image_size = STMDFU_PREFIXLEN;
-
-    dfusefile->images = NULL;
-    dfusefile->suffix = (dfuse_suffix *)malloc(sizeof(dfuse_suffix));
+    dfuse_file *dfusefile = dfuse_new();
+
+    if (dfusefile == NULL) {
+        return NULL;
+    }
 
     // set predetermined prefix values
+    dfusefile->prefix.targets = 0;
+    dfusefile->prefix.signature[0] = 'D';
+    dfusefile->prefix.signature[1] = 'f';
+    dfusefile->prefix.signature[2] = 'u';
+    dfusefile->prefix.signature[3] = 'S';
+    dfusefile->prefix.signature[4] = 'e';
+    dfusefile->prefix.version = 0x01;
+    dfusefile->prefix.dfu_image_size = STMDFU_PREFIXLEN;
+
     // set predetermined suffix values
-    dfusefile->suffix->device_low = LO(device_id);
-    dfusefile->suffix->device_high = HI(device_id);
-    dfusefile->suffix->product_low = LO(product_id);
-    dfusefile->suffix->product_high = HI(product_id);
-    dfusefile->suffix->vendor_low = LO(vendor_id);
-    dfusefile->suffix->vendor_high = HI(vendor_id);
-    dfusefile->suffix->dfu_low = 0x1a;
-    dfusefile->suffix->dfu_high = 0x01;
-    dfusefile->suffix->dfu_signature[0] = 'U';
-    dfusefile->suffix->dfu_signature[1] = 'F';
-    dfusefile->suffix->dfu_signature[2] = 'D';
-    dfusefile->suffix->suffix_length = 16;
+    dfusefile->suffix.device_low = LO(device_id);
+    dfusefile->suffix.device_high = HI(device_id);
+    dfusefile->suffix.product_low = LO(product_id);
+    dfusefile->suffix.product_high = HI(product_id);
+    dfusefile->suffix.vendor_low = LO(vendor_id);
+    dfusefile->suffix.vendor_high = HI(vendor_id);
+    dfusefile->suffix.dfu_low = 0x1a;
+    dfusefile->suffix.dfu_high = 0x01;
+    dfusefile->suffix.dfu_signature[0] = 'U';
+    dfusefile->suffix.dfu_signature[1] = 'F';
+    dfusefile->suffix.dfu_signature[2] = 'D';
+    dfusefile->suffix.suffix_length = 16;
 
     return dfusefile;
 }
 
-dfuse_image *dfuse_addimage(dfuse_file *dfusefile, const char *target_name,
-                            uint8_t alternate_setting)
+/*
+    dfuse_grow() makes room for one more entry of size bytes in an
+    array of the arena that holds count entries in room, by moving it
+    to a new block twice the size. The old block stays in the arena
+    until it is freed.
+*/
+static void *dfuse_grow(dfuse_file *dfusefile, void *array, uint32_t count,
+                        uint32_t *room, size_t size)
 {
-    dfusefile->prefix->targets++;
-    if (dfusefile->images) {
-        dfusefile->images = (dfuse_image **)realloc(
-            dfusefile->images,
-            sizeof(dfuse_image *) * dfusefile->prefix->targets);
+    void *grown;
+
+    if (count < *room) {
+        return array;
+    }
 
-    } else {
-        dfusefile->images = (dfuse_image **)malloc(sizeof(dfuse_image *) *
-                                                   dfusefile->prefix->targets);
+    grown = dfuse_alloc(dfusefile, (size_t)(*room ? *room * 2 : 4) * size);
+    if (grown == NULL) {
+        return NULL;
+    }
+    if (count) {
+        memcpy(grown, array, count * size);
     }
+    *room = *room ? *room * 2 : 4;
 
-    dfuse_image *image = (dfuse_image *)malloc(sizeof(dfuse_image));
-    dfusefile->images[dfusefile->prefix->targets - 1] = image;
+    return grown;
+}
 
-    image->imgelement = NULL;
+dfuse_image *dfuse_addimage(dfuse_file *dfusefile, const char *target_name,
+                            uint8_t alternate_setting)
+{
+    dfuse_image *images =
+        (dfuse_image *)dfuse_grow(dfusefile, dfusefile->images,
+                                  dfusefile->prefix.targets, &dfusefile->room,
+                                  sizeof(dfuse_image));
+
+    if (images == NULL) {
+        return NULL;
+    }
+    dfusefile->images = images;
 
-    image->tarprefix =
-        (dfuse_target_prefix *)malloc(sizeof(dfuse_target_prefix));
-    image->tarprefix->num_elements = 0;
-    image->tarprefix->signature[0] = 'T';
-    image->tarprefix->signature[1] = 'a';
-    image->tarprefix->signature[2] = 'r';
-    image->tarprefix->signature[3] = 'g';
-    image->tarprefix->signature[4] = 'e';
-    image->tarprefix->signature[5] = 't';
-    image->tarprefix->alternate_setting = alternate_setting;
-    image->tarprefix->target_named = 1;
+    dfuse_image *image = &images[dfusefile->prefix.targets++];
 
-    memset(image->tarprefix->target_name, 0,
-           sizeof(image->tarprefix->target_name));
-    strcpy(image->tarprefix->target_name, target_name);
-    image->tarprefix->target_size = 0;
+    memset(image, 0, sizeof(dfuse_image));
+    image->tarprefix.signature[0] = 'T';
+    image->tarprefix.signature[1] = 'a';
+    image->tarprefix.signature[2] = 'r';
+    image->tarprefix.signature[3] = 'g';
+    image->tarprefix.signature[4] = 'e';
+    image->tarprefix.signature[5] = 't';
+    image->tarprefix.alternate_setting = alternate_setting;
+    image->tarprefix.target_named = 1;
+    snprintf(image->tarprefix.target_name, sizeof(image->tarprefix.target_name),
+             "%s", target_name);
 
-    dfusefile->prefix->dfu_image_size += STMDFU_TARPREFIXLEN;
+    dfusefile->prefix.dfu_image_size += STMDFU_TARPREFIXLEN;
 
     return image;
 }
 
-dfuse_image_element *dfuse_addelement(dfuse_file *dfusefile, dfuse_image *image,
-                                      unsigned int address, int size)
+dfuse_image_element *dfuse_addelement_view(dfuse_file *dfusefile,
+                                           dfuse_image *image,
+                                           unsigned int address, int size,
+                                           uint8_t *data)
 {
-    image->tarprefix->num_elements++;
-    if (image->imgelement) {
-        image->imgelement = (dfuse_image_element **)realloc(
-            image->imgelement,
-            sizeof(dfuse_image_element *) * image->tarprefix->num_elements);
+    dfuse_image_element *elements = (dfuse_image_element *)dfuse_grow(
+        dfusefile, image->imgelement, image->tarprefix.num_elements,
+        &image->room, sizeof(dfuse_image_element));
 
-    } else {
-        image->imgelement = (dfuse_image_element **)malloc(
-            sizeof(dfuse_image_element *) * image->tarprefix->num_elements);
+    if (elements == NULL) {
+        return NULL;
     }
+    image->imgelement = elements;
 
-    dfuse_image_element *el =
-        (dfuse_image_element *)malloc(sizeof(dfuse_image_element));
-    image->imgelement[image->tarprefix->num_elements - 1] = el;
+    dfuse_image_element *el = &elements[image->tarprefix.num_elements++];
 
     el->element_address = address;
     el->element_size = size;
-    el->data = (uint8_t *)malloc(size);
+    el->data = data;
+    el->offset = 0;
 
     int delta_size =
         size + sizeof(el->element_address) + sizeof(el->element_size);
-    image->tarprefix->target_size += delta_size;
-    dfusefile->prefix->dfu_image_size += delta_size;
+    image->tarprefix.target_size += delta_size;
+    dfusefile->prefix.dfu_image_size += delta_size;
 
     return el;
 }
 
+dfuse_image_element *dfuse_addelement(dfuse_file *dfusefile, dfuse_image *image,
+                                      unsigned int address, int size)
+{
+    uint8_t *data = (uint8_t *)dfuse_alloc(dfusefile, size);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    return dfuse_addelement_view(dfusefile, image, address, size, data);
+}
+
 /*
-        dfuse_readbin() reads the binary firmware image into memory
+        dfuse_readbin() reads the binary firmware image into memory.
+        Returns 0, or -1 if there isn't room for it in the arena or the
+        file can't be read.
 */
-void dfuse_readbin(dfuse_file *dfusefile, dfuse_image *image, int binfile)
+int dfuse_readbin(dfuse_file *dfusefile, dfuse_image *image, int binfile)
 {
     struct stat stat;
-    fstat(binfile, &stat);
+
+    if (image == NULL || fstat(binfile, &stat)) {
+        return -1;
+    }
 
     dfuse_image_element *el =
         dfuse_addelement(dfusefile, image, 0x08000000, stat.st_size);
 
+    if (el == NULL) {
+        return -1;
+    }
+
     int i, j;
 
     // read binary into data array
@@ -160,238 +292,550 @@ void dfuse_readbin(dfuse_file *dfusefile, dfuse_image *image, int binfile)
     for (j = i; i == READBIN_READLEN; j += READBIN_READLEN) {
         i = read(binfile, &el->data[j], READBIN_READLEN);
     }
+
+    return i < 0 ? -1 : 0;
 }
 
-int dfuse_writeprefix(dfuse_file *dfusefile, int dfufile)
+int dfuse_packprefix(dfuse_file *dfusefile, uint8_t *buf)
 {
     int ct = 0;
 
-    ct = DFUWRITE(dfusefile->prefix->signature);
-    ct += DFUWRITE(dfusefile->prefix->version);
-    ct += DFUWRITE(dfusefile->prefix->dfu_image_size);
-    ct += DFUWRITE(dfusefile->prefix->targets);
-
-    if (ct != STMDFU_PREFIXLEN)
-        ct = -1;
+    ct += DFUPACK(dfusefile->prefix.signature);
+    ct += DFUPACK(dfusefile->prefix.version);
+    ct += DFUPACK(dfusefile->prefix.dfu_image_size);
+    ct += DFUPACK(dfusefile->prefix.targets);
 
     return ct;
 }
 
-int dfuse_readprefix(dfuse_file *dfusefile, int dfufile)
+int dfuse_packtarprefix(dfuse_image *image, uint8_t *buf)
 {
     int ct = 0;
 
-    ct = DFUREAD(dfusefile->prefix->signature);
-    ct += DFUREAD(dfusefile->prefix->version);
-    ct += DFUREAD(dfusefile->prefix->dfu_image_size);
-    ct += DFUREAD(dfusefile->prefix->targets);
-
-    if (ct != STMDFU_PREFIXLEN)
-        ct = -1;
+    ct += DFUPACK(image->tarprefix.signature);
+    ct += DFUPACK(image->tarprefix.alternate_setting);
+    ct += DFUPACK(image->tarprefix.target_named);
+    ct += DFUPACK(image->tarprefix.target_name);
+    ct += DFUPACK(image->tarprefix.target_size);
+    ct += DFUPACK(image->tarprefix.num_elements);
 
     return ct;
 }
 
-int dfuse_writetarprefix(dfuse_image *image, int dfufile)
+int dfuse_packimgelement_meta(dfuse_image_element *el, uint8_t *buf)
 {
     int ct = 0;
 
-    ct = DFUWRITE(image->tarprefix->signature);
-    ct += DFUWRITE(image->tarprefix->alternate_setting);
-    ct += DFUWRITE(image->tarprefix->target_named);
-    ct += DFUWRITE(image->tarprefix->target_name);
-    ct += DFUWRITE(image->tarprefix->target_size);
-    ct += DFUWRITE(image->tarprefix->num_elements);
-
-    if (ct != STMDFU_TARPREFIXLEN)
-        ct = -1;
+    ct += DFUPACK(el->element_address);
+    ct += DFUPACK(el->element_size);
 
     return ct;
 }
 
-int dfuse_readtarprefix(dfuse_image *image, int dfufile)
+int dfuse_packsuffix(dfuse_file *dfusefile, uint8_t *buf)
 {
     int ct = 0;
 
-    ct = DFUREAD(image->tarprefix->signature);
-    ct += DFUREAD(image->tarprefix->alternate_setting);
-    ct += DFUREAD(image->tarprefix->target_named);
-    ct += DFUREAD(image->tarprefix->target_name);
-    ct += DFUREAD(image->tarprefix->target_size);
-    ct += DFUREAD(image->tarprefix->num_elements);
-
-    if (ct != STMDFU_TARPREFIXLEN)
-        ct = -1;
+    ct += DFUPACK(dfusefile->suffix.device_low);
+    ct += DFUPACK(dfusefile->suffix.device_high);
+    ct += DFUPACK(dfusefile->suffix.product_low);
+    ct += DFUPACK(dfusefile->suffix.product_high);
+    ct += DFUPACK(dfusefile->suffix.vendor_low);
+    ct += DFUPACK(dfusefile->suffix.vendor_high);
+    ct += DFUPACK(dfusefile->suffix.dfu_low);
+    ct += DFUPACK(dfusefile->suffix.dfu_high);
+    ct += DFUPACK(dfusefile->suffix.dfu_signature);
+    ct += DFUPACK(dfusefile->suffix.suffix_length);
+    ct += DFUPACK(dfusefile->suffix.crc);
 
     return ct;
 }
 
-int dfuse_writeimages(dfuse_file *dfusefile, int dfufile)
+/*
+        dfuse_take() copies len bytes at ct of the file out of the
+        source, and reads a new window of it when they aren't in the
+        current one. A read that comes up short sets src->error.
+*/
+static void dfuse_take(dfuse_source *src, size_t ct, void *var, size_t len)
 {
-    int ct = 0;
-    for (int i = 0; i < dfusefile->prefix->targets; i++) {
-        dfuse_image *image = dfusefile->images[i];
-        ct += dfuse_writetarprefix(image, dfufile);
-        for (int j = 0; j < image->tarprefix->num_elements; j++) {
-            dfuse_image_element *el = image->imgelement[j];
-            ct += dfuse_writeimgelement(el, dfufile);
+    ssize_t n;
+
+    if (src->map != NULL) {
+        memcpy(var, &src->map[ct], len);
+        return;
+    }
+
+    if (ct < src->window_start ||
+        ct + len > src->window_start + src->window_len) {
+        n = pread(src->fd, src->window, sizeof(src->window), ct);
+        src->window_start = ct;
+        src->window_len = n > 0 ? n : 0;
+        if (len > src->window_len) {
+            memset(var, 0, len);
+            src->error = 1;
+            return;
         }
     }
-    return ct;
+
+    memcpy(var, &src->window[ct - src->window_start], len);
 }
 
-int dfuse_writeimgelement(dfuse_image_element *el, int dfufile)
+/*
+        dfuse_source_crc() takes the crc of the first size bytes of a file
+        that isn't mapped, a window at a time. A read that comes up short
+        sets src->error.
+*/
+static uint32_t dfuse_source_crc(dfuse_source *src, size_t size)
 {
-    int ct = 0;
-
-    ct += DFUWRITE(el->element_address);
-    ct += DFUWRITE(el->element_size);
-    ct += write(dfufile, el->data, el->element_size);
-    if (ct != el->element_size + sizeof(el->element_address) +
-                  sizeof(el->element_size)) {
-        ct = -1;
+    uint32_t crc = 0;
+    size_t ct, len;
+    ssize_t n;
+
+    // the window is reused, whatever was in it is gone
+    src->window_len = 0;
+
+    for (ct = 0; ct < size; ct += n) {
+        len = size - ct < sizeof(src->window) ? size - ct
+                                              : sizeof(src->window);
+        n = pread(src->fd, src->window, len, ct);
+        if (n <= 0) {
+            src->error = 1;
+            return 0;
+        }
+        crc = crc32_update(crc, src->window, n);
     }
 
-    return ct;
+    return crc;
 }
 
-int dfuse_readimgelement_meta(dfuse_image_element *el, int dfufile)
+/*
+        dfuse_crc_matches() tells whether crc, of everything in the file
+        but the crc itself, is the one in the suffix. DfuSe tools store
+        the crc without the final inversion, our tools with it, either is
+        good.
+*/
+int dfuse_crc_matches(dfuse_file *dfusefile, uint32_t crc)
 {
-    int ct = 0;
+    return dfusefile->suffix.crc == crc || dfusefile->suffix.crc == ~crc;
+}
 
-    ct += DFUREAD(el->element_address);
-    ct += DFUREAD(el->element_size);
+/*
+        dfuse_parse() fills the dfuse structs in from the headers of the
+        file, and checks every size and signature against the file on the
+        way. The element data points into the mapping, if there is one.
+        The crc of a file that isn't mapped is taken through the window,
+        so a streamed file is checked before anything is flashed from it.
+        Returns what is wrong with the file, or NULL if it is sound.
+*/
+static const char *dfuse_parse(dfuse_file *dfusefile, dfuse_source *src)
+{
+    size_t size = dfusefile->mapping_size;
+    size_t ct = 0;
+    uint32_t crc;
+    int i, j;
 
-    if (ct != sizeof(el->element_address) + sizeof(el->element_size)) {
-        ct = -1;
+    if (size < STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN) {
+        return "too short";
     }
 
-    return ct;
+    DFUTAKE(dfusefile->prefix.signature);
+    DFUTAKE(dfusefile->prefix.version);
+    DFUTAKE(dfusefile->prefix.dfu_image_size);
+    DFUTAKE(dfusefile->prefix.targets);
+
+    if (src->error) {
+        return "read error";
+    }
+    if (memcmp(dfusefile->prefix.signature, "DfuSe", 5) ||
+        dfusefile->prefix.version != 0x01) {
+        return "no DfuSe prefix";
+    }
+    if (dfusefile->prefix.dfu_image_size != size - STMDFU_SUFFIXLEN) {
+        return "the image size doesn't match the file size";
+    }
+
+    // the counts are known before the arrays are needed, so they are
+    // carved from the arena at their final size
+    dfusefile->room = dfusefile->prefix.targets;
+    dfusefile->images = (dfuse_image *)dfuse_alloc(
+        dfusefile, dfusefile->room * sizeof(dfuse_image));
+    if (dfusefile->images == NULL) {
+        return "out of memory";
+    }
+
+    for (i = 0; i < dfusefile->prefix.targets; i++) {
+        dfuse_image *image = &dfusefile->images[i];
+        size_t target_end;
+
+        memset(image, 0, sizeof(dfuse_image));
+
+        if (size - STMDFU_SUFFIXLEN - ct < STMDFU_TARPREFIXLEN) {
+            return "a target prefix runs past the image";
+        }
+
+        DFUTAKE(image->tarprefix.signature);
+        DFUTAKE(image->tarprefix.alternate_setting);
+        DFUTAKE(image->tarprefix.target_named);
+        DFUTAKE(image->tarprefix.target_name);
+        DFUTAKE(image->tarprefix.target_size);
+        DFUTAKE(image->tarprefix.num_elements);
+        image->tarprefix.target_name[sizeof(image->tarprefix.target_name) -
+                                      1] = 0;
+
+        if (memcmp(image->tarprefix.signature, "Target", 6)) {
+            return "no Target signature";
+        }
+        if (image->tarprefix.target_size > size - STMDFU_SUFFIXLEN - ct ||
+            image->tarprefix.num_elements >
+                image->tarprefix.target_size / STMDFU_ELEMENTLEN) {
+            return "a target runs past the image";
+        }
+        target_end = ct + image->tarprefix.target_size;
+
+        image->room = image->tarprefix.num_elements;
+        image->imgelement = (dfuse_image_element *)dfuse_alloc(
+            dfusefile, image->room * sizeof(dfuse_image_element));
+        if (image->imgelement == NULL) {
+            return "out of memory";
+        }
+
+        for (j = 0; j < image->tarprefix.num_elements; j++) {
+            dfuse_image_element *el = &image->imgelement[j];
+
+            if (target_end - ct < STMDFU_ELEMENTLEN) {
+                return "an element runs past its target";
+            }
+
+            DFUTAKE(el->element_address);
+            DFUTAKE(el->element_size);
+
+            // the element is a view into the mapping, not a copy
+            if (el->element_size > target_end - ct) {
+                return "an element runs past its target";
+            }
+            el->data = src->map != NULL ? &src->map[ct] : NULL;
+            el->offset = ct;
+            ct += el->element_size;
+        }
+
+        if (ct != target_end) {
+            return "the target size doesn't match its elements";
+        }
+    }
+
+    if (ct != dfusefile->prefix.dfu_image_size) {
+        return "there is data after the last target";
+    }
+
+    DFUTAKE(dfusefile->suffix.device_low);
+    DFUTAKE(dfusefile->suffix.device_high);
+    DFUTAKE(dfusefile->suffix.product_low);
+    DFUTAKE(dfusefile->suffix.product_high);
+    DFUTAKE(dfusefile->suffix.vendor_low);
+    DFUTAKE(dfusefile->suffix.vendor_high);
+    DFUTAKE(dfusefile->suffix.dfu_low);
+    DFUTAKE(dfusefile->suffix.dfu_high);
+    DFUTAKE(dfusefile->suffix.dfu_signature);
+    DFUTAKE(dfusefile->suffix.suffix_length);
+    DFUTAKE(dfusefile->suffix.crc);
+
+    if (src->error) {
+        return "read error";
+    }
+    if (memcmp(dfusefile->suffix.dfu_signature, "UFD", 3) ||
+        dfusefile->suffix.suffix_length != STMDFU_SUFFIXLEN) {
+        return "no DFU suffix";
+    }
+
+    crc = src->map != NULL ? crc32_update(0, src->map, size - 4)
+                           : dfuse_source_crc(src, size - 4);
+    if (src->error) {
+        return "read error";
+    }
+    if (!dfuse_crc_matches(dfusefile, crc)) {
+        return "bad crc";
+    }
+
+    return NULL;
 }
 
-int dfuse_readimgelement_data(dfuse_image_element *el, int dfufile)
+/*
+        dfuse_map() maps a dfuse file into memory and checks it, with the
+        element data left where it is in the mapping.
+*/
+dfuse_file *dfuse_map(const char *file)
 {
-    int ct = 0;
+    dfuse_source src;
+    dfuse_file *dfusefile;
+    const char *error;
+    struct stat stat;
+    void *map;
+    int dfufile;
+
+    dfufile = open(file, O_RDONLY);
+    if (dfufile < 0 || fstat(dfufile, &stat)) {
+        printf("error opening <%s>\n", file);
+        if (dfufile >= 0) {
+            close(dfufile);
+        }
+        return NULL;
+    }
 
-    ct += read(dfufile, el->data, el->element_size);
+    if (stat.st_size < STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN ||
+        stat.st_size > UINT32_MAX) {
+        printf("<%s> isn't a dfuse file: %s\n", file,
+               stat.st_size > UINT32_MAX ? "too long" : "too short");
+        close(dfufile);
+        return NULL;
+    }
 
-    if (ct != el->element_size) {
-        ct = -1;
+    map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, dfufile, 0);
+    close(dfufile);
+    if (map == MAP_FAILED) {
+        printf("error mapping <%s>\n", file);
+        return NULL;
     }
 
-    return ct;
+    dfusefile = dfuse_new();
+    if (dfusefile == NULL) {
+        printf("out of memory for <%s>\n", file);
+        munmap(map, stat.st_size);
+        return NULL;
+    }
+    dfusefile->mapping = (uint8_t *)map;
+    dfusefile->mapping_size = stat.st_size;
+
+    memset(&src, 0, sizeof(src));
+    src.map = dfusefile->mapping;
+    error = dfuse_parse(dfusefile, &src);
+    if (error != NULL) {
+        printf("<%s> isn't a sound dfuse file: %s\n", file, error);
+        dfuse_struct_cleanup(dfusefile);
+        return NULL;
+    }
+
+    return dfusefile;
 }
 
-int dfuse_writesuffix(dfuse_file *dfusefile, int dfufile)
+/*
+        dfuse_scan() reads the headers of a dfuse file, and the rest
+        for the crc, through a small window, for dfuse files that are
+        streamed rather than mapped. Every element knows its offset in
+        the file, the data is left where it is.
+*/
+dfuse_file *dfuse_scan(const char *file, int *fd)
 {
-    int ct = 0;
+    dfuse_source src;
+    dfuse_file *dfusefile;
+    const char *error;
+    struct stat stat;
 
-    ct = DFUWRITE(dfusefile->suffix->device_low);
-    ct += DFUWRITE(dfusefile->suffix->device_high);
-    ct += DFUWRITE(dfusefile->suffix->product_low);
-    ct += DFUWRITE(dfusefile->suffix->product_high);
-    ct += DFUWRITE(dfusefile->suffix->vendor_low);
-    ct += DFUWRITE(dfusefile->suffix->vendor_high);
-    ct += DFUWRITE(dfusefile->suffix->dfu_low);
-    ct += DFUWRITE(dfusefile->suffix->dfu_high);
-    ct += DFUWRITE(dfusefile->suffix->dfu_signature);
-    ct += DFUWRITE(dfusefile->suffix->suffix_length);
+    memset(&src, 0, sizeof(src));
+    src.fd = open(file, O_RDONLY);
+    if (src.fd < 0 || fstat(src.fd, &stat)) {
+        printf("error opening <%s>\n", file);
+        if (src.fd >= 0) {
+            close(src.fd);
+        }
+        return NULL;
+    }
 
-    calccrc(dfusefile, dfufile);
+    if (stat.st_size < STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN ||
+        stat.st_size > UINT32_MAX) {
+        printf("<%s> isn't a dfuse file: %s\n", file,
+               stat.st_size > UINT32_MAX ? "too long" : "too short");
+        close(src.fd);
+        return NULL;
+    }
 
-    ct += DFUWRITE(dfusefile->suffix->crc);
+    dfusefile = dfuse_new();
+    if (dfusefile == NULL) {
+        printf("out of memory for <%s>\n", file);
+        close(src.fd);
+        return NULL;
+    }
+    dfusefile->mapping_size = stat.st_size;
+
+    error = dfuse_parse(dfusefile, &src);
+    if (error != NULL) {
+        printf("<%s> isn't a sound dfuse file: %s\n", file, error);
+        dfuse_struct_cleanup(dfusefile);
+        close(src.fd);
+        return NULL;
+    }
 
-    if (ct != STMDFU_SUFFIXLEN)
-        ct = -1;
+    *fd = src.fd;
 
-    return ct;
+    return dfusefile;
 }
 
-int dfuse_readsuffix(dfuse_file *dfusefile, int dfufile)
+/*
+        dfuse_writer gathers the parts of a dfuse file on their way out.
+        Headers are packed into hdr, element data is pointed at where it
+        is, and everything goes out with one writev() per batch. The crc
+        is updated as parts are queued, so the file is written in one pass
+        and never read back.
+*/
+typedef struct {
+    int fd;
+    int ct;
+    uint32_t crc;
+    int iovcnt;
+    struct iovec iov[DFUSE_WRITER_IOVS];
+    int hdrlen;
+    uint8_t hdr[DFUSE_WRITER_HDRLEN];
+} dfuse_writer;
+
+static int dfuse_writer_flush(dfuse_writer *w)
 {
-    int ct = 0;
+    struct iovec *iov = w->iov;
+    int iovcnt = w->iovcnt;
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(w->fd, iov, iovcnt);
+        if (n < 0) {
+            return -1;
+        }
+        w->ct += n;
 
-    ct = DFUREAD(dfusefile->suffix->device_low);
-    ct += DFUREAD(dfusefile->suffix->device_high);
-    ct += DFUREAD(dfusefile->suffix->product_low);
-    ct += DFUREAD(dfusefile->suffix->product_high);
-    ct += DFUREAD(dfusefile->suffix->vendor_low);
-    ct += DFUREAD(dfusefile->suffix->vendor_high);
-    ct += DFUREAD(dfusefile->suffix->dfu_low);
-    ct += DFUREAD(dfusefile->suffix->dfu_high);
-    ct += DFUREAD(dfusefile->suffix->dfu_signature);
-    ct += DFUREAD(dfusefile->suffix->suffix_length);
-    ct += DFUREAD(dfusefile->suffix->crc);
-
-    if (ct != STMDFU_SUFFIXLEN)
-        ct = -1;
+        // a short write leaves the rest of the batch to go again
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
 
-    return ct;
+    w->iovcnt = 0;
+    w->hdrlen = 0;
+
+    return 0;
+}
+
+static int dfuse_writer_add(dfuse_writer *w, uint8_t *data, int length)
+{
+    if (w->iovcnt == DFUSE_WRITER_IOVS && dfuse_writer_flush(w)) {
+        return -1;
+    }
+
+    w->crc = crc32_update(w->crc, data, length);
+    w->iov[w->iovcnt].iov_base = data;
+    w->iov[w->iovcnt].iov_len = length;
+    w->iovcnt++;
+
+    return 0;
 }
 
 /*
-        calccrc() calculates a 32 bit CRC to go in the
-        suffix of the dfuse file
+        dfuse_writer_header() makes room for a header of up to
+        STMDFU_TARPREFIXLEN bytes in hdr, and for it and the data after it
+        in the batch, so that nothing is flushed before the caller has
+        packed and queued it.
 */
-void calccrc(dfuse_file *dfusefile, int dfufile)
+static uint8_t *dfuse_writer_header(dfuse_writer *w)
+{
+    if ((w->hdrlen + STMDFU_TARPREFIXLEN > DFUSE_WRITER_HDRLEN ||
+         w->iovcnt + 2 > DFUSE_WRITER_IOVS) &&
+        dfuse_writer_flush(w)) {
+        return NULL;
+    }
+
+    return &w->hdr[w->hdrlen];
+}
+
+static int dfuse_writer_addheader(dfuse_writer *w, uint8_t *header,
+                                  int length)
 {
-    unsigned char *crcbuf;
-
-    chksum_crc32gentab();
-
-    // 	int offset1 = 0;
-    // 	int offset2 = STMDFU_PREFIXLEN - 1;
-    // 	int offset3 = STMDFU_PREFIXLEN + STMDFU_TARPREFIXLEN - 1;
-    // 	int offset4 = STMDFU_PREFIXLEN + STMDFU_TARPREFIXLEN + 8 - 1;
-    //
-    // 	lseek(dfufile, 0, SEEK_SET);
-    // 	crcbuf = (char *)malloc(sizeof(char)*fptr);
-    // 	if (fptr != read(dfufile, crcbuf, fptr))
-    // 		printf("UHOHHHHH\n");
-    // 	lseek(dfufile, 0, SEEK_END);
-    // 	u_int32_t crc1 = chksum_crc32(&crcbuf[offset1], (fptr-offset1));
-    // 	u_int32_t crc2 = chksum_crc32(&crcbuf[offset2], (fptr-offset2+1));
-    // 	u_int32_t crc3 = chksum_crc32(&crcbuf[offset3], (fptr-offset3+1));
-    // 	u_int32_t crc4 = chksum_crc32(&crcbuf[offset4], (fptr-offset4+1));
-    // 	dfusefile->suffix->crc = 13;
-    // 	free(crcbuf);
-    //
-    // 	printf("<%x>%d :: <%x>%d :: <%x>%d :: <%x>%d of %d\n", crc1, offset1,
-    // crc2, offset2, crc3, offset3, crc4, offset4, fptr);
-
-    lseek(dfufile, 0, SEEK_SET);
-
-    crcbuf =
-        (unsigned char *)malloc(sizeof(char) * (dfusefile->prefix->dfu_image_size + 12));
-    if ((dfusefile->prefix->dfu_image_size + 12) !=
-        read(dfufile, crcbuf, (dfusefile->prefix->dfu_image_size + 12)))
-        printf("UHOHHHHHHHH\n");
-    lseek(dfufile, 0, SEEK_END);
-    dfusefile->suffix->crc =
-        chksum_crc32(crcbuf, (dfusefile->prefix->dfu_image_size + 12));
-    free(crcbuf);
+    w->hdrlen += length;
+
+    return dfuse_writer_add(w, header, length);
 }
 
 /*
-        dfuse_struct_cleanup() deallocates the dfuse file
-        structures
+        dfuse_write() writes the whole dfuse file, with the crc of
+        everything before it in the suffix.
 */
-void dfuse_struct_cleanup(dfuse_file *dfusefile)
+int dfuse_write(dfuse_file *dfusefile, int dfufile)
 {
+    dfuse_writer w;
+    uint8_t *header;
     int i, j;
 
-    for (i = 0; i < dfusefile->prefix->targets; i++) {
-        for (j = 0; j < dfusefile->images[i]->tarprefix->num_elements; j++) {
-            free(dfusefile->images[i]->imgelement[j]->data);
-            free(dfusefile->images[i]->imgelement[j]);
+    w.fd = dfufile;
+    w.ct = 0;
+    w.crc = 0;
+    w.iovcnt = 0;
+    w.hdrlen = 0;
+
+    header = dfuse_writer_header(&w);
+    if (header == NULL ||
+        dfuse_writer_addheader(&w, header,
+                               dfuse_packprefix(dfusefile, header))) {
+        return -1;
+    }
+
+    for (i = 0; i < dfusefile->prefix.targets; i++) {
+        dfuse_image *image = &dfusefile->images[i];
+
+        header = dfuse_writer_header(&w);
+        if (header == NULL ||
+            dfuse_writer_addheader(&w, header,
+                                   dfuse_packtarprefix(image, header))) {
+            return -1;
         }
-        free(dfusefile->images[i]->tarprefix);
-        free(dfusefile->images[i]->imgelement);
-        free(dfusefile->images[i]);
+
+        for (j = 0; j < image->tarprefix.num_elements; j++) {
+            dfuse_image_element *el = &image->imgelement[j];
+
+            header = dfuse_writer_header(&w);
+            if (header == NULL ||
+                dfuse_writer_addheader(
+                    &w, header, dfuse_packimgelement_meta(el, header)) ||
+                dfuse_writer_add(&w, el->data, el->element_size)) {
+                return -1;
+            }
+        }
+    }
+
+    // the crc covers the suffix too, up to the crc itself
+    header = dfuse_writer_header(&w);
+    if (header == NULL) {
+        return -1;
+    }
+    dfuse_packsuffix(dfusefile, header);
+    dfusefile->suffix.crc =
+        crc32_update(w.crc, header, STMDFU_SUFFIXLEN - 4);
+    if (dfuse_writer_addheader(&w, header,
+                               dfuse_packsuffix(dfusefile, header)) ||
+        dfuse_writer_flush(&w)) {
+        return -1;
     }
 
-    free(dfusefile->images);
-    free(dfusefile->suffix);
-    free(dfusefile->prefix);
-    free(dfusefile);
-}
\ No newline at end of file
+    return w.ct;
+}
+
+/*
+        dfuse_struct_cleanup() unmaps the file, and frees every chunk
+        of the arena, the one the dfuse file is in too.
+*/
+void dfuse_struct_cleanup(dfuse_file *dfusefile)
+{
+    dfuse_chunk *chunk = dfusefile->arena;
+    dfuse_chunk *next;
+
+    if (dfusefile->mapping != NULL) {
+        munmap(dfusefile->mapping, dfusefile->mapping_size);
+    }
+
+    // one of the chunks holds dfusefile itself
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
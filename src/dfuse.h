@@ -17,11 +17,21 @@ Specification, UM0391.
 #define STMDFU_PREFIXLEN 11
 #define STMDFU_SUFFIXLEN 16
 #define STMDFU_TARPREFIXLEN 274
+#define STMDFU_ELEMENTLEN 8
 
 #define READBIN_READLEN 100
 
-#define DFUWRITE(var) (write(dfufile, &(var), sizeof(var)))
-#define DFUREAD(var) (read(dfufile, &(var), sizeof(var)))
+#define DFUSE_ARENA_CHUNK 4096
+#define DFUSE_ARENA_ALIGN 16
+
+#define DFUSE_SCAN_WINDOW 4096
+
+#define DFUSE_WRITER_IOVS 64
+#define DFUSE_WRITER_HDRLEN 4096
+
+#define DFUPACK(var) (memcpy(&buf[ct], &(var), sizeof(var)), sizeof(var))
+#define DFUTAKE(var)                                                       \
+    (dfuse_take(src, ct, &(var), sizeof(var)), ct += sizeof(var))
 
 typedef struct {
     char signature[5];
@@ -53,31 +63,63 @@ typedef struct {
     uint32_t num_elements;
 } dfuse_target_prefix;
 
+/*
+offset is where the data of an element read from a dfuse file is in
+that file
+*/
 typedef struct {
     uint32_t element_address;
     uint32_t element_size;
     uint8_t *data;
+    uint32_t offset;
 } dfuse_image_element;
 
 typedef struct {
-    dfuse_target_prefix *tarprefix;
-    dfuse_image_element **imgelement;
+    dfuse_target_prefix tarprefix;
+    dfuse_image_element *imgelement;
+    uint32_t room;
 } dfuse_image;
 
+/*
+one block of the arena a dfuse file lives in, its memory follows the
+header
+*/
+typedef struct dfuse_chunk {
+    struct dfuse_chunk *next;
+    size_t size;
+    size_t used;
+} dfuse_chunk;
+
+/*
+a dfuse file and everything in it (the images and elements, which are
+arrays, and the element data) is carved from one arena of chunks, and
+dfuse_struct_cleanup() frees it all at once. A dfuse file read with
+dfuse_map() keeps the mapping, and the element data points into it.
+mapping_size is the size of the file it was read from.
+*/
 typedef struct {
-    dfuse_prefix *prefix;
-    dfuse_image **images;
-    dfuse_suffix *suffix;
+    dfuse_prefix prefix;
+    dfuse_image *images;
+    dfuse_suffix suffix;
+    uint8_t *mapping;
+    uint32_t mapping_size;
+    uint32_t room;
+    dfuse_chunk *arena;
 } dfuse_file;
 
 /*
-dfuse_init() allocates memory for the various dfuse structs
-that make up the dfuse file, and populates fields that are
-independent of the firmware image.
+dfuse_init() starts the arena of a dfuse file, and populates
+fields that are independent of the firmware image.
 */
 dfuse_file *dfuse_init(uint32_t device_id, uint32_t vendor_id,
                        uint32_t product_id);
 
+/*
+dfuse_addimage() and dfuse_addelement() append to the image and
+element arrays, the data of an element is carved from the arena.
+The pointer they return is good until the next image (or element
+of the same image) is added, the array may have moved then.
+*/
 dfuse_image *dfuse_addimage(dfuse_file *dfusefile, const char *target_name,
                             uint8_t alternate_setting);
 
@@ -85,50 +127,70 @@ dfuse_image_element *dfuse_addelement(dfuse_file *dfusefile, dfuse_image *image,
                                       unsigned int address, int size);
 
 /*
-dfuse_readbin() reads the binary firmware image into memory
+dfuse_addelement_view() adds an element whose data is kept elsewhere,
+in dfusefile->mapping, say, or nowhere if only the headers are
+packed. The data isn't copied.
+*/
+dfuse_image_element *dfuse_addelement_view(dfuse_file *dfusefile,
+                                           dfuse_image *image,
+                                           unsigned int address, int size,
+                                           uint8_t *data);
+
+/*
+dfuse_readbin() reads the binary firmware image into memory. Returns 0,
+or -1 if the image can't be allocated or read.
+*/
+int dfuse_readbin(dfuse_file *dfusefile, dfuse_image *image, int binfile);
+
+/*
+        dfuse_map() maps a dfuse file into memory, and checks the
+        prefix, every target prefix and element size, and the suffix
+        and its crc, before anything uses it. The element data isn't
+        copied, it points into the (read only) mapping, which
+        dfuse_struct_cleanup() unmaps. Returns NULL, and says why, if
+        the file can't be read or isn't a sound dfuse file.
+*/
+dfuse_file *dfuse_map(const char *file);
+
+/*
+        dfuse_scan() checks a dfuse file like dfuse_map() does, crc
+        and all, for a file that is streamed rather than mapped. It
+        reads through a window of DFUSE_SCAN_WINDOW bytes and keeps
+        only the headers: the element data is NULL, and its offset in
+        the file is kept. The file is left open in *fd. Returns NULL,
+        and says why, like dfuse_map().
+*/
+dfuse_file *dfuse_scan(const char *file, int *fd);
+
+/*
+        dfuse_crc_matches() tells whether crc (of the whole file up to
+        the crc itself) matches the one in the suffix.
 */
-void dfuse_readbin(dfuse_file *dfusefile, dfuse_image *image, int binfile);
+int dfuse_crc_matches(dfuse_file *dfusefile, uint32_t crc);
 
 /*
-        the dfuse_write{dfuse_file_part}() functions write the
-        corresponding dfuse file part from memory to a file.
-
-        the dfuse_read{dfuse_file_part}() functions read the
-        corresponding dfuse file part from a file into the
-        dfuse structure in memory.
-
-        These functions are delicate, they must be used
-        in the order:
-                prefix
-                tarprefix
-                imgelement(_meta)
-                (imgelement_data)
-                suffix
-
-        otherwise the file will be malformed, or the data read
-        into memory will go in to the wrong fields
+        the dfuse_pack{dfuse_file_part}() functions lay out the
+        corresponding dfuse file part in buf, byte for byte as it
+        is in the file, for writers that stream a dfuse file and
+        checksum it on the way (dfuse_write() is one). They return
+        the number of bytes packed (STMDFU_PREFIXLEN etc.). The suffix
+        is packed with the crc that is in it at the time.
 */
-int dfuse_writeprefix(dfuse_file *dfusefile, int dfufile);
-int dfuse_writetarprefix(dfuse_image *image, int dfufile);
-int dfuse_writeimgelement(dfuse_image_element *el, int dfufile);
-int dfuse_writesuffix(dfuse_file *dfusefile, int dfufile);
-int dfuse_writeimages(dfuse_file *dfusefile, int dfufile);
-
-int dfuse_readprefix(dfuse_file *dfusefile, int dfufile);
-int dfuse_readtarprefix(dfuse_image *image, int dfufile);
-int dfuse_readimgelement_meta(dfuse_image_element *el, int dfufile);
-int dfuse_readimgelement_data(dfuse_image_element *el, int dfufile);
-int dfuse_readsuffix(dfuse_file *dfusefile, int dfufile);
+int dfuse_packprefix(dfuse_file *dfusefile, uint8_t *buf);
+int dfuse_packtarprefix(dfuse_image *image, uint8_t *buf);
+int dfuse_packimgelement_meta(dfuse_image_element *el, uint8_t *buf);
+int dfuse_packsuffix(dfuse_file *dfusefile, uint8_t *buf);
 
 /*
-calccrc() calculates a 32 bit CRC to go in the
-suffix of the dfuse file
+dfuse_write() writes the whole dfuse file in one pass, and
+fills in the CRC of the suffix on the way. Returns the
+number of bytes written, or -1.
 */
-void calccrc(dfuse_file *dfusefile, int dfufile);
+int dfuse_write(dfuse_file *dfusefile, int dfufile);
 
 /*
-dfuse_struct_cleanup() deallocates the dfuse file
-structures
+dfuse_struct_cleanup() frees the arena of the dfuse file, and
+with it everything in it, and unmaps the file it was read from
 */
 void dfuse_struct_cleanup(dfuse_file *dfusefile);
 #endif
\ No newline at end of file
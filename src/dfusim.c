@@ -0,0 +1,569 @@
+/*
+dfusim.{c,h} :
+A simulated STM32 DfuSe bootloader, as a dfu transport. It models the DfuSe
+state machine (set address, erase and mass erase commands, block numbered
+download and upload, leaving dfu mode, read protection) on top of memory
+buffers laid out like an STM32F4 with 1MB of flash, and makes the requests
+take configurable times. Everything above dfurequests.c can be run and
+benchmarked against it without any hardware.
+
+More information on the DfuSe commands is available in the application note
+USB DFU protocol used in the STM32 Bootloader, AN3156.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libusb-1.0/libusb.h>
+#include "dfulayout.h"
+#include "dfurequests.h"
+#include "dfusim.h"
+
+/*
+        the memory regions of the simulated chip, one per alternate setting
+*/
+static const char *dfusim_layouts[DFUSIM_NUM_ALTS] = {
+    "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg",
+    "@Option Bytes  /0x1FFFC000/01*016 e",
+    "@OTP Memory /0x1FFF7800/01*512 e,01*016 e",
+    "@Device Feature/0xFFFF0000/01*004 e"};
+
+/*
+        dfusim_parse_config() fills config with the defaults, then with the
+        key=value pairs of spec. The default times are much shorter than a
+        real chip's, so that test runs stay quick.
+*/
+int32_t dfusim_parse_config(const char *spec, dfusim_config *config)
+{
+    char key[32];
+    const char *p = spec;
+    char *end;
+    int len;
+
+    memset(config, 0, sizeof(*config));
+    config->devices = 1;
+    config->erase_us_per_kb = 500;
+    config->mass_erase_ms = 500;
+    config->program_us_per_kb = 400;
+    config->command_us = 1000;
+    config->request_us = 50;
+
+    while (p != NULL && *p) {
+        len = strcspn(p, "=");
+        if (p[len] != '=' || len >= (int)sizeof(key)) {
+            printf("dfusim: can't parse <%s>\n", p);
+            return -1;
+        }
+        memcpy(key, p, len);
+        key[len] = 0;
+        p += len + 1;
+
+        if (!strcmp(key, "dir")) {
+            len = strcspn(p, ",");
+            if (len >= (int)sizeof(config->dir)) {
+                len = sizeof(config->dir) - 1;
+            }
+            memcpy(config->dir, p, len);
+            config->dir[len] = 0;
+            p += strcspn(p, ",");
+        } else {
+            uint32_t value = strtoul(p, &end, 0);
+
+            if (!strcmp(key, "devices")) {
+                config->devices = value;
+            } else if (!strcmp(key, "erase_us_per_kb")) {
+                config->erase_us_per_kb = value;
+            } else if (!strcmp(key, "mass_erase_ms")) {
+                config->mass_erase_ms = value;
+            } else if (!strcmp(key, "program_us_per_kb")) {
+                config->program_us_per_kb = value;
+            } else if (!strcmp(key, "command_us")) {
+                config->command_us = value;
+            } else if (!strcmp(key, "request_us")) {
+                config->request_us = value;
+            } else if (!strcmp(key, "poll_ms")) {
+                config->poll_timeout_ms = value;
+            } else if (!strcmp(key, "rdp")) {
+                config->read_protected = value;
+            } else {
+                printf("dfusim: unknown setting <%s>\n", key);
+                return -1;
+            }
+            p = end;
+        }
+
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    if (config->devices < 1 || config->devices > DFUSIM_MAX_DEVICES) {
+        printf("dfusim: can simulate 1 to %d devices\n", DFUSIM_MAX_DEVICES);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dfusim_sleep_until(const struct timespec *until)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, until, NULL)) {
+    }
+}
+
+static void dfusim_sleep_us(uint32_t us)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += us / 1000000;
+    until.tv_nsec += (us % 1000000) * 1000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    dfusim_sleep_until(&until);
+}
+
+/*
+        dfusim_stall() answers a request the device doesn't accept in its
+        state: it goes into dfuERROR, and the request stalls.
+*/
+static int32_t dfusim_stall(dfusim_device *sim, uint8_t status)
+{
+    sim->state = STATE_DFU_ERROR;
+    sim->status = status;
+
+    return LIBUSB_ERROR_PIPE;
+}
+
+static uint32_t dfusim_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+        dfusim_memory() points at length bytes at address in the memory of
+        the selected alternate setting. Returns NULL if they aren't all in it.
+*/
+static uint8_t *dfusim_memory(dfusim_device *sim, uint32_t address,
+                              uint32_t length)
+{
+    uint32_t start = dfu_region_start(&sim->regions[sim->alt]);
+
+    if (address < start || address - start > sim->memory_size[sim->alt] ||
+        length > sim->memory_size[sim->alt] - (address - start)) {
+        return NULL;
+    }
+
+    return sim->memory[sim->alt] + (address - start);
+}
+
+/*
+        dfusim_mass_erase() erases the whole flash.
+*/
+static void dfusim_mass_erase(dfusim_device *sim)
+{
+    memset(sim->memory[0], 0xff, sim->memory_size[0]);
+}
+
+/*
+        dfusim_duration_us() is how long the pending download takes once
+        GETSTATUS has started it.
+*/
+static uint32_t dfusim_duration_us(dfusim_device *sim)
+{
+    dfu_sector sector;
+    uint8_t command = sim->pending[0];
+
+    if (sim->pending_block >= 2) {
+        return (uint64_t)sim->pending_length * sim->config.program_us_per_kb /
+               1024;
+    }
+
+    if ((command == DFUSIM_CMD_ERASE && sim->pending_length == 1) ||
+        command == DFUSIM_CMD_READ_UNPROTECT) {
+        return sim->config.mass_erase_ms * 1000;
+    }
+
+    if (command == DFUSIM_CMD_ERASE && sim->pending_length == 5 &&
+        !dfu_layout_find_sector(&sim->regions[sim->alt], 1,
+                                dfusim_le32(&sim->pending[1]), &sector)) {
+        return sector.size / 1024 * sim->config.erase_us_per_kb;
+    }
+
+    return sim->config.command_us;
+}
+
+/*
+        dfusim_execute() carries out the pending download when it is done,
+        and sets the state and status it ends in.
+*/
+static void dfusim_execute(dfusim_device *sim)
+{
+    dfu_sector sector;
+    uint8_t command = sim->pending[0];
+    uint32_t address, i;
+    uint8_t *p;
+
+    sim->state = STATE_DFU_DOWNLOAD_IDLE;
+    sim->status = DFU_STATUS_OK;
+
+    // a data block goes to the address pointer, in blocks of wTransferSize
+    if (sim->pending_block >= 2) {
+        address = sim->address + (sim->pending_block - 2) * DFUSIM_TRANSFER_SIZE;
+        p = dfusim_memory(sim, address, sim->pending_length);
+
+        if (sim->read_protected) {
+            dfusim_stall(sim, DFU_STATUS_ERROR_VENDOR);
+        } else if (p == NULL) {
+            dfusim_stall(sim, DFU_STATUS_ERROR_ADDRESS);
+        } else {
+            // flash can only be programmed from 1s to 0s
+            for (i = 0; i < sim->pending_length; i++) {
+                if ((p[i] & sim->pending[i]) != sim->pending[i]) {
+                    dfusim_stall(sim, DFU_STATUS_ERROR_PROG);
+                    return;
+                }
+                p[i] = sim->pending[i];
+            }
+        }
+        return;
+    }
+
+    if (command == DFUSIM_CMD_SET_ADDRESS && sim->pending_length == 5) {
+        sim->address = dfusim_le32(&sim->pending[1]);
+    } else if (command == DFUSIM_CMD_ERASE && sim->pending_length == 1) {
+        if (sim->read_protected) {
+            dfusim_stall(sim, DFU_STATUS_ERROR_VENDOR);
+        } else {
+            dfusim_mass_erase(sim);
+        }
+    } else if (command == DFUSIM_CMD_ERASE && sim->pending_length == 5) {
+        address = dfusim_le32(&sim->pending[1]);
+        if (sim->read_protected) {
+            dfusim_stall(sim, DFU_STATUS_ERROR_VENDOR);
+        } else if (dfu_layout_find_sector(&sim->regions[sim->alt], 1, address,
+                                          &sector) ||
+                   !(sector.attributes & DFU_SECTOR_ERASABLE)) {
+            dfusim_stall(sim, DFU_STATUS_ERROR_TARGET);
+        } else {
+            memset(dfusim_memory(sim, sector.address, sector.size), 0xff,
+                   sector.size);
+        }
+    } else if (command == DFUSIM_CMD_READ_UNPROTECT) {
+        // removing the protection takes the contents of the flash with it
+        dfusim_mass_erase(sim);
+        sim->read_protected = 0;
+    } else {
+        dfusim_stall(sim, DFU_STATUS_ERROR_TARGET);
+    }
+}
+
+static int32_t dfusim_download(dfusim_device *sim, uint16_t block,
+                               uint8_t *data, uint16_t length)
+{
+    if (sim->state != STATE_DFU_IDLE &&
+        sim->state != STATE_DFU_DOWNLOAD_IDLE) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+    }
+
+    // a zero length download after a transfer makes the device leave
+    if (length == 0) {
+        if (sim->state != STATE_DFU_DOWNLOAD_IDLE) {
+            return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+        }
+        sim->state = STATE_DFU_MANIFEST_SYNC;
+        return 0;
+    }
+
+    if (block == 1 || length > DFUSIM_TRANSFER_SIZE) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+    }
+
+    memcpy(sim->pending, data, length);
+    sim->pending_block = block;
+    sim->pending_length = length;
+    sim->state = STATE_DFU_DOWNLOAD_SYNC;
+
+    return length;
+}
+
+static int32_t dfusim_upload(dfusim_device *sim, uint16_t block,
+                             uint8_t *data, uint16_t length)
+{
+    static const uint8_t commands[] = {DFUSIM_CMD_GET, DFUSIM_CMD_SET_ADDRESS,
+                                       DFUSIM_CMD_ERASE,
+                                       DFUSIM_CMD_READ_UNPROTECT};
+    uint32_t address, start, end;
+    uint8_t *p;
+
+    if (sim->state != STATE_DFU_IDLE && sim->state != STATE_DFU_UPLOAD_IDLE) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+    }
+
+    if (block == 0) {
+        if (length > sizeof(commands)) {
+            length = sizeof(commands);
+        }
+        memcpy(data, commands, length);
+        sim->state = STATE_DFU_UPLOAD_IDLE;
+        return length;
+    }
+
+    if (block == 1 || length > DFUSIM_TRANSFER_SIZE) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+    }
+
+    if (sim->read_protected && sim->alt == 0) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_VENDOR);
+    }
+
+    // reads are cut short at the end of the memory
+    address = sim->address + (block - 2) * DFUSIM_TRANSFER_SIZE;
+    start = dfu_region_start(&sim->regions[sim->alt]);
+    end = start + sim->memory_size[sim->alt];
+    if (address >= start && address < end && end - address < length) {
+        length = end - address;
+    }
+
+    p = dfusim_memory(sim, address, length);
+    if (p == NULL) {
+        return dfusim_stall(sim, DFU_STATUS_ERROR_ADDRESS);
+    }
+
+    memcpy(data, p, length);
+    sim->state = STATE_DFU_UPLOAD_IDLE;
+
+    return length;
+}
+
+static int32_t dfusim_get_status(dfusim_device *sim, uint8_t *data,
+                                 uint16_t length)
+{
+    uint32_t duration_us, poll_timeout = 0;
+
+    if (length < 6) {
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    if (sim->state == STATE_DFU_DOWNLOAD_SYNC) {
+        // the first GETSTATUS starts the operation
+        duration_us = dfusim_duration_us(sim);
+        clock_gettime(CLOCK_MONOTONIC, &sim->busy_until);
+        sim->busy_until.tv_sec += duration_us / 1000000;
+        sim->busy_until.tv_nsec += (duration_us % 1000000) * 1000;
+        if (sim->busy_until.tv_nsec >= 1000000000) {
+            sim->busy_until.tv_sec++;
+            sim->busy_until.tv_nsec -= 1000000000;
+        }
+
+        sim->state = STATE_DFU_DOWNLOAD_BUSY;
+        poll_timeout = sim->config.poll_timeout_ms ?
+                           sim->config.poll_timeout_ms :
+                           (duration_us + 999) / 1000;
+    } else if (sim->state == STATE_DFU_DOWNLOAD_BUSY) {
+        // a busy device doesn't answer until it is done
+        dfusim_sleep_until(&sim->busy_until);
+        dfusim_execute(sim);
+    } else if (sim->state == STATE_DFU_MANIFEST_SYNC) {
+        // the device resets into the application after this answer
+        sim->state = STATE_DFU_MANIFEST;
+        sim->gone = 1;
+    }
+
+    data[0] = sim->status;
+    data[1] = poll_timeout & 0xff;
+    data[2] = (poll_timeout >> 8) & 0xff;
+    data[3] = (poll_timeout >> 16) & 0xff;
+    data[4] = sim->state;
+    data[5] = 0;
+
+    return 6;
+}
+
+static int32_t dfusim_control(dfu_device *device, uint8_t request_type,
+                              uint8_t request, uint16_t wvalue,
+                              uint8_t *data, uint16_t length,
+                              uint32_t timeout)
+{
+    dfusim_device *sim = (dfusim_device *)device->transport_data;
+
+    (void)request_type;
+    (void)timeout;
+
+    if (sim->gone) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    // the round trip over the bus
+    dfusim_sleep_us(sim->config.request_us);
+
+    switch (request) {
+    case DFU_DNLOAD:
+        return dfusim_download(sim, wvalue, data, length);
+    case DFU_UPLOAD:
+        return dfusim_upload(sim, wvalue, data, length);
+    case DFU_GETSTATUS:
+        return dfusim_get_status(sim, data, length);
+    case DFU_CLRSTATUS:
+        sim->state = STATE_DFU_IDLE;
+        sim->status = DFU_STATUS_OK;
+        return 0;
+    case DFU_GETSTATE:
+        data[0] = sim->state;
+        return 1;
+    case DFU_ABORT:
+        if (sim->state == STATE_DFU_DOWNLOAD_BUSY) {
+            return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+        }
+        sim->state = STATE_DFU_IDLE;
+        sim->status = DFU_STATUS_OK;
+        return 0;
+    }
+
+    // DETACH is an application mode request
+    return dfusim_stall(sim, DFU_STATUS_ERROR_STALLEDPKT);
+}
+
+static int32_t dfusim_set_altsetting(dfu_device *device, int32_t altsetting)
+{
+    dfusim_device *sim = (dfusim_device *)device->transport_data;
+
+    if (altsetting < 0 || altsetting >= DFUSIM_NUM_ALTS) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    sim->alt = altsetting;
+
+    return sim->gone ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+static int32_t dfusim_reset(dfu_device *device)
+{
+    dfusim_device *sim = (dfusim_device *)device->transport_data;
+
+    sim->gone = 1;
+
+    return 0;
+}
+
+static void dfusim_close(dfu_device *device)
+{
+    dfusim_device *sim = (dfusim_device *)device->transport_data;
+    int i;
+
+    for (i = 0; i < DFUSIM_NUM_ALTS; i++) {
+        if (i == 0 && sim->mapped) {
+            munmap(sim->memory[i], sim->memory_size[i]);
+        } else {
+            free(sim->memory[i]);
+        }
+    }
+
+    free(sim);
+}
+
+const dfu_transport dfusim_transport = {"sim", dfusim_control,
+                                        dfusim_set_altsetting, dfusim_reset,
+                                        dfusim_close};
+
+/*
+        dfusim_map_flash() keeps the flash of a device in a file in dir, so
+        that what one run flashes the next one can read back.
+*/
+static uint8_t *dfusim_map_flash(const char *dir, int index, uint32_t size)
+{
+    char path[512];
+    struct stat st;
+    uint8_t *memory;
+    int fd, fresh;
+
+    snprintf(path, sizeof(path), "%s/sim%d.flash", dir, index);
+
+    // the caller falls back to flash that isn't kept, so every failure
+    // is reported
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st)) {
+        printf("dfusim: can't open <%s>, its flash won't be kept\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    fresh = st.st_size != size;
+    if (fresh && ftruncate(fd, size)) {
+        printf("dfusim: can't size <%s>, its flash won't be kept\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    memory = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        printf("dfusim: can't map <%s>, its flash won't be kept\n", path);
+        return NULL;
+    }
+
+    if (fresh) {
+        memset(memory, 0xff, size);
+    }
+
+    return memory;
+}
+
+/*
+        dfusim_open_devices() creates the simulated devices and fills in
+        what probing a usb device would.
+*/
+int32_t dfusim_open_devices(dfusim_config *config, dfu_device ***devices)
+{
+    uint32_t i, j;
+
+    *devices = (dfu_device **)calloc(config->devices + 1, sizeof(dfu_device *));
+
+    for (i = 0; i < config->devices; i++) {
+        dfu_device *dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+        dfusim_device *sim = (dfusim_device *)calloc(1, sizeof(dfusim_device));
+
+        sim->config = *config;
+        sim->state = STATE_DFU_IDLE;
+        sim->read_protected = config->read_protected;
+
+        for (j = 0; j < DFUSIM_NUM_ALTS; j++) {
+            dfu_layout_parse(&sim->regions[j], dfusim_layouts[j], j);
+            sim->memory_size[j] = dfu_region_end(&sim->regions[j]) -
+                                  dfu_region_start(&sim->regions[j]);
+
+            if (j == 0 && config->dir[0]) {
+                sim->memory[j] =
+                    dfusim_map_flash(config->dir, i, sim->memory_size[j]);
+                sim->mapped = sim->memory[j] != NULL;
+            }
+            if (sim->memory[j] == NULL) {
+                sim->memory[j] = (uint8_t *)malloc(sim->memory_size[j]);
+                memset(sim->memory[j], 0xff, sim->memory_size[j]);
+            }
+
+            dfudev->regions[j] = sim->regions[j];
+        }
+
+        dfudev->transport = &dfusim_transport;
+        dfudev->transport_data = sim;
+        dfudev->num_regions = DFUSIM_NUM_ALTS;
+        dfudev->transfer_size = DFUSIM_TRANSFER_SIZE;
+        snprintf(dfudev->path, sizeof(dfudev->path), "sim-%u", i + 1);
+
+        (*devices)[i] = dfudev;
+    }
+
+    return config->devices;
+}
@@ -0,0 +1,81 @@
+/*
+dfusim.{c,h} :
+A simulated STM32 DfuSe bootloader, as a dfu transport. It models the DfuSe
+state machine (set address, erase and mass erase commands, block numbered
+download and upload, leaving dfu mode, read protection) on top of memory
+buffers laid out like an STM32F4 with 1MB of flash, and makes the requests
+take configurable times. Everything above dfurequests.c can be run and
+benchmarked against it without any hardware.
+
+More information on the DfuSe commands is available in the application note
+USB DFU protocol used in the STM32 Bootloader, AN3156.
+*/
+
+#ifndef __DFUSIM__
+#define __DFUSIM__
+
+#define DFUSIM_MAX_DEVICES 32
+#define DFUSIM_TRANSFER_SIZE 2048
+#define DFUSIM_NUM_ALTS 4
+
+/* DfuSe commands (the first byte of a download to block 0) */
+#define DFUSIM_CMD_GET 0x00
+#define DFUSIM_CMD_SET_ADDRESS 0x21
+#define DFUSIM_CMD_ERASE 0x41
+#define DFUSIM_CMD_READ_UNPROTECT 0x92
+
+/*
+dfusim_config is what can be set with -t sim:key=value,...: the number of
+devices, how long operations and requests take, the bwPollTimeout the
+devices report (0 reports how long the operation really takes), read
+protection, and a directory to keep the flash contents in between runs.
+*/
+typedef struct {
+    uint32_t devices;
+    uint32_t erase_us_per_kb;
+    uint32_t mass_erase_ms;
+    uint32_t program_us_per_kb;
+    uint32_t command_us;
+    uint32_t request_us;
+    uint32_t poll_timeout_ms;
+    int read_protected;
+    char dir[256];
+} dfusim_config;
+
+/*
+dfusim_device is the state of one simulated bootloader.
+*/
+typedef struct {
+    dfusim_config config;
+    dfu_region regions[DFUSIM_NUM_ALTS];
+    uint8_t *memory[DFUSIM_NUM_ALTS];
+    uint32_t memory_size[DFUSIM_NUM_ALTS];
+    int mapped;
+    int32_t alt;
+    uint8_t state;
+    uint8_t status;
+    uint32_t address;
+    int read_protected;
+    int gone;
+    uint16_t pending_block;
+    uint16_t pending_length;
+    uint8_t pending[DFUSIM_TRANSFER_SIZE];
+    struct timespec busy_until;
+} dfusim_device;
+
+extern const dfu_transport dfusim_transport;
+
+/*
+dfusim_parse_config() fills config with the defaults, then with the
+key=value pairs of spec (comma separated, may be NULL). Returns 0 on
+success, or < 0 if a key is unknown.
+*/
+int32_t dfusim_parse_config(const char *spec, dfusim_config *config);
+
+/*
+dfusim_open_devices() creates config->devices simulated devices, ready as if
+found and probed on usb. Returns the number of devices, the devices are
+returned in a malloc'd array and are closed like any other device.
+*/
+int32_t dfusim_open_devices(dfusim_config *config, dfu_device ***devices);
+#endif
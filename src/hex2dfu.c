@@ -7,159 +7,130 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "crc32.h"
 #include "dfuse.h"
+#include "ihex.h"
 
-int hex2bin(unsigned char *obuf, const char *ibuf, int len)
+/*
+        one input file. The files are opened (mapped and scanned for the
+        extents of their data) and then decoded into the elements laid out
+        from the extents of all of them, on a thread each.
+*/
+typedef struct {
+    const char *path;
+    ihex_file hex;
+    ihex_region *regions;
+    int32_t num_regions;
+    int32_t result;
+} hex2dfu_job;
+
+static void *hex2dfu_open_worker(void *arg)
 {
-    unsigned char c, c2;
-
-    len = len / 2;
-    while (*ibuf != 0) {
-        c = *ibuf++;
-        if (c >= '0' && c <= '9')
-            c -= '0';
-        else if (c >= 'a' && c <= 'f')
-            c -= 'a' - 10;
-        else if (c >= 'A' && c <= 'F')
-            c -= 'A' - 10;
-        else
-            return -1;
-
-        c2 = *ibuf++;
-        if (c2 >= '0' && c2 <= '9')
-            c2 -= '0';
-        else if (c2 >= 'a' && c2 <= 'f')
-            c2 -= 'a' - 10;
-        else if (c2 >= 'A' && c2 <= 'F')
-            c2 -= 'A' - 10;
-        else
-            return -1;
-
-        *obuf++ = (c << 4) | c2;
-    }
-    return len;
+    hex2dfu_job *job = (hex2dfu_job *)arg;
+
+    job->result = ihex_open(&job->hex, job->path);
+
+    return NULL;
 }
 
-int check_checksum(uint8_t *inbuf, int len)
+static void *hex2dfu_decode_worker(void *arg)
 {
-    unsigned int check = 0;
-    while (len--) {
-        check += *inbuf++;
-    }
-    return check & 0xFF;
+    hex2dfu_job *job = (hex2dfu_job *)arg;
+
+    job->result = ihex_decode(&job->hex, job->regions, job->num_regions);
+
+    return NULL;
 }
 
-// more details: http://en.wikipedia.org/wiki/Intel_HEX
-uint8_t *ihex2bin_buf(unsigned int *start_address, int *dst_len,
-                      const char *file)
+/*
+        hex2dfu_run() runs worker for every job, each on its own thread.
+        Returns the number of jobs that failed.
+*/
+static int hex2dfu_run(hex2dfu_job *jobs, int njobs, void *(*worker)(void *))
 {
-    unsigned int lines = 0, total = 0, oneline_len, elar = 0, pos, cnt;
-    char oneline[512];
-    uint8_t raw[256], *dst=NULL;
-    int start_set = 0;
-
-    FILE *fp = fopen(file, "r");
-    if (fp) {
-        *dst_len = 1024 * 128;
-        dst = malloc(*dst_len); // allocate 128kB of memory for bin data buffer
-        if (dst == NULL) {
-            *dst_len = -2;
-            return NULL;
+    pthread_t *threads = (pthread_t *)calloc(njobs, sizeof(pthread_t));
+    int i, failed = 0;
+
+    for (i = 0; i < njobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &jobs[i])) {
+            worker(&jobs[i]);
+            threads[i] = 0;
         }
+    }
 
-        *start_address = 0;
-
-        while (fgets(oneline, sizeof(oneline), fp) != NULL) {
-            if (oneline[0] == ':') {                    // is valid record?
-                oneline_len = strlen(oneline) - 2;      // get line length
-                hex2bin(raw, oneline + 1, oneline_len); // convert to bin
-                if (check_checksum(raw, oneline_len / 2) ==
-                    0) { // check cheksum validity
-                    if ((raw[0] == 2) && (raw[1] == 0) && (raw[2] == 0) &&
-                        (raw[3] == 4)) { //> Extended Linear Address Record
-                                         //:020000040803EF
-                        elar = (unsigned int)raw[4] << 24 |
-                               (unsigned int)raw[5]
-                                   << 16; // gen new address offset
-                    } else if ((raw[0] == 0) && (raw[1] == 0) &&
-                               (raw[2] == 0) &&
-                               (raw[3] ==
-                                1)) {     //>End Of File record   :00000001FF
-                        *dst_len = total; // return total size of bin data &&
-                                          // start address
-                        return dst;
-                    } else if (raw[3] == 0) { //>Data record - process
-                        pos = elar +
-                              ((unsigned int)raw[1] << 8 |
-                               (unsigned int)
-                                   raw[2]); // get start address of this chunk
-                        if (start_set == 0) {
-                            *start_address =
-                                pos;       // set it as new start address - only
-                                           // possible for first data record
-                            start_set = 1; // only once - this is start address
-                                           // of thye binary data
-                        }
-                        pos -= *start_address;
-                        cnt = raw[0]; // get chunk size/length
-                        if (pos + cnt >
-                            *dst_len) { // enlarge buffer if required
-                            unsigned char *dst_new = realloc(
-                                dst, *dst_len + 8192); // add 8kB of new space
-                            if (dst_new == NULL) {
-                                *dst_len = -2; // allocation error - exit
-                                free(dst);
-                                return NULL;
-                            } else {
-                                *dst_len += 8192;
-                                dst = dst_new; // allocation succesed - copy new
-                                               // pointer
-                            }
-                        }
-                        memmove(dst + pos, raw + 4, cnt);
-                        if (pos + cnt > total) { // set new total variable
-                            total =
-                                pos +
-                                cnt; // tricky way - file can be none linear!
-                        }
-                    }
-                } else {
-                    *dst_len = -1; // checksum error - exit
-                    return NULL;
-                }
-            }
-            lines++; // not a IntelHex line - comment?
+    for (i = 0; i < njobs; i++) {
+        if (threads[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].result < 0) {
+            failed++;
         }
-        *dst_len = -3; // fatal error - no valid intel hex file processed
-        free(dst);
     }
-    return NULL;
+
+    free(threads);
+
+    return failed;
+}
+
+/*
+        hex2dfu_place_crc() stores the crc32 of an element, from its start up
+        to address, at address.
+*/
+static void hex2dfu_place_crc(dfuse_image *image, unsigned int address)
+{
+    unsigned int i, offset;
+    u_int32_t crc;
+
+    for (i = 0; i < image->tarprefix.num_elements; i++) {
+        dfuse_image_element *el = &image->imgelement[i];
+
+        offset = address - el->element_address;
+        if (address >= el->element_address && el->element_size >= 4 &&
+            offset <= el->element_size - 4) {
+            crc = crc32_update(0, el->data, offset);
+            el->data[offset] = crc & 0xff;
+            el->data[offset + 1] = (crc >> 8) & 0xff;
+            el->data[offset + 2] = (crc >> 16) & 0xff;
+            el->data[offset + 3] = crc >> 24;
+            printf("   CRC32: 0x%.8x at 0x%.8x\n\n", crc, address);
+            return;
+        }
+    }
+
+    printf("   CRC32: 0x%.8x isn't in any element\n\n", address);
 }
 
 void print_help(void)
 {
     printf("STM32 hextodfu v0.1\n\n");
     printf("Options:\n");
-    printf("-c        - place CRC23 under this address (optional)\n");
+    printf("-c        - place CRC32 under this address (optional)\n");
     printf("-d        - firmware version number (optional, default: 0xFFFF)\n");
+    printf("-g        - largest gap filled with 0xFF within an element, larger\n");
+    printf("            gaps start a new element (optional, default: %d)\n",
+           IHEX_MAX_GAP);
     printf("-h        - help\n");
     printf("-o        - output DFU file name (mandatory)\n");
     printf("-p        - USB ProductID (optional, default: 0xDF11)\n");
-    printf("-v        - USB VendorID (optional, default: 0x0483)\n\n");
+    printf("-v        - USB VendorID (optional, default: 0x0483)\n");
+    printf("-x        - where files overlap, the later file wins (optional,\n");
+    printf("            default: overlaps are an error)\n\n");
     printf("Example: hex2dfu -o outfile.dfu file1.hex file2.hex ...\n\n");
 }
 
 int main(int argc, char *argv[])
 {
-    unsigned int add_crc32 = 0;
+    unsigned int add_crc32 = 0, max_gap = IHEX_MAX_GAP;
+    int overwrite = 0, overlaps = 0, rv = 0;
     int vendor_id = 0x0483, product_id = 0xdf11, device_id = 0xffff;
     const char *outfile = NULL;
 
     int c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "hv:p:d:o:c:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:p:d:o:c:g:x")) != -1) {
         switch (c) {
         case 'p': // PID
             product_id = strtol(optarg, NULL, 16);
@@ -173,6 +144,12 @@ int main(int argc, char *argv[])
         case 'c': // place crc32 at this address
             add_crc32 = strtol(optarg, NULL, 16);
             break;
+        case 'g': // largest gap within an element
+            max_gap = strtoul(optarg, NULL, 0);
+            break;
+        case 'x': // later files overwrite earlier ones
+            overwrite = 1;
+            break;
         case 'o': // output file name
             outfile = optarg;
             break;
@@ -187,41 +164,111 @@ int main(int argc, char *argv[])
         }
     }
 
-    int dfufile = open(outfile, O_RDWR | O_CREAT | O_TRUNC,
-                       S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    if (outfile == NULL || optind >= argc) {
+        print_help();
+        return 1;
+    }
 
-    if (dfufile == -1) {
-        printf("Could not create %s\n", argv[2]);
-        return -2;
+    int njobs = argc - optind;
+    hex2dfu_job *jobs = (hex2dfu_job *)calloc(njobs, sizeof(hex2dfu_job));
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].path = argv[optind + i];
     }
 
     dfuse_file *dfusefile = dfuse_init(device_id, vendor_id, product_id);
     dfuse_image *image = dfuse_addimage(dfusefile, outfile, 0);
 
     printf("Generating Image \e[1;4;32m%s\e[0m:\n\n", outfile);
-    for (int i = optind; i < argc; i++) {
-        unsigned int start_address = 0;
-        int dst_len = 0;
-        printf("   Element: \e[1;4;34m%s\e[0m\n", argv[i]);
-        const uint8_t *buf = ihex2bin_buf(&start_address, &dst_len, argv[i]);
-        printf("   Address: 0x%.8x - 0x%.8x (%d bytes) \n\n", start_address,
-               start_address + dst_len, dst_len);
-        if (buf) {
-            dfuse_image_element *el =
-                dfuse_addelement(dfusefile, image, start_address, dst_len);
-            memcpy(el->data, buf, dst_len);
+
+    // the extents of the data come from the first pass, and are laid out
+    // in elements, the data is then decoded straight into them
+    int failed = hex2dfu_run(jobs, njobs, hex2dfu_open_worker);
+    ihex_file *files = (ihex_file *)calloc(njobs, sizeof(ihex_file));
+    ihex_region *regions = NULL;
+    int num_regions = 0;
+
+    for (int i = 0; i < njobs && !failed; i++) {
+        files[i] = jobs[i].hex;
+        printf("   File:    \e[1;4;34m%s\e[0m\n", jobs[i].path);
+        printf("   Data:    0x%.8x - 0x%.8x (%u bytes in %u extents)\n\n",
+               files[i].start_address, files[i].end_address, files[i].bytes,
+               files[i].num_extents);
+    }
+    if (!failed) {
+        num_regions = ihex_plan(files, njobs, max_gap, overwrite, &overlaps,
+                                &regions);
+        failed = num_regions < 0;
+    }
+    for (int i = 0; i < num_regions; i++) {
+        dfuse_image_element *el = dfuse_addelement(
+            dfusefile, image, regions[i].address, regions[i].size);
+
+        if (el == NULL) {
+            printf("Out of memory for 0x%.8x - 0x%.8x\n", regions[i].address,
+                   regions[i].address + regions[i].size);
+            num_regions = i;
+            failed = 1;
+            break;
         }
+
+        printf("   Element: 0x%.8x - 0x%.8x (%u bytes) \n", regions[i].address,
+               regions[i].address + regions[i].size, regions[i].size);
+        memset(el->data, 0xff, regions[i].size);
+        regions[i].data = el->data;
+    }
+    if (num_regions > 0) {
         printf("\n");
     }
 
-    dfuse_writeprefix(dfusefile, dfufile);
-    dfuse_writeimages(dfusefile, dfufile);
-    dfuse_writesuffix(dfusefile, dfufile);
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].regions = regions;
+        jobs[i].num_regions = num_regions > 0 ? num_regions : 0;
+    }
+    if (!failed && overlaps) {
+        // the later file wins, so they go one after the other
+        for (int i = 0; i < njobs && !failed; i++) {
+            hex2dfu_decode_worker(&jobs[i]);
+            failed = jobs[i].result < 0;
+        }
+    } else if (!failed) {
+        failed = hex2dfu_run(jobs, njobs, hex2dfu_decode_worker);
+    }
+
+    for (int i = 0; i < njobs; i++) {
+        ihex_close(&jobs[i].hex);
+    }
+    free(jobs);
+    free(files);
+    free(regions);
+
+    if (failed) {
+        dfuse_struct_cleanup(dfusefile);
+        return 1;
+    }
+
+    if (add_crc32) {
+        hex2dfu_place_crc(image, add_crc32);
+    }
+
+    int dfufile = open(outfile, O_WRONLY | O_CREAT | O_TRUNC,
+                       S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    if (dfufile == -1) {
+        printf("Could not create %s\n", outfile);
+        dfuse_struct_cleanup(dfusefile);
+        return -2;
+    }
+
+    // a truncated file mustn't pass for a good one
+    if (dfuse_write(dfusefile, dfufile) < 0) {
+        printf("Could not write %s\n", outfile);
+        rv = -3;
+    }
 
-    // printf("Checksum: <%x>\n", dfusefile->suffix->crc);
+    // printf("Checksum: <%x>\n", dfusefile->suffix.crc);
 
     dfuse_struct_cleanup(dfusefile);
     close(dfufile);
 
-    return 0;
+    return rv;
 }
\ No newline at end of file
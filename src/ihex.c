@@ -0,0 +1,547 @@
+/*
+ihex.{c,h} :
+Reads Intel HEX files. A file is mapped into memory and gone over twice:
+once for the extents of its data, which only needs the record headers, and
+once to decode the data records straight into place. In between the
+extents of all the files are laid out in a sorted interval map, overlaps
+between files are found, and extents that are close are merged into
+regions, so that a gap in the data doesn't have to be stored (or flashed).
+Files can be decoded on separate threads.
+
+More information on the format: http://en.wikipedia.org/wiki/Intel_HEX
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ihex.h"
+
+/*
+        one record, as found by ihex_next(). data points at the hex digits
+        of the data, which are followed by the two of the checksum.
+*/
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint16_t address;
+    const char *data;
+} ihex_record;
+
+static int ihex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int ihex_byte(const char *p)
+{
+    int hi = ihex_nibble(p[0]);
+    int lo = ihex_nibble(p[1]);
+
+    if (hi < 0 || lo < 0) {
+        return -1;
+    }
+
+    return hi << 4 | lo;
+}
+
+#ifdef __SSE2__
+/*
+        ihex_unhex16() decodes 32 hex digits into 16 bytes, and returns
+        the mask of the digits that were valid (0xffff for both halves).
+        Digits are told apart with byte compares, '0'-'9' from the digit
+        and 'a'-'f' from the digit or'ed with 0x20, and pairs of nibbles
+        are joined within 16 bit lanes.
+*/
+static int ihex_unhex16(uint8_t *out, const char *in, __m128i *sum)
+{
+    const __m128i lowbyte = _mm_set1_epi16(0x00ff);
+    __m128i words[2];
+    int valid = 0xffff;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+        __m128i alpha =
+            _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        __m128i value = _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(x, _mm_set1_epi8('0'))),
+            _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+        valid &= _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+
+        // the first digit of a pair is the high nibble
+        words[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, lowbyte), 4),
+                                _mm_srli_epi16(value, 8));
+    }
+
+    words[0] = _mm_packus_epi16(words[0], words[1]);
+    _mm_storeu_si128((__m128i *)out, words[0]);
+    *sum = _mm_add_epi64(*sum, _mm_sad_epu8(words[0], _mm_setzero_si128()));
+
+    return valid;
+}
+#endif
+
+/*
+        ihex_unhex() decodes 2 * length hex digits from in into length bytes
+        at out, and adds the bytes to *sum for the checksum. Runs of 16 bytes
+        go through SSE2 where there is SSE2 (all of x86-64), the rest a byte
+        at a time. Returns -1 on a bad digit.
+*/
+static int ihex_unhex(uint8_t *out, const char *in, uint32_t length,
+                      uint32_t *sum)
+{
+    int byte;
+
+#ifdef __SSE2__
+    __m128i vsum = _mm_setzero_si128();
+    uint64_t sums[2];
+
+    for (; length >= 16; length -= 16) {
+        if (ihex_unhex16(out, in, &vsum) != 0xffff) {
+            return -1;
+        }
+        out += 16;
+        in += 32;
+    }
+
+    _mm_storeu_si128((__m128i *)sums, vsum);
+    *sum += sums[0] + sums[1];
+#endif
+
+    for (; length; length--) {
+        byte = ihex_byte(in);
+        if (byte < 0) {
+            return -1;
+        }
+        *out++ = byte;
+        *sum += byte;
+        in += 2;
+    }
+
+    return 0;
+}
+
+/*
+        ihex_next() finds the next record from *p on, skipping lines that
+        aren't records, and moves *p to the line after it. Returns 1 for a
+        record, 0 at the end of the file, or -1 (and says why) if the record
+        is cut short or its header isn't hex.
+*/
+static int ihex_next(ihex_file *hex, const char **p, uint32_t *line,
+                     ihex_record *rec)
+{
+    const char *end = hex->map + hex->map_size;
+    const char *q = *p;
+    const char *eol;
+    int length, address_hi, address_lo, type;
+
+    while (q < end) {
+        eol = (const char *)memchr(q, '\n', end - q);
+        *p = eol != NULL ? eol + 1 : end;
+        (*line)++;
+
+        if (*q != ':') {
+            q = *p;
+            continue;
+        }
+
+        if (end - q < 11 || (length = ihex_byte(q + 1)) < 0 ||
+            (address_hi = ihex_byte(q + 3)) < 0 ||
+            (address_lo = ihex_byte(q + 5)) < 0 ||
+            (type = ihex_byte(q + 7)) < 0 || end - q < 11 + 2 * length) {
+            printf("%s:%u: broken record\n", hex->path, *line);
+            return -1;
+        }
+
+        rec->type = type;
+        rec->length = length;
+        rec->address = address_hi << 8 | address_lo;
+        rec->data = q + 9;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+        ihex_base() is the address an extended address record moves the
+        following records to.
+*/
+static int64_t ihex_base(ihex_record *rec)
+{
+    int hi = ihex_byte(rec->data);
+    int lo = ihex_byte(rec->data + 2);
+
+    if (rec->length != 2 || hi < 0 || lo < 0) {
+        return -1;
+    }
+
+    return (int64_t)(hi << 8 | lo) << (rec->type == IHEX_LINEAR ? 16 : 4);
+}
+
+/*
+        ihex_extent_cmp() orders extents by start address, and extents
+        that start together by file, for qsort().
+*/
+static int ihex_extent_cmp(const void *a, const void *b)
+{
+    const ihex_extent *x = (const ihex_extent *)a;
+    const ihex_extent *y = (const ihex_extent *)b;
+
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->file - y->file;
+}
+
+/*
+        ihex_add_extent() adds [start, end) to the extents of a file. Records
+        mostly follow on from each other, so it grows the last extent when
+        it can, and the extents stay few.
+*/
+static int ihex_add_extent(ihex_file *hex, uint32_t *room, uint32_t start,
+                           uint32_t end)
+{
+    ihex_extent *last = hex->num_extents ? &hex->extents[hex->num_extents - 1]
+                                         : NULL;
+    ihex_extent *extents;
+
+    if (last != NULL && start <= last->end && end >= last->start) {
+        if (start < last->start) {
+            last->start = start;
+        }
+        if (end > last->end) {
+            last->end = end;
+        }
+        return 0;
+    }
+
+    if (hex->num_extents == *room) {
+        *room = *room ? *room * 2 : 16;
+        extents = (ihex_extent *)realloc(hex->extents,
+                                         *room * sizeof(ihex_extent));
+        if (extents == NULL) {
+            return -1;
+        }
+        hex->extents = extents;
+    }
+
+    hex->extents[hex->num_extents].start = start;
+    hex->extents[hex->num_extents].end = end;
+    hex->extents[hex->num_extents].file = 0;
+    hex->num_extents++;
+
+    return 0;
+}
+
+/*
+        ihex_merge_extents() sorts the extents of a file and joins the ones
+        that overlap or touch, so they are disjoint. A file may write the
+        same address twice (the later record wins, as it is decoded later).
+*/
+static void ihex_merge_extents(ihex_file *hex)
+{
+    uint32_t i, n = 0;
+
+    if (hex->num_extents < 2) {
+        return;
+    }
+
+    qsort(hex->extents, hex->num_extents, sizeof(ihex_extent),
+          ihex_extent_cmp);
+
+    for (i = 1; i < hex->num_extents; i++) {
+        if (hex->extents[i].start <= hex->extents[n].end) {
+            if (hex->extents[i].end > hex->extents[n].end) {
+                hex->extents[n].end = hex->extents[i].end;
+            }
+        } else {
+            hex->extents[++n] = hex->extents[i];
+        }
+    }
+    hex->num_extents = n + 1;
+}
+
+/*
+        ihex_open() maps the file, and finds the extents of its data from
+        the record headers. The data isn't decoded yet.
+*/
+int32_t ihex_open(ihex_file *hex, const char *path)
+{
+    struct stat stat;
+    ihex_record rec;
+    const char *p;
+    uint32_t line = 0, room = 0, i;
+    uint64_t base = 0, address;
+    int64_t next_base;
+    int fd, rv;
+
+    memset(hex, 0, sizeof(*hex));
+    hex->path = path;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &stat) || stat.st_size == 0) {
+        printf("%s: can't read\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    hex->map = (const char *)mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+    close(fd);
+    if (hex->map == MAP_FAILED) {
+        printf("%s: can't map\n", path);
+        hex->map = NULL;
+        return -1;
+    }
+    hex->map_size = stat.st_size;
+    madvise((void *)hex->map, hex->map_size, MADV_SEQUENTIAL);
+
+    p = hex->map;
+    while ((rv = ihex_next(hex, &p, &line, &rec)) > 0) {
+        if (rec.type == IHEX_EOF) {
+            break;
+        }
+
+        if (rec.type == IHEX_SEGMENT || rec.type == IHEX_LINEAR) {
+            next_base = ihex_base(&rec);
+            if (next_base < 0) {
+                printf("%s:%u: broken address record\n", path, line);
+                rv = -1;
+                break;
+            }
+            base = next_base;
+        } else if (rec.type == IHEX_DATA && rec.length) {
+            address = base + rec.address;
+            if (address + rec.length > 0xffffffffULL) {
+                printf("%s:%u: data past 4GB\n", path, line);
+                rv = -1;
+                break;
+            }
+            if (ihex_add_extent(hex, &room, address, address + rec.length)) {
+                printf("%s: out of memory\n", path);
+                rv = -1;
+                break;
+            }
+            hex->records++;
+        }
+    }
+
+    if (rv == 0) {
+        printf("%s: no end of file record\n", path);
+        rv = -1;
+    }
+    if (rv < 0) {
+        ihex_close(hex);
+        return -1;
+    }
+
+    ihex_merge_extents(hex);
+    for (i = 0; i < hex->num_extents; i++) {
+        hex->bytes += hex->extents[i].end - hex->extents[i].start;
+    }
+    if (hex->num_extents) {
+        hex->start_address = hex->extents[0].start;
+        hex->end_address = hex->extents[hex->num_extents - 1].end;
+    }
+
+    return 0;
+}
+
+/*
+        ihex_plan() puts the extents of all the files in one array sorted
+        by address, and sweeps it once. An extent that starts before the
+        furthest end so far overlaps an extent of another file (the extents
+        of one file are disjoint). An extent that starts no more than
+        max_gap after the end of the region so far joins it, otherwise it
+        starts a new one.
+*/
+int32_t ihex_plan(ihex_file *files, int32_t nfiles, uint32_t max_gap,
+                  int overwrite, int *overlaps, ihex_region **regions)
+{
+    ihex_extent *all;
+    ihex_region *out;
+    uint32_t total = 0, i, n = 0, reach = 0;
+    int32_t f, reacher = -1;
+
+    *overlaps = 0;
+    *regions = NULL;
+
+    for (f = 0; f < nfiles; f++) {
+        total += files[f].num_extents;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    all = (ihex_extent *)malloc(total * sizeof(ihex_extent));
+    out = (ihex_region *)malloc(total * sizeof(ihex_region));
+    if (all == NULL || out == NULL) {
+        printf("out of memory\n");
+        free(all);
+        free(out);
+        return -1;
+    }
+
+    for (f = 0; f < nfiles; f++) {
+        for (i = 0; i < files[f].num_extents; i++) {
+            all[n] = files[f].extents[i];
+            all[n++].file = f;
+        }
+    }
+    qsort(all, total, sizeof(ihex_extent), ihex_extent_cmp);
+
+    n = 0;
+    for (i = 0; i < total; i++) {
+        if (reacher >= 0 && all[i].start < reach) {
+            if (!overwrite) {
+                printf("%s and %s both have data at 0x%08x\n",
+                       files[reacher].path, files[all[i].file].path,
+                       all[i].start);
+                free(all);
+                free(out);
+                return -1;
+            }
+            *overlaps = 1;
+        }
+
+        if (n && all[i].start <= (uint64_t)out[n - 1].address +
+                                     out[n - 1].size + max_gap) {
+            if (all[i].end > out[n - 1].address + out[n - 1].size) {
+                out[n - 1].size = all[i].end - out[n - 1].address;
+            }
+        } else {
+            out[n].address = all[i].start;
+            out[n].size = all[i].end - all[i].start;
+            out[n].data = NULL;
+            n++;
+        }
+
+        if (all[i].end > reach) {
+            reach = all[i].end;
+            reacher = all[i].file;
+        }
+    }
+
+    free(all);
+    *regions = out;
+
+    return n;
+}
+
+/*
+        ihex_find_region() is the region that holds address, by binary
+        search. Records mostly follow on from each other, so the last one
+        found is tried first.
+*/
+static ihex_region *ihex_find_region(ihex_region *regions, int32_t num_regions,
+                                     int32_t *last, uint64_t address)
+{
+    int32_t lo = 0, hi = num_regions - 1, mid;
+
+    if (address >= regions[*last].address &&
+        address < (uint64_t)regions[*last].address + regions[*last].size) {
+        return &regions[*last];
+    }
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (regions[mid].address <= address) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    *last = lo;
+
+    return &regions[lo];
+}
+
+/*
+        ihex_decode() goes over the records again, and decodes the data
+        records into their region. Every data record is in one region, as
+        the regions were laid out from the extents of the records. Every
+        record's checksum is checked on the way.
+*/
+int32_t ihex_decode(ihex_file *hex, ihex_region *regions,
+                    int32_t num_regions)
+{
+    ihex_record rec;
+    ihex_region *region;
+    const char *p = hex->map;
+    uint32_t line = 0, sum;
+    uint64_t base = 0, address;
+    uint8_t scratch[256];
+    uint8_t *dest;
+    int32_t last = 0;
+    int checksum;
+
+    while (ihex_next(hex, &p, &line, &rec) > 0) {
+        dest = scratch;
+        if (rec.type == IHEX_DATA && rec.length && num_regions) {
+            address = base + rec.address;
+            region = ihex_find_region(regions, num_regions, &last, address);
+            dest = &region->data[address - region->address];
+        }
+
+        sum = rec.length + (rec.address >> 8) + (rec.address & 0xff) +
+              rec.type;
+        checksum = ihex_byte(rec.data + 2 * rec.length);
+        if (checksum < 0 || ihex_unhex(dest, rec.data, rec.length, &sum)) {
+            printf("%s:%u: bad hex digit\n", hex->path, line);
+            return -1;
+        }
+        if ((sum + checksum) & 0xff) {
+            printf("%s:%u: bad checksum\n", hex->path, line);
+            return -1;
+        }
+
+        if (rec.type == IHEX_EOF) {
+            break;
+        }
+        if (rec.type == IHEX_SEGMENT || rec.type == IHEX_LINEAR) {
+            base = ihex_base(&rec);
+        }
+    }
+
+    return 0;
+}
+
+/*
+        ihex_close() unmaps the file, and frees its extents.
+*/
+void ihex_close(ihex_file *hex)
+{
+    if (hex->map != NULL) {
+        munmap((void *)hex->map, hex->map_size);
+        hex->map = NULL;
+    }
+    free(hex->extents);
+    hex->extents = NULL;
+    hex->num_extents = 0;
+}
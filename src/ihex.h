@@ -0,0 +1,91 @@
+/*
+ihex.{c,h} :
+Reads Intel HEX files. A file is mapped into memory and gone over twice:
+once for the extents of its data, which only needs the record headers, and
+once to decode the data records straight into place. In between the
+extents of all the files are laid out in a sorted interval map, overlaps
+between files are found, and extents that are close are merged into
+regions, so that a gap in the data doesn't have to be stored (or flashed).
+Files can be decoded on separate threads.
+
+More information on the format: http://en.wikipedia.org/wiki/Intel_HEX
+*/
+
+#ifndef __DFU_IHEX__
+#define __DFU_IHEX__
+
+#define IHEX_DATA 0x00
+#define IHEX_EOF 0x01
+#define IHEX_SEGMENT 0x02
+#define IHEX_LINEAR 0x04
+
+/* extents further apart than this go in regions of their own by default */
+#define IHEX_MAX_GAP 1024
+
+/*
+a run of addresses [start, end) that data records of a file write
+*/
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    int32_t file;
+} ihex_extent;
+
+/*
+a run of memory the data of the files goes to, as laid out by ihex_plan().
+The caller provides data, gaps that aren't in any file should be 0xff.
+*/
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    uint8_t *data;
+} ihex_region;
+
+/*
+an Intel HEX file, mapped. start_address and end_address are the lowest
+address the data records write, and the first one after the highest, and
+extents are the runs in between that are written, sorted and merged.
+*/
+typedef struct {
+    const char *path;
+    const char *map;
+    size_t map_size;
+    uint32_t start_address;
+    uint32_t end_address;
+    uint32_t records;
+    uint32_t bytes;
+    ihex_extent *extents;
+    uint32_t num_extents;
+} ihex_file;
+
+/*
+ihex_open() maps the file at path and finds the extents of its data.
+Returns 0, or < 0 (and says why) if the file can't be read or has a broken
+record structure.
+*/
+int32_t ihex_open(ihex_file *hex, const char *path);
+
+/*
+ihex_plan() lays out the extents of nfiles opened files in regions. Two
+files that write the same address are an error, unless overwrite is set
+(later files win then, and they have to be decoded in order). Extents no
+more than max_gap bytes apart share a region. Returns the number of
+regions, in a malloc'd array sorted by address, or < 0 (and says where)
+on an overlap. *overlaps is set if there were any.
+*/
+int32_t ihex_plan(ihex_file *files, int32_t nfiles, uint32_t max_gap,
+                  int overwrite, int *overlaps, ihex_region **regions);
+
+/*
+ihex_decode() decodes the data of an opened file into the regions laid out
+for it. Returns 0, or < 0 (and says why) if a record has a bad digit or
+checksum.
+*/
+int32_t ihex_decode(ihex_file *hex, ihex_region *regions,
+                    int32_t num_regions);
+
+/*
+ihex_close() unmaps the file, and frees its extents.
+*/
+void ihex_close(ihex_file *hex);
+#endif
@@ -15,149 +15,1940 @@ to complete the operation.
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "dfulayout.h"
 #include "dfurequests.h"
 #include "dfucommands.h"
 #include "dfuse.h"
+#include "crc32.h"
+#include "dfusim.h"
+#include "dfurecord.h"
+#include "dfuimage.h"
 #include "stmdfu.h"
+#include "stmdfud.h"
+
+uint64_t stmdfu_enumerate_us;
 
 int main(int argc, char *argv[])
 {
-    dfu_device *dfudev = stmdfu_init_dfu();
+    dfu_device **devices;
+    stmdfu_selector sel;
+    dfusim_config sim;
+    char *socket_path = getenv("STMDFU_SOCKET");
+    char *transport = NULL;
+    char *record = NULL;
+    char *replay = NULL;
+    int i, n, ndevices, rv;
+
+    if (argc > 1 && !strcmp(argv[1], "--daemon")) {
+        return stmdfu_daemon(argc > 2 ? argv[2] : NULL);
+    }
+
+    // -S <socket> (or STMDFU_SOCKET) hands the command to a running daemon,
+    // which also takes care of -s/-p/-d
+    if (argc > 2 && !strcmp(argv[1], "-S")) {
+        socket_path = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (socket_path != NULL) {
+        return stmdfu_client(socket_path, argc, argv);
+    }
+
+    // -t sim[:key=value,...] runs against simulated devices instead of usb,
+    // --record <file> keeps every request of the session in a file, and
+    // --replay <file> plays such a file back in place of the device
+    while (argc > 2 && (!strcmp(argv[1], "-t") ||
+                        !strcmp(argv[1], "--record") ||
+                        !strcmp(argv[1], "--replay"))) {
+        if (!strcmp(argv[1], "-t"))
+            transport = argv[2];
+        else if (!strcmp(argv[1], "--record"))
+            record = argv[2];
+        else
+            replay = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (transport != NULL) {
+        if (!strcmp(transport, "usb")) {
+            transport = NULL;
+        } else if (strncmp(transport, "sim", 3) ||
+                   (transport[3] != 0 && transport[3] != ':')) {
+            printf("unknown transport <%s>, use usb or sim[:key=value,...]\n",
+                   transport);
+            return 1;
+        } else if (dfusim_parse_config(transport[3] ? &transport[4] : NULL,
+                                       &sim)) {
+            return 1;
+        }
+    }
+
+    // -s/-p/-d, so that only the wanted device gets opened
+    n = stmdfu_parse_selector(argc, argv, &sel);
+    if (n < 0) {
+        return 1;
+    }
+    argv[n] = argv[0];
+    argv += n;
+    argc -= n;
+
+    // station mode waits for boards itself, rather than opening them here
+    if (argc > 2 && !strcmp(argv[1], "station")) {
+        int flags = 0, limit = 0;
+
+        if (transport != NULL || record != NULL || replay != NULL) {
+            printf("station mode waits for usb hotplug, it can't run on "
+                   "simulated, recorded or replayed devices\n");
+            return 1;
+        }
+
+        for (i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "--diff"))
+                flags |= STMDFU_FLASH_DIFF;
+            if (!strcmp(argv[i], "--no-erase"))
+                flags |= STMDFU_FLASH_NO_ERASE;
+            if (!strcmp(argv[i], "--verify"))
+                flags |= STMDFU_FLASH_VERIFY;
+            if (!strcmp(argv[i], "--stats"))
+                flags |= STMDFU_FLASH_STATS;
+            if (!strcmp(argv[i], "--count") && i + 1 < argc)
+                limit = strtol(argv[++i], NULL, 0);
+        }
+
+        return stmdfu_run_station(argv[2], flags, limit, &sel) < 0;
+    }
+
+    if (replay != NULL) {
+        ndevices = dfurecord_replay_open(replay, &devices);
+        if (ndevices < 0) {
+            return 1;
+        }
+    } else if (transport != NULL) {
+        ndevices = dfusim_open_devices(&sim, &devices);
+    } else {
+        // only flash --all uses more than one device
+        int all = 0;
+
+        for (i = 3; argc > 2 && !strcmp(argv[1], "flash") && i < argc; i++) {
+            all |= !strcmp(argv[i], "--all");
+        }
+        ndevices = find_dfu_devices(&devices, &sel, all);
+    }
+
+    rv = 1;
+    if (record != NULL && ndevices != 1) {
+        printf("--record needs exactly one device, pick it with -s, -p or "
+               "-d\n");
+    } else if (record == NULL || !dfurecord_start(devices[0], record)) {
+        rv = stmdfu_run(devices, ndevices, argc, argv);
+
+        // a replay that didn't see the recorded requests fails the run
+        if ((record != NULL || replay != NULL) && ndevices == 1 &&
+            dfurecord_finish(devices[0]) < 0) {
+            rv = 1;
+        }
+    }
+
+    for (i = 0; i < ndevices; i++) {
+        close_dfu_device(devices[i]);
+    }
+    free(devices);
+    if (transport == NULL && replay == NULL) {
+        libusb_exit(NULL);
+    }
+
+    return rv;
+}
+
+/*
+stmdfu_run() runs one command (argv[1] onwards, as on the command line)
+against already opened stm32 dfu devices. Returns the exit status.
+*/
+int stmdfu_run(dfu_device **devices, int ndevices, int argc, char *argv[])
+{
+    dfu_device *dfudev;
+    stmdfu_selector sel;
+    struct timespec start;
+    char *report = NULL;
+    char *trace = NULL;
+    int flags = 0;
+    int stats = 0;
+    int rv = 0;
+    int n, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    n = stmdfu_parse_selector(argc, argv, &sel);
+    if (n < 0) {
+        return 1;
+    }
+    argv[n] = argv[0];
+    argv += n;
+    argc -= n;
+
+    // move the selected devices to the front, the caller still owns (and
+    // closes) all of them. Simulated devices aren't on usb, so the
+    // selectors don't apply to them.
+    for (i = n = 0; i < ndevices; i++) {
+        libusb_device *dev = NULL;
+
+        if (devices[i]->handle != NULL) {
+            dev = libusb_get_device(devices[i]->handle);
+        }
+
+        if (dev == NULL || (stmdfu_select_location(dev, &sel) &&
+                            stmdfu_select_serial(dev, devices[i]->handle,
+                                                 &sel))) {
+            dfudev = devices[n];
+            devices[n++] = devices[i];
+            devices[i] = dfudev;
+        }
+    }
+    if (ndevices && !n) {
+        printf("No STM32 DFU Device matches the selection.\n");
+        return 1;
+    }
+    ndevices = n;
+
+    if (argc < 2) {
+        printf("usage: %s "
+               "flash|dump|optbytes|erase|masserase|layout|station ...\n",
+               argv[0]);
+        return 1;
+    }
+
+    // a job of the daemon comes straight from the client, so the
+    // arguments of a command are counted before any of them is used
+    if (!strcmp(argv[1], "flash") && argc < 3) {
+        printf("usage: %s flash <file> [--diff] [--all] [--no-erase] "
+               "[--verify] [--dry-run] [--stream]\n",
+               argv[0]);
+        return 1;
+    }
+    if (!strcmp(argv[1], "dump") && argc < 4) {
+        printf("usage: %s dump <address> <size> [-o file] "
+               "[-f bin|ihex|dfuse|text]\n",
+               argv[0]);
+        return 1;
+    }
+    if (!strcmp(argv[1], "erase") && argc < 3) {
+        printf("usage: %s erase <address> [length]\n", argv[0]);
+        return 1;
+    }
+
+    // --stats prints where the time went after any command, --report
+    // writes it to a file as json, --trace writes every request of it
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        if (!strcmp(argv[i], "--report") && i + 1 < argc)
+            report = argv[++i];
+        if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace = argv[++i];
+    }
+
+    for (i = 0; i < ndevices; i++) {
+        dfu_reset_stats(devices[i]);
+    }
+
+    if (ndevices < 1) {
+        printf("No STM32 DFU Device connected. Check boot switches and "
+               "replugin board.\n");
+        return 1;
+    }
 
     if (!strcmp(argv[1], "flash")) {
-        stmdfu_write_image(dfudev, argv[2]);
+        for (int i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "--diff"))
+                flags |= STMDFU_FLASH_DIFF;
+            if (!strcmp(argv[i], "--all"))
+                flags |= STMDFU_FLASH_ALL;
+            if (!strcmp(argv[i], "--no-erase"))
+                flags |= STMDFU_FLASH_NO_ERASE;
+            if (!strcmp(argv[i], "--verify"))
+                flags |= STMDFU_FLASH_VERIFY;
+            if (!strcmp(argv[i], "--dry-run"))
+                flags |= STMDFU_FLASH_DRY_RUN;
+            if (!strcmp(argv[i], "--stream"))
+                flags |= STMDFU_FLASH_STREAM;
+        }
+
+        // a dry run only needs the layout, which one device shows
+        if (flags & STMDFU_FLASH_DRY_RUN) {
+            flags &= ~STMDFU_FLASH_ALL;
+        }
+
+        if ((flags & STMDFU_FLASH_STREAM) && (flags & STMDFU_FLASH_ALL)) {
+            printf("--stream flashes one device, --all shares the image "
+                   "between them\n");
+            return 1;
+        }
+
+        if (stats) {
+            flags |= STMDFU_FLASH_STATS;
+        }
+    }
+
+    // only once the options have been found sound, so that a trace that
+    // is started is always written
+    if (trace != NULL && dfu_trace_start() < 0) {
+        printf("can't allocate the trace buffer\n");
+        trace = NULL;
+    }
+
+    // every device gets flashed by its own thread
+    if (flags & STMDFU_FLASH_ALL) {
+        rv = stmdfu_write_image_all(devices, ndevices, argv[2], flags);
+        if (report != NULL) {
+            stmdfu_write_report(report, argv[1], devices, ndevices, rv,
+                                &start);
+        }
+        if (trace != NULL) {
+            stmdfu_write_trace(trace, devices, ndevices);
+        }
+        return rv < 0;
+    }
+
+    if (ndevices > 1) {
+        printf("More than 1 STM32 DFU device connected. Targetting last "
+               "enumerated STM32 DFU device.\n");
+    }
+
+    dfudev = devices[ndevices - 1];
+
+    // a dry run only reads the layout, nothing is sent to the device
+    if (!(flags & STMDFU_FLASH_DRY_RUN)) {
+        stmdfu_prepare_device(dfudev);
     }
 
+    if (!strcmp(argv[1], "flash")) {
+        rv = stmdfu_write_image(dfudev, argv[2], flags);
+    }
     if (!strcmp(argv[1], "dump")) {
         int address = strtol(argv[2], NULL, 0);
         int size = strtol(argv[3], NULL, 0);
+        char *file = NULL;
+        char *name = NULL;
+        int format = -1;
+
+        if (address < 0)
+            address = 0;
+
+        if (size < 1)
+            size = 1;
+
+        for (int i = 4; i < argc - 1; i++) {
+            if (!strcmp(argv[i], "-o"))
+                file = argv[++i];
+            else if (!strcmp(argv[i], "-f"))
+                name = argv[++i];
+        }
+
+        // without -f the format follows the file name, raw binary otherwise
+        if (name != NULL) {
+            format = stmdfu_dump_format(name);
+        } else {
+            format = stmdfu_dump_format(file);
+            if (format < 0)
+                format = STMDFU_DUMP_BIN;
+        }
+
+        if (format < 0) {
+            printf("unknown dump format <%s>, use bin, ihex, dfuse or "
+                   "text\n",
+                   name);
+            rv = -1;
+        } else {
+            rv = stmdfu_read_flash(dfudev, address, size, file, format);
+        }
+    }
+
+    if (!strcmp(argv[1], "optbytes")) {
+        stmdfu_read_optbytes(dfudev);
+    }
+
+    if (!strcmp(argv[1], "erase")) {
+        int address = strtol(argv[2], NULL, 0);
+        int length = 1;
 
         if (address < 0)
             address = 0;
 
-        if (size < 1)
-            size = 1;
+        // an optional length erases every sector of a range
+        if (argc > 3 && argv[3][0] != '-')
+            length = strtol(argv[3], NULL, 0);
+
+        if (length < 1)
+            length = 1;
+
+        rv = stmdfu_erase(dfudev, address, length);
+    }
+
+    if (!strcmp(argv[1], "masserase")) {
+        stmdfu_mass_erase(dfudev);
+    }
+
+    if (!strcmp(argv[1], "layout")) {
+        stmdfu_print_layout(dfudev);
+    }
+
+    if (stats) {
+        dfu_print_op_stats(dfudev);
+    }
+
+    if (report != NULL) {
+        stmdfu_write_report(report, argv[1], &dfudev, 1, rv, &start);
+    }
+
+    if (trace != NULL) {
+        stmdfu_write_trace(trace, &dfudev, 1);
+    }
+
+    return rv < 0;
+}
+
+/*
+stmdfu_write_trace() writes the requests recorded since dfu_trace_start()
+to file in Chrome trace-event format, and stops recording.
+*/
+int32_t stmdfu_write_trace(char *file, dfu_device **devices, int ndevices)
+{
+    FILE *out = fopen(file, "w");
+
+    if (out == NULL) {
+        printf("error opening <%s>\n", file);
+        dfu_trace_stop();
+        return -1;
+    }
+
+    dfu_trace_write(out, devices, ndevices);
+    fclose(out);
+
+    return 0;
+}
+
+/*
+stmdfu_write_report() writes the run report of a command as json: how
+long the command and the enumeration before it took, and the phases,
+requests and operations of every device the command ran on. A file of
+"-" is stdout.
+*/
+int32_t stmdfu_write_report(char *file, char *command, dfu_device **devices,
+                            int ndevices, int32_t result,
+                            struct timespec *start)
+{
+    struct timespec end;
+    FILE *out = stdout;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (strcmp(file, "-")) {
+        out = fopen(file, "w");
+        if (out == NULL) {
+            printf("error opening <%s>\n", file);
+            return -1;
+        }
+    }
+
+    fprintf(out, "{\n  \"command\": \"%s\",\n", command);
+    fprintf(out, "  \"result\": %d,\n", result < 0 ? result : 0);
+    fprintf(out, "  \"total_ms\": %.3f,\n",
+            (end.tv_sec - start->tv_sec) * 1e3 +
+                (end.tv_nsec - start->tv_nsec) / 1e6);
+    fprintf(out, "  \"enumerate_ms\": %.3f,\n", stmdfu_enumerate_us / 1e3);
+    fprintf(out, "  \"devices\": [");
+    for (i = 0; i < ndevices; i++) {
+        fprintf(out, "%s\n    ", i ? "," : "");
+        dfu_write_report(out, devices[i]);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
+
+/*
+stmdfu_write_image() is a wrapper function that extracts an image from
+a dfuse (or .hex, .bin, .elf) file, and flashes it to an attached stm32
+device via usb dfu. With STMDFU_FLASH_STREAM a dfuse file is streamed.
+With STMDFU_FLASH_DIFF only the sectors that differ from the image are
+erased and programmed.
+*/
+int32_t stmdfu_write_image(dfu_device *dfudev, char *file, int flags)
+{
+    dfuse_file *dfusefile;
+    int32_t rv;
+
+    if (flags & STMDFU_FLASH_STREAM) {
+        return stmdfu_stream_image(dfudev, file, flags);
+    }
+
+    dfusefile = stmdfu_load_image(file);
+    if (dfusefile == NULL) {
+        return -1;
+    }
+
+    rv = stmdfu_flash_image(dfudev, dfusefile, flags);
+
+    dfuse_struct_cleanup(dfusefile);
+
+    return rv;
+}
+
+/*
+stmdfu_write_image_all() flashes an image to all of the given stm32 dfu
+devices at once. The dfuse file is parsed once, and every device gets
+its own worker thread. A summary of the results is printed at the end.
+*/
+int32_t stmdfu_write_image_all(dfu_device **devices, int ndevices,
+                               char *file, int flags)
+{
+    stmdfu_job *jobs;
+    pthread_t *threads;
+    dfuse_file *dfusefile;
+    int i, failed = 0;
+
+    dfusefile = stmdfu_load_image(file);
+    if (dfusefile == NULL) {
+        return -1;
+    }
+
+    printf("flashing %s to %d devices...\n", file, ndevices);
+
+    jobs = (stmdfu_job *)calloc(ndevices, sizeof(stmdfu_job));
+    threads = (pthread_t *)calloc(ndevices, sizeof(pthread_t));
+
+    for (i = 0; i < ndevices; i++) {
+        jobs[i].dfudev = devices[i];
+        jobs[i].dfusefile = dfusefile;
+        jobs[i].flags = flags | STMDFU_FLASH_QUIET;
+        jobs[i].result = -1;
+        if (pthread_create(&threads[i], NULL, stmdfu_flash_worker, &jobs[i])) {
+            printf("can't start a worker for device %s\n", devices[i]->path);
+            threads[i] = 0;
+        }
+    }
+
+    for (i = 0; i < ndevices; i++) {
+        if (threads[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    printf("\n%-16s %-8s %10s %8s\n", "device", "result", "bytes", "time");
+    for (i = 0; i < ndevices; i++) {
+        printf("%-16s %-8s %10u %7.2fs\n", devices[i]->path,
+               jobs[i].result < 0 ? "FAILED" : "ok", jobs[i].bytes,
+               jobs[i].seconds);
+        if (jobs[i].result < 0) {
+            failed++;
+        }
+    }
+    printf("%d of %d devices flashed\n", ndevices - failed, ndevices);
+
+    for (i = 0; i < ndevices && (flags & STMDFU_FLASH_STATS); i++) {
+        printf("\n%s:\n", devices[i]->path);
+        dfu_print_op_stats(devices[i]);
+    }
+
+    free(threads);
+    free(jobs);
+    dfuse_struct_cleanup(dfusefile);
+
+    return failed ? -1 : 0;
+}
+
+/*
+stmdfu_flash_worker() is the thread body used by stmdfu_write_image_all(),
+it flashes one device and records the result in its stmdfu_job.
+*/
+void *stmdfu_flash_worker(void *arg)
+{
+    stmdfu_job *job = (stmdfu_job *)arg;
+    struct timespec start, end;
+    int i, j;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    stmdfu_prepare_device(job->dfudev);
+    job->result = stmdfu_flash_image(job->dfudev, job->dfusefile, job->flags);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < job->dfusefile->prefix.targets; i++) {
+        dfuse_image *image = &job->dfusefile->images[i];
+        for (j = 0; j < image->tarprefix.num_elements; j++) {
+            job->bytes += image->imgelement[j].element_size;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+stmdfu_station_stop is set by SIGINT, the station then finishes the boards
+that are in flight and stops.
+*/
+static volatile sig_atomic_t stmdfu_station_stop;
+
+static void stmdfu_station_interrupt(int sig)
+{
+    (void)sig;
+    stmdfu_station_stop = 1;
+}
+
+/*
+stmdfu_station_worker() is the thread body of one board in station mode.
+It opens the device that has arrived, flashes it and reports the result.
+*/
+static void *stmdfu_station_worker(void *arg)
+{
+    stmdfu_arrival *arrival = (stmdfu_arrival *)arg;
+    stmdfu_station *station = arrival->station;
+    dfu_device *dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+    struct timespec now;
+    stmdfu_job job;
+    int tries, skip, err = -1;
+
+    // the device node can take a moment to become accessible after the
+    // arrival has been reported
+    for (tries = 0; tries < STMDFU_STATION_OPEN_TRIES; tries++) {
+        err = probe_dfu_device(arrival->dev, dfudev, station->sel);
+        if (err >= 0) {
+            break;
+        }
+        usleep(STMDFU_STATION_OPEN_DELAY_US);
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.result = -1;
+
+    // a board with another serial number is left alone, and so are boards
+    // that turn up once --count boards have been started
+    pthread_mutex_lock(&station->lock);
+    skip = err > 0 || (station->limit && station->started == station->limit);
+    if (!skip) {
+        station->started++;
+    }
+    pthread_mutex_unlock(&station->lock);
+
+    if (!skip && err == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job.dfudev = dfudev;
+        job.dfusefile = station->dfusefile;
+        job.flags = station->flags | STMDFU_FLASH_QUIET;
+        stmdfu_flash_worker(&job);
+
+        // one board's lines stay together
+        pthread_mutex_lock(&station->lock);
+        printf("%-16s %-8s %10u %7.2fs  (opened after %.0fms)\n",
+               dfudev->path, job.result < 0 ? "FAILED" : "ok", job.bytes,
+               job.seconds,
+               (now.tv_sec - arrival->arrived.tv_sec) * 1e3 +
+                   (now.tv_nsec - arrival->arrived.tv_nsec) / 1e6);
+        if (station->flags & STMDFU_FLASH_STATS) {
+            dfu_print_op_stats(dfudev);
+        }
+        pthread_mutex_unlock(&station->lock);
+    } else if (!skip) {
+        printf("%-16s %-8s can't open the device\n", "?", "FAILED");
+    }
+
+    if (err == 0) {
+        close_dfu_device(dfudev);
+    } else {
+        free(dfudev);
+    }
+    libusb_unref_device(arrival->dev);
+
+    pthread_mutex_lock(&station->lock);
+    if (!skip && job.result < 0) {
+        station->failed++;
+    } else if (!skip) {
+        station->passed++;
+    }
+    station->in_flight--;
+    pthread_mutex_unlock(&station->lock);
+
+    free(arrival);
+
+    return NULL;
+}
+
+/*
+stmdfu_station_arrived() is the libusb hotplug callback of station mode.
+It runs on the event handling thread, where no requests can be made, so
+every board that arrives is handed to a worker thread of its own.
+*/
+static int stmdfu_station_arrived(libusb_context *ctx, libusb_device *dev,
+                                  libusb_hotplug_event event, void *arg)
+{
+    stmdfu_station *station = (stmdfu_station *)arg;
+    stmdfu_arrival *arrival;
+    pthread_t thread;
+
+    (void)ctx;
+
+    if (event != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED || stmdfu_station_stop ||
+        !stmdfu_select_location(dev, station->sel)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&station->lock);
+    if (station->limit && station->started == station->limit) {
+        pthread_mutex_unlock(&station->lock);
+        return 0;
+    }
+    station->in_flight++;
+    pthread_mutex_unlock(&station->lock);
+
+    arrival = (stmdfu_arrival *)calloc(1, sizeof(stmdfu_arrival));
+    arrival->station = station;
+    arrival->dev = libusb_ref_device(dev);
+    clock_gettime(CLOCK_MONOTONIC, &arrival->arrived);
+
+    if (pthread_create(&thread, NULL, stmdfu_station_worker, arrival)) {
+        printf("can't start a worker for a new device\n");
+        libusb_unref_device(arrival->dev);
+        free(arrival);
+        pthread_mutex_lock(&station->lock);
+        station->in_flight--;
+        pthread_mutex_unlock(&station->lock);
+        return 0;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/*
+stmdfu_run_station() is station mode: it flashes file to every stm32 dfu
+device that is plugged in, as soon as it arrives, and keeps waiting for
+the next one. Boards are flashed in parallel. It stops after limit boards
+(0 means never) or on SIGINT, once the boards in flight are done. Only
+the boards that sel selects are flashed.
+*/
+int32_t stmdfu_run_station(char *file, int flags, int limit,
+                           stmdfu_selector *sel)
+{
+    libusb_hotplug_callback_handle callback;
+    struct timeval timeout = {0, STMDFU_STATION_EVENT_US};
+    stmdfu_station station;
+    int busy = 1;
+
+    memset(&station, 0, sizeof(station));
+    pthread_mutex_init(&station.lock, NULL);
+    station.flags = flags;
+    station.limit = limit;
+    station.sel = sel;
+
+    station.dfusefile = stmdfu_load_image(file);
+    if (station.dfusefile == NULL) {
+        return -1;
+    }
+
+    libusb_init(NULL);
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        printf("this libusb has no hotplug support\n");
+        dfuse_struct_cleanup(station.dfusefile);
+        libusb_exit(NULL);
+        return -1;
+    }
+
+    signal(SIGINT, stmdfu_station_interrupt);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    printf("station: flashing %s to every board that is plugged in, "
+           "ctrl-c to stop\n", file);
+    printf("%-16s %-8s %10s %8s\n", "device", "result", "bytes", "time");
+
+    // boards that are already attached are reported right away
+    if (libusb_hotplug_register_callback(
+            NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+            LIBUSB_HOTPLUG_ENUMERATE, STM32VENDOR, STM32PRODUCT,
+            LIBUSB_HOTPLUG_MATCH_ANY, stmdfu_station_arrived, &station,
+            &callback)) {
+        printf("can't register for hotplug events\n");
+        dfuse_struct_cleanup(station.dfusefile);
+        libusb_exit(NULL);
+        return -1;
+    }
+
+    while (busy) {
+        libusb_handle_events_timeout_completed(NULL, &timeout, NULL);
+
+        pthread_mutex_lock(&station.lock);
+        busy = station.in_flight ||
+               (!stmdfu_station_stop &&
+                (!station.limit || station.started < station.limit));
+        pthread_mutex_unlock(&station.lock);
+    }
+
+    libusb_hotplug_deregister_callback(NULL, callback);
+
+    printf("%d of %d boards flashed\n", station.passed,
+           station.passed + station.failed);
+
+    dfuse_struct_cleanup(station.dfusefile);
+    pthread_mutex_destroy(&station.lock);
+    libusb_exit(NULL);
+
+    return station.failed ? -1 : 0;
+}
+
+/*
+stmdfu_load_image() reads a dfuse, Intel HEX, raw binary or ELF file into
+memory, and checks it before any device is touched. Returns NULL if the
+file can't be read or is corrupt.
+*/
+dfuse_file *stmdfu_load_image(char *file)
+{
+    return dfuimage_load(file);
+}
+
+/*
+stmdfu_flash_image() flashes every element of a dfuse file that is
+already in memory, then makes the device leave dfu mode. Elements that
+follow each other are written as one span. Returns 0 on success, or < 0
+if an element couldn't be flashed.
+*/
+int32_t stmdfu_flash_image(dfu_device *dfudev, dfuse_file *dfusefile,
+                           int flags)
+{
+    struct timespec start;
+    stmdfu_span *spans;
+    int32_t rv = 0, nspans, i;
+    uint32_t total = 0, skipped = 0, j;
+
+    if (flags & STMDFU_FLASH_DRY_RUN) {
+        return stmdfu_print_plan(dfudev, dfusefile, flags);
+    }
+
+    // diff mode decides sector by sector what to erase
+    if (!(flags & (STMDFU_FLASH_DIFF | STMDFU_FLASH_NO_ERASE))) {
+        rv = stmdfu_erase_image(dfudev, dfusefile, flags);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    nspans = stmdfu_plan_spans(dfudev, dfusefile, flags, &spans);
+    if (nspans < 0) {
+        return nspans;
+    }
+
+    for (i = 0; i < nspans && rv >= 0; i++) {
+        stmdfu_span *span = &spans[i];
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            printf("flashing %u bytes at %.8x", span->length, span->address);
+            if (span->num_elements > 1) {
+                printf(" (%u elements)", span->num_elements);
+            }
+            printf("...");
+            fflush(stdout);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (flags & STMDFU_FLASH_DIFF) {
+            rv = stmdfu_write_element_diff(dfudev, span->elements[0],
+                                           &skipped);
+        } else {
+            rv = stmdfu_write_span(dfudev, span);
+        }
+        dfu_phase_add(dfudev, DFU_PHASE_PROGRAM, &start, span->length);
+        for (j = 0; j < span->num_elements && rv >= 0 &&
+                    (flags & STMDFU_FLASH_VERIFY);
+             j++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rv = stmdfu_verify_element(dfudev, span->elements[j]);
+            dfu_phase_add(dfudev, DFU_PHASE_VERIFY, &start,
+                          span->elements[j]->element_size);
+        }
+        total += span->length;
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            printf(rv < 0 ? "failed.\n" : "done.\n");
+        }
+    }
+
+    free(spans);
+
+    if (rv < 0) {
+        return rv;
+    }
+
+    if ((flags & STMDFU_FLASH_DIFF) && !(flags & STMDFU_FLASH_QUIET)) {
+        printf("%u of %u bytes unchanged, skipped\n", skipped, total);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dfu_leave_dfu_mode(dfudev);
+    dfu_phase_add(dfudev, DFU_PHASE_LEAVE, &start, 0);
+
+    return 0;
+}
+
+/*
+stmdfu_span_joins() decides whether el can be written in the same span as
+the elements before it: it has to start at or after the end of the span,
+in the same region, and within as many blocks as one download can number.
+A gap is only padded if it is within one sector with both of them, and the
+sectors are erased first, so the padding only goes over erased bytes.
+*/
+static int stmdfu_span_joins(dfu_device *dfudev, stmdfu_span *span,
+                             dfuse_image_element *el, int flags)
+{
+    uint64_t end = (uint64_t)span->address + span->length;
+    uint64_t length = (uint64_t)el->element_address + el->element_size -
+                      span->address;
+    dfu_sector before, after;
+
+    if ((flags & STMDFU_FLASH_DIFF) || span->length == 0 ||
+        el->element_size == 0 || el->element_address < end) {
+        return 0;
+    }
+
+    if ((length + dfudev->transfer_size - 1) / dfudev->transfer_size +
+            DFUSE_FIRST_BLOCK > 0xffff) {
+        return 0;
+    }
+
+    if (dfu_get_sector(dfudev, end - 1, &before) ||
+        dfu_get_sector(dfudev, el->element_address, &after) ||
+        before.region != after.region) {
+        return 0;
+    }
+
+    if (el->element_address == end) {
+        return 1;
+    }
+
+    return !(flags & STMDFU_FLASH_NO_ERASE) && before.address == after.address;
+}
+
+/*
+stmdfu_plan_spans() joins the elements of a dfuse file into spans. The
+spans and the element pointers they share are one malloc'd block, spans
+first, so one free() releases both.
+*/
+int32_t stmdfu_plan_spans(dfu_device *dfudev, dfuse_file *dfusefile,
+                          int flags, stmdfu_span **spans)
+{
+    dfuse_image_element **elements;
+    stmdfu_span *span = NULL;
+    uint32_t count = 0, n = 0, k = 0;
+    int i, j;
+
+    for (i = 0; i < dfusefile->prefix.targets; i++) {
+        count += dfusefile->images[i].tarprefix.num_elements;
+    }
+
+    *spans = (stmdfu_span *)malloc(
+        count * (sizeof(stmdfu_span) + sizeof(dfuse_image_element *)) + 1);
+    if (*spans == NULL) {
+        printf("stmdfu_plan_spans: out of memory\n");
+        return -1;
+    }
+    elements = (dfuse_image_element **)&(*spans)[count];
+
+    for (i = 0; i < dfusefile->prefix.targets; i++) {
+        dfuse_image *image = &dfusefile->images[i];
+        for (j = 0; j < image->tarprefix.num_elements; j++) {
+            dfuse_image_element *el = &image->imgelement[j];
+
+            elements[k] = el;
+            if (span != NULL && stmdfu_span_joins(dfudev, span, el, flags)) {
+                span->length =
+                    el->element_address + el->element_size - span->address;
+                span->num_elements++;
+            } else {
+                span = &(*spans)[n++];
+                span->address = el->element_address;
+                span->length = el->element_size;
+                span->elements = &elements[k];
+                span->num_elements = 1;
+                span->next = 0;
+            }
+            k++;
+        }
+    }
+
+    return n;
+}
+
+/*
+stmdfu_span_block() is the dfu_write_flash_cb() callback of
+stmdfu_write_span(). A block that is all in one element goes out from the
+element itself, one that spans a gap or the edge of an element is put
+together in block.
+*/
+static uint8_t *stmdfu_span_block(void *arg, uint32_t offset, uint8_t *block,
+                                  uint32_t length)
+{
+    stmdfu_span *span = (stmdfu_span *)arg;
+    uint64_t start = (uint64_t)span->address + offset;
+    uint64_t end = start + length, from, to, el_end;
+    dfuse_image_element *el;
+    uint32_t i;
+
+    // the elements that end before the block are done with
+    while (span->next < span->num_elements &&
+           (uint64_t)span->elements[span->next]->element_address +
+                   span->elements[span->next]->element_size <= start) {
+        span->next++;
+    }
+
+    if (span->next < span->num_elements) {
+        el = span->elements[span->next];
+        el_end = (uint64_t)el->element_address + el->element_size;
+        if (el->element_address <= start && el_end >= end) {
+            return &el->data[start - el->element_address];
+        }
+    }
+
+    memset(block, 0xff, length);
+    for (i = span->next; i < span->num_elements; i++) {
+        el = span->elements[i];
+        el_end = (uint64_t)el->element_address + el->element_size;
+        if (el->element_address >= end) {
+            break;
+        }
+        from = el->element_address > start ? el->element_address : start;
+        to = el_end < end ? el_end : end;
+        memcpy(&block[from - start], &el->data[from - el->element_address],
+               to - from);
+    }
+
+    return block;
+}
+
+/*
+stmdfu_write_span() writes the elements of a span, and the padding
+between them, as one download.
+*/
+int32_t stmdfu_write_span(dfu_device *dfudev, stmdfu_span *span)
+{
+    span->next = 0;
+
+    return dfu_write_flash_cb(dfudev, span->address, span->length,
+                              stmdfu_span_block, span);
+}
+
+/*
+stmdfu_print_plan() shows what flashing the image would do: the erase,
+and every span with the elements in it and the padding between them. Each
+span saves the address pointer and idle handshake (about four requests)
+of every element in it but the first.
+*/
+int32_t stmdfu_print_plan(dfu_device *dfudev, dfuse_file *dfusefile,
+                          int flags)
+{
+    stmdfu_span *spans;
+    int32_t rv = 0, nspans, i;
+    uint32_t data, total = 0, j;
+
+    printf("dry run, nothing is erased or written\n");
+
+    if (flags & STMDFU_FLASH_DIFF) {
+        printf("erase: only the sectors that differ\n");
+    } else if (flags & STMDFU_FLASH_NO_ERASE) {
+        printf("erase: none\n");
+    } else {
+        rv = stmdfu_erase_image(dfudev, dfusefile, flags);
+    }
+
+    nspans = stmdfu_plan_spans(dfudev, dfusefile, flags, &spans);
+    if (nspans < 0) {
+        return nspans;
+    }
+
+    for (i = 0; i < nspans; i++) {
+        data = 0;
+        for (j = 0; j < spans[i].num_elements; j++) {
+            data += spans[i].elements[j]->element_size;
+        }
+        total += spans[i].num_elements;
+
+        printf("span %d: 0x%.8x - 0x%.8x, %u bytes, %u element%s", i + 1,
+               spans[i].address, spans[i].address + spans[i].length,
+               spans[i].length, spans[i].num_elements,
+               spans[i].num_elements == 1 ? "" : "s");
+        if (spans[i].length > data) {
+            printf(", %u bytes of padding", spans[i].length - data);
+        }
+        printf("\n");
+    }
+
+    printf("%u elements in %d spans, %u address pointer round trips "
+           "(about %u requests) saved\n",
+           total, nspans, total - nspans, 4 * (total - nspans));
+
+    free(spans);
+
+    return rv;
+}
+
+/*
+stmdfu_stream_reader() is the reader thread of stmdfu_stream_image(). It
+reads the file front to back into free slots of the ring, and takes the
+crc of everything but the crc itself on the way.
+*/
+static void *stmdfu_stream_reader(void *arg)
+{
+    stmdfu_stream *stream = (stmdfu_stream *)arg;
+    uint32_t offset = 0, slot, length, got, summed;
+    uint32_t crc_end = stream->file_size - 4;
+    uint32_t crc = 0;
+    uint8_t *data;
+    ssize_t n;
+
+    while (offset < stream->file_size) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->queued == STMDFU_STREAM_SLOTS && !stream->stop) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->stop) {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        slot = (stream->first + stream->queued) % STMDFU_STREAM_SLOTS;
+        pthread_mutex_unlock(&stream->lock);
+
+        // the usb side doesn't touch slots that aren't queued yet
+        data = &stream->slots[slot * stream->slot_size];
+        length = stream->file_size - offset < stream->slot_size
+                     ? stream->file_size - offset
+                     : stream->slot_size;
+        for (got = 0; got < length; got += n) {
+            n = read(stream->fd, &data[got], length - got);
+            if (n <= 0) {
+                break;
+            }
+        }
+        if (got < length) {
+            pthread_mutex_lock(&stream->lock);
+            stream->error = 1;
+            break;
+        }
+
+        summed = offset >= crc_end ? 0
+                 : crc_end - offset < length ? crc_end - offset
+                                             : length;
+        crc = crc32_update(crc, data, summed);
+        offset += length;
+
+        pthread_mutex_lock(&stream->lock);
+        stream->length[slot] = length;
+        stream->queued++;
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    if (!stream->error) {
+        pthread_mutex_lock(&stream->lock);
+    }
+    stream->crc = crc;
+    stream->done = 1;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+/*
+stmdfu_stream_take() copies length bytes at offset in the file out of the
+ring into dst. The bytes before offset that haven't been taken (headers,
+mostly) are passed over, offsets only ever go forward. Returns 0, or -1 if
+the file couldn't be read that far.
+*/
+static int32_t stmdfu_stream_take(stmdfu_stream *stream, uint32_t offset,
+                                  uint8_t *dst, uint32_t length)
+{
+    uint32_t at, available, n;
+    uint8_t *data;
+
+    pthread_mutex_lock(&stream->lock);
+    while (length) {
+        while (stream->queued == 0 && !stream->done) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->queued == 0) {
+            pthread_mutex_unlock(&stream->lock);
+            return -1;
+        }
+
+        at = stream->position + stream->used;
+        available = stream->length[stream->first] - stream->used;
+        if (at < offset) {
+            n = offset - at < available ? offset - at : available;
+        } else {
+            n = length < available ? length : available;
+            data = &stream->slots[stream->first * stream->slot_size +
+                                  stream->used];
+            pthread_mutex_unlock(&stream->lock);
+            memcpy(dst, data, n);
+            pthread_mutex_lock(&stream->lock);
+            dst += n;
+            offset += n;
+            length -= n;
+        }
+
+        stream->used += n;
+        if (stream->used == stream->length[stream->first]) {
+            stream->position += stream->used;
+            stream->used = 0;
+            stream->first = (stream->first + 1) % STMDFU_STREAM_SLOTS;
+            stream->queued--;
+            pthread_cond_signal(&stream->cond);
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+/*
+stmdfu_stream_finish() lets the reader thread run to the end of the file
+(so that it has the crc of all of it) and drops what is left, or stops it
+if stop is set, and waits for it.
+*/
+static void stmdfu_stream_finish(stmdfu_stream *stream, pthread_t thread,
+                                 int stop)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = stop;
+    while (!stream->done || stream->queued) {
+        if (stream->queued) {
+            stream->first = (stream->first + 1) % STMDFU_STREAM_SLOTS;
+            stream->queued--;
+        }
+        pthread_cond_signal(&stream->cond);
+        if (!stream->done && !stream->queued) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(thread, NULL);
+}
+
+/*
+stmdfu_stream_block() is the dfu_write_flash_cb() callback of a streamed
+span. It takes the data of the elements the block covers from the ring,
+pads what is in between, and keeps the crc of every element.
+*/
+static uint8_t *stmdfu_stream_block(void *arg, uint32_t offset,
+                                    uint8_t *block, uint32_t length)
+{
+    stmdfu_stream *stream = (stmdfu_stream *)arg;
+    stmdfu_span *span = stream->span;
+    uint64_t start = (uint64_t)span->address + offset;
+    uint64_t end = start + length, from, to, el_end;
+    dfuse_image_element *el;
+    uint32_t *crc;
+    uint32_t i;
+
+    memset(block, 0xff, length);
+    for (i = span->next; i < span->num_elements; i++) {
+        el = span->elements[i];
+        el_end = (uint64_t)el->element_address + el->element_size;
+        if (el_end <= start) {
+            span->next = i + 1;
+            continue;
+        }
+        if (el->element_address >= end) {
+            break;
+        }
+
+        from = el->element_address > start ? el->element_address : start;
+        to = el_end < end ? el_end : end;
+        if (stmdfu_stream_take(stream,
+                               el->offset + (from - el->element_address),
+                               &block[from - start], to - from)) {
+            return NULL;
+        }
+        crc = &stream->crcs[&span->elements[i] - stream->base];
+        *crc = crc32_update(*crc, &block[from - start], to - from);
+    }
+
+    return block;
+}
+
+/*
+stmdfu_crc_block() is the dfu_read_flash_cb() callback of a streamed
+--verify, it takes the crc of what is read back.
+*/
+static int32_t stmdfu_crc_block(void *arg, uint32_t offset, uint8_t *data,
+                                uint32_t length)
+{
+    uint32_t *crc = (uint32_t *)arg;
+
+    *crc = crc32_update(*crc, data, length);
+
+    return 0;
+}
+
+/*
+stmdfu_stream_image() flashes a dfuse file the way stmdfu_flash_image()
+does, in spans, with the data coming through the ring of the reader thread
+rather than from memory. Only the headers, the spans, the ring and a crc
+per element are held, a few tens of KiB whatever the size of the image.
+*/
+int32_t stmdfu_stream_image(dfu_device *dfudev, char *file, int flags)
+{
+    stmdfu_stream stream;
+    stmdfu_span *spans = NULL;
+    dfuse_file *dfusefile;
+    pthread_t thread;
+    struct timespec start;
+    int32_t rv = 0, nspans = 0, i;
+    uint32_t count = 0, j, crc;
+    int fd, reading = 0;
+
+    if (flags & STMDFU_FLASH_DIFF) {
+        printf("--diff reads the image sector by sector, it can't be "
+               "streamed\n");
+        return -1;
+    }
+
+    dfusefile = dfuse_scan(file, &fd);
+    if (dfusefile == NULL) {
+        return -1;
+    }
+
+    if (flags & STMDFU_FLASH_DRY_RUN) {
+        rv = stmdfu_print_plan(dfudev, dfusefile, flags);
+        dfuse_struct_cleanup(dfusefile);
+        close(fd);
+        return rv;
+    }
+
+    if (!(flags & STMDFU_FLASH_NO_ERASE)) {
+        rv = stmdfu_erase_image(dfudev, dfusefile, flags);
+    }
+    if (rv >= 0) {
+        nspans = stmdfu_plan_spans(dfudev, dfusefile, flags, &spans);
+        rv = nspans < 0 ? nspans : 0;
+    }
+    for (i = 0; i < nspans; i++) {
+        count += spans[i].num_elements;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.cond, NULL);
+    stream.fd = fd;
+    stream.file_size = dfusefile->mapping_size;
+    stream.slot_size = dfudev->transfer_size;
+    stream.slots = (uint8_t *)malloc(STMDFU_STREAM_SLOTS * stream.slot_size);
+    stream.base = nspans > 0 ? spans[0].elements : NULL;
+    stream.crcs = (uint32_t *)calloc(count + 1, sizeof(uint32_t));
+    if (stream.slots == NULL || stream.crcs == NULL) {
+        rv = -1;
+    }
+
+    if (rv >= 0) {
+        reading = !pthread_create(&thread, NULL, stmdfu_stream_reader,
+                                  &stream);
+        if (!reading) {
+            printf("stmdfu_stream_image: can't start the reader thread\n");
+            rv = -1;
+        }
+    }
+
+    for (i = 0; i < nspans && rv >= 0; i++) {
+        stmdfu_span *span = &spans[i];
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            printf("streaming %u bytes to %.8x", span->length, span->address);
+            if (span->num_elements > 1) {
+                printf(" (%u elements)", span->num_elements);
+            }
+            printf("...");
+            fflush(stdout);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        stream.span = span;
+        span->next = 0;
+        rv = dfu_write_flash_cb(dfudev, span->address, span->length,
+                                stmdfu_stream_block, &stream);
+        dfu_phase_add(dfudev, DFU_PHASE_PROGRAM, &start, span->length);
+
+        for (j = 0; j < span->num_elements && rv >= 0 &&
+                    (flags & STMDFU_FLASH_VERIFY);
+             j++) {
+            dfuse_image_element *el = span->elements[j];
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            crc = 0;
+            rv = dfu_read_flash_cb(dfudev, el->element_address,
+                                   el->element_size, stmdfu_crc_block, &crc);
+            if (rv >= 0 && crc != stream.crcs[&span->elements[j] -
+                                              stream.base]) {
+                printf("verify failed: 0x%.8x - 0x%.8x doesn't read back "
+                       "as written\n",
+                       el->element_address,
+                       el->element_address + el->element_size);
+                rv = -1;
+            }
+            dfu_phase_add(dfudev, DFU_PHASE_VERIFY, &start, el->element_size);
+        }
+
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            printf(rv < 0 ? "failed.\n" : "done.\n");
+        }
+    }
+
+    // the file was checked before the erase, the crc the reader took
+    // tells whether what was flashed is still what was checked
+    if (reading) {
+        stmdfu_stream_finish(&stream, thread, rv < 0);
+    }
+    if (rv >= 0 && stream.error) {
+        printf("error reading <%s>\n", file);
+        rv = -1;
+    }
+    if (rv >= 0 && !dfuse_crc_matches(dfusefile, stream.crc)) {
+        printf("<%s> has changed while it was flashed, what has been "
+               "flashed from it can't be trusted\n",
+               file);
+        rv = -1;
+    }
+
+    free(stream.crcs);
+    free(stream.slots);
+    free(spans);
+    pthread_cond_destroy(&stream.cond);
+    pthread_mutex_destroy(&stream.lock);
+    dfuse_struct_cleanup(dfusefile);
+    close(fd);
+
+    if (rv < 0) {
+        return rv;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dfu_leave_dfu_mode(dfudev);
+    dfu_phase_add(dfudev, DFU_PHASE_LEAVE, &start, 0);
+
+    return 0;
+}
+
+/*
+stmdfu_erase_image() erases every sector that the elements of a dfuse
+file cover, in one go before programming starts. If the image covers
+most of the flash and a mass erase is cheaper, it mass erases instead.
+*/
+int32_t stmdfu_erase_image(dfu_device *dfudev, dfuse_file *dfusefile,
+                           int flags)
+{
+    dfu_erase_plan plan;
+    struct timespec start;
+    int32_t rv = 0;
+    int i, j;
+
+    dfu_erase_plan_init(&plan);
+
+    for (i = 0; i < dfusefile->prefix.targets && rv >= 0; i++) {
+        dfuse_image *image = &dfusefile->images[i];
+        for (j = 0; j < image->tarprefix.num_elements && rv >= 0; j++) {
+            dfuse_image_element *el = &image->imgelement[j];
+            rv = dfu_erase_plan_add(dfudev, &plan, el->element_address,
+                                    el->element_size);
+        }
+    }
+
+    if (rv >= 0 && plan.num_sectors) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        dfu_erase_plan_choose(dfudev, &plan, DFU_MASS_ERASE_COVERAGE);
+
+        if (flags & STMDFU_FLASH_DRY_RUN) {
+            if (plan.mass_erase) {
+                printf("erase: mass erase\n");
+            } else {
+                printf("erase: %u sectors (%u bytes)\n", plan.num_sectors,
+                       plan.bytes);
+            }
+            dfu_erase_plan_free(&plan);
+            return 0;
+        }
+
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            if (plan.mass_erase) {
+                printf("mass erasing...");
+            } else {
+                printf("erasing %u sectors (%u bytes)...", plan.num_sectors,
+                       plan.bytes);
+            }
+            fflush(stdout);
+        }
+
+        rv = dfu_erase_plan_execute(dfudev, &plan);
+        dfu_phase_add(dfudev, DFU_PHASE_ERASE, &start, plan.bytes);
+
+        if (!(flags & STMDFU_FLASH_QUIET)) {
+            printf(rv < 0 ? "failed.\n" : "done.\n");
+        }
+    }
+
+    dfu_erase_plan_free(&plan);
+
+    return rv;
+}
+
+/*
+stmdfu_verify_block() is the dfu_read_flash_cb() callback of
+stmdfu_verify_element(). It queues a block that has been read back for the
+compare thread, and only waits if the thread is STMDFU_VERIFY_SLOTS blocks
+behind.
+*/
+static int32_t stmdfu_verify_block(void *arg, uint32_t offset, uint8_t *data,
+                                   uint32_t length)
+{
+    stmdfu_verify *verify = (stmdfu_verify *)arg;
+    uint32_t slot;
+
+    pthread_mutex_lock(&verify->lock);
+    while (verify->queued == STMDFU_VERIFY_SLOTS && !verify->mismatch) {
+        pthread_cond_wait(&verify->cond, &verify->lock);
+    }
+
+    // no point reading on once a difference has been found
+    if (verify->mismatch) {
+        pthread_mutex_unlock(&verify->lock);
+        return -1;
+    }
+
+    slot = (verify->first + verify->queued) % STMDFU_VERIFY_SLOTS;
+    pthread_mutex_unlock(&verify->lock);
+
+    // the compare thread doesn't touch slots that aren't queued yet
+    memcpy(&verify->slots[slot * verify->slot_size], data, length);
+    verify->offset[slot] = offset;
+    verify->length[slot] = length;
+
+    pthread_mutex_lock(&verify->lock);
+    verify->queued++;
+    pthread_cond_signal(&verify->cond);
+    pthread_mutex_unlock(&verify->lock);
+
+    return 0;
+}
+
+/*
+stmdfu_verify_worker() is the compare thread of stmdfu_verify_element(),
+it checks queued blocks against the image while the next block is read.
+*/
+static void *stmdfu_verify_worker(void *arg)
+{
+    stmdfu_verify *verify = (stmdfu_verify *)arg;
+    uint32_t slot, offset, i;
+    uint8_t *data;
+
+    pthread_mutex_lock(&verify->lock);
+    for (;;) {
+        while (verify->queued == 0 && !verify->done) {
+            pthread_cond_wait(&verify->cond, &verify->lock);
+        }
+        if (verify->queued == 0) {
+            break;
+        }
+
+        slot = verify->first;
+        pthread_mutex_unlock(&verify->lock);
+
+        data = &verify->slots[slot * verify->slot_size];
+        offset = verify->offset[slot];
+
+        if (memcmp(data, &verify->expected[offset], verify->length[slot])) {
+            i = 0;
+            while (data[i] == verify->expected[offset + i]) {
+                i++;
+            }
+            verify->mismatch_offset = offset + i;
+            verify->mismatch_read = data[i];
+        }
+
+        pthread_mutex_lock(&verify->lock);
+        if (verify->mismatch_offset != UINT32_MAX) {
+            verify->mismatch = 1;
+        }
+        verify->first = (verify->first + 1) % STMDFU_VERIFY_SLOTS;
+        verify->queued--;
+        pthread_cond_signal(&verify->cond);
+        if (verify->mismatch) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&verify->lock);
+
+    return NULL;
+}
+
+/*
+stmdfu_verify_element() reads an image element back from the device and
+compares it with the image. The compare runs on a thread of its own, so
+the next block is already on its way over usb while a block is checked.
+Returns 0 if the element matches, or < 0 at the first difference.
+*/
+int32_t stmdfu_verify_element(dfu_device *dfudev, dfuse_image_element *el)
+{
+    stmdfu_verify verify;
+    pthread_t thread;
+    int32_t rv;
+
+    memset(&verify, 0, sizeof(verify));
+    pthread_mutex_init(&verify.lock, NULL);
+    pthread_cond_init(&verify.cond, NULL);
+    verify.expected = el->data;
+    verify.mismatch_offset = UINT32_MAX;
+    verify.slot_size = dfudev->transfer_size;
+    verify.slots = (uint8_t *)malloc(STMDFU_VERIFY_SLOTS * verify.slot_size);
+
+    if (pthread_create(&thread, NULL, stmdfu_verify_worker, &verify)) {
+        printf("stmdfu_verify_element: can't start the compare thread\n");
+        rv = -1;
+    } else {
+        rv = dfu_read_flash_cb(dfudev, el->element_address, el->element_size,
+                               stmdfu_verify_block, &verify);
+
+        pthread_mutex_lock(&verify.lock);
+        verify.done = 1;
+        pthread_cond_signal(&verify.cond);
+        pthread_mutex_unlock(&verify.lock);
+
+        pthread_join(thread, NULL);
+    }
+
+    if (verify.mismatch) {
+        printf("verify failed at 0x%.8x: wrote 0x%.2x, read 0x%.2x\n",
+               el->element_address + verify.mismatch_offset,
+               el->data[verify.mismatch_offset], verify.mismatch_read);
+        rv = -1;
+    } else if (rv < 0) {
+        printf("verify failed: can't read back 0x%.8x\n", el->element_address);
+    }
+
+    free(verify.slots);
+    pthread_cond_destroy(&verify.cond);
+    pthread_mutex_destroy(&verify.lock);
+
+    return rv;
+}
+
+/*
+stmdfu_flush_run() programs a run of neighbouring sectors that
+stmdfu_write_element_diff() has collected, with one address pointer and
+one continuous download. Trailing 0xff bytes are already erased, so they
+aren't sent.
+*/
+static int32_t stmdfu_flush_run(dfu_device *dfudev, uint32_t address,
+                                uint8_t *run, uint32_t *length)
+{
+    int32_t rv = 0;
+
+    while (*length && run[*length - 1] == 0xff) {
+        (*length)--;
+    }
+
+    if (*length) {
+        rv = dfu_write_flash(dfudev, address, run, *length);
+    }
+
+    *length = 0;
+
+    return rv;
+}
+
+/*
+stmdfu_write_element_diff() reads back every sector that an image element
+covers, and only erases and programs the sectors whose contents differ.
+Bytes of the sectors outside the element are preserved. The number of
+element bytes that were already up to date is added to skipped.
+*/
+int32_t stmdfu_write_element_diff(dfu_device *dfudev, dfuse_image_element *el,
+                                  uint32_t *skipped)
+{
+    uint32_t address = el->element_address;
+    uint32_t end = el->element_address + el->element_size;
+    uint32_t run_address = 0, run_length = 0;
+    uint8_t *run = NULL, *current;
+    dfu_sector sector;
+    int32_t rv = 0;
+
+    while (address < end && rv >= 0) {
+        if (0 > dfu_get_sector(dfudev, address, &sector)) {
+            printf("stmdfu_write_element_diff: no sector at 0x%.8x\n",
+                   address);
+            rv = -1;
+            break;
+        }
+
+        uint32_t sector_end = sector.address + sector.size;
+        uint32_t chunk_end = end < sector_end ? end : sector_end;
+        uint32_t chunk = chunk_end - address;
+        uint8_t *wanted = &el->data[address - el->element_address];
+
+        current = (uint8_t *)malloc(sector.size);
+        if (0 > dfu_read_flash(dfudev, sector.address, current, sector.size)) {
+            free(current);
+            rv = -1;
+            break;
+        }
+
+        if (!memcmp(&current[address - sector.address], wanted, chunk)) {
+            *skipped += chunk;
+            rv = stmdfu_flush_run(dfudev, run_address, run, &run_length);
+        } else {
+            if (run_length && run_address + run_length != sector.address) {
+                rv = stmdfu_flush_run(dfudev, run_address, run, &run_length);
+            }
+
+            // a blank sector doesn't need erasing
+            for (uint32_t i = 0; i < sector.size; i++) {
+                if (current[i] != 0xff) {
+                    if (0 > dfu_erase(dfudev, sector.address)) {
+                        rv = -1;
+                    }
+                    break;
+                }
+            }
+
+            // the whole sector is erased, so the run keeps the bytes of it
+            // that are outside the element
+            if (!run_length) {
+                run_address = sector.address;
+            }
+            run = (uint8_t *)realloc(run, run_length + sector.size);
+            memcpy(&run[run_length], current, sector.size);
+            memcpy(&run[run_length + address - sector.address], wanted, chunk);
+            run_length += sector.size;
+        }
 
-        stmdfu_read_flash(dfudev, address, size);
+        free(current);
+        address = chunk_end;
     }
 
-    if (!strcmp(argv[1], "optbytes")) {
-        stmdfu_read_optbytes(dfudev);
+    if (rv >= 0) {
+        rv = stmdfu_flush_run(dfudev, run_address, run, &run_length);
     }
 
-    if (!strcmp(argv[1], "erase")) {
-        int address = strtol(argv[2], NULL, 0);
+    free(run);
 
-        if (address < 0)
-            address = 0;
+    return rv;
+}
 
-        stmdfu_erase(dfudev, address);
-    }
+/*
+stmdfu_dump_format() maps a format name (bin, ihex, dfuse, text) or the
+extension of a file name to an STMDFU_DUMP_... format. Returns -1 if it is
+none of them.
+*/
+int stmdfu_dump_format(const char *name)
+{
+    const char *ext;
 
-    if (!strcmp(argv[1], "masserase")) {
-        stmdfu_mass_erase(dfudev);
+    if (name == NULL) {
+        return -1;
     }
 
-    cleanup(dfudev);
+    ext = strrchr(name, '.');
+    ext = ext ? ext + 1 : name;
 
-    return 0;
+    if (!strcmp(ext, "hex") || !strcmp(ext, "ihex")) {
+        return STMDFU_DUMP_IHEX;
+    }
+    if (!strcmp(ext, "dfu") || !strcmp(ext, "dfuse")) {
+        return STMDFU_DUMP_DFUSE;
+    }
+    if (!strcmp(ext, "text") || !strcmp(ext, "txt")) {
+        return STMDFU_DUMP_TEXT;
+    }
+    if (!strcmp(ext, "bin") || !strcmp(ext, "raw")) {
+        return STMDFU_DUMP_BIN;
+    }
+
+    return -1;
 }
 
 /*
-stmdfu_write_image() is a wrapper function that extracts an image from
-a dfuse file, and flashes it to an attached stm32 device via usb dfu.
+stmdfu_dump_write() writes to the dump output, and keeps the crc of
+everything written up to date for the dfuse suffix.
 */
-void stmdfu_write_image(dfu_device *dfudev, char *file)
+static void stmdfu_dump_write(stmdfu_dump *dump, uint8_t *data,
+                              uint32_t length)
 {
-    int i, j;
-    int writesize;
-
-    int dfufile = open(file, O_RDONLY);
-    if (dfufile < 0) {
-        printf("error opening <%s>\n", file);
+    if (dump->format == STMDFU_DUMP_DFUSE) {
+        dump->crc = crc32_update(dump->crc, data, length);
     }
 
-    dfuse_file *dfusefile = (dfuse_file *)malloc(sizeof(dfuse_file));
-    dfusefile->prefix = (dfuse_prefix *)malloc(sizeof(dfuse_prefix));
-
-    dfuse_readprefix(dfusefile, dfufile);
+    fwrite(data, 1, length, dump->out);
+}
 
-    dfusefile->images = (dfuse_image **)malloc(sizeof(dfuse_image *) *
-                                               dfusefile->prefix->targets);
-    for (i = 0; i < dfusefile->prefix->targets; i++) {
-        dfuse_image *image = (dfuse_image *)malloc(sizeof(dfuse_image));
-        dfusefile->images[i] = image;
-        image->tarprefix =
-            (dfuse_target_prefix *)malloc(sizeof(dfuse_target_prefix));
+/*
+stmdfu_dump_ihex_record() writes one Intel HEX record.
+*/
+static void stmdfu_dump_ihex_record(stmdfu_dump *dump, uint8_t type,
+                                    uint16_t address, uint8_t *data,
+                                    uint8_t length)
+{
+    uint8_t sum = length + (address >> 8) + address + type;
+    int i;
 
-        dfuse_readtarprefix(image, dfufile);
+    fprintf(dump->out, ":%.2X%.4X%.2X", length, address, type);
+    for (i = 0; i < length; i++) {
+        fprintf(dump->out, "%.2X", data[i]);
+        sum += data[i];
+    }
+    fprintf(dump->out, "%.2X\n", (uint8_t)-sum);
+}
 
-        image->imgelement = (dfuse_image_element **)malloc(
-            sizeof(dfuse_image_element *) * image->tarprefix->num_elements);
-        for (j = 0; j < image->tarprefix->num_elements; j++) {
-            dfuse_image_element *el =
-                (dfuse_image_element *)malloc(sizeof(dfuse_image_element));
-            dfusefile->images[i]->imgelement[j] = el;
+/*
+stmdfu_dump_block() is the dfu_read_flash_cb() callback of
+stmdfu_read_flash(), it writes every block to the output in the wanted
+format as soon as it has been read.
+*/
+static int32_t stmdfu_dump_block(void *arg, uint32_t offset, uint8_t *data,
+                                 uint32_t length)
+{
+    stmdfu_dump *dump = (stmdfu_dump *)arg;
+    uint32_t i, n;
 
-            dfuse_readimgelement_meta(el, dfufile);
-            el->data = (uint8_t *)malloc(sizeof(uint8_t) * el->element_size);
-            dfuse_readimgelement_data(el, dfufile);
-        }
-    }
+    switch (dump->format) {
+    case STMDFU_DUMP_IHEX:
+        for (i = 0; i < length; i += n) {
+            uint32_t address = dump->address + offset + i;
+            uint8_t upper[2] = {address >> 24, address >> 16};
 
-    dfusefile->suffix = (dfuse_suffix *)malloc(sizeof(dfuse_suffix));
+            // records can't cross a 64kB boundary
+            n = length - i < 16 ? length - i : 16;
+            if ((address & 0xffff) + n > 0x10000) {
+                n = 0x10000 - (address & 0xffff);
+            }
 
-    dfuse_readsuffix(dfusefile, dfufile);
+            if (address >> 16 != dump->upper) {
+                stmdfu_dump_ihex_record(dump, 0x04, 0, upper, 2);
+                dump->upper = address >> 16;
+            }
+            stmdfu_dump_ihex_record(dump, 0x00, address, &data[i], n);
+        }
+        break;
 
-    for (i = 0; i < dfusefile->prefix->targets; i++) {
-        dfuse_image *image = dfusefile->images[i];
-        for (j = 0; j < image->tarprefix->num_elements; j++) {
-            dfuse_image_element *el = image->imgelement[j];
-            dfu_set_address_pointer(dfudev, el->element_address);
-            printf("address pointer set to %.8x\n", el->element_address);
-            dfu_make_idle(dfudev, 0);
-            printf("made idle\n");
-            writesize = el->element_size / FLASH_PAGE_BYTES;
-            writesize = (writesize + 1) * FLASH_PAGE_BYTES;
-            printf("flashing...");
-            dfu_write_flash(dfudev, el->data, writesize);
-            printf("done.\n");
+    case STMDFU_DUMP_TEXT:
+        for (i = 0; i < length; i++) {
+            fprintf(dump->out, "0x%.2X ", data[i]);
+            if (++dump->column == 10) {
+                fprintf(dump->out, "\n");
+                dump->column = 0;
+            }
         }
+        break;
+
+    default:
+        stmdfu_dump_write(dump, data, length);
+        break;
     }
 
-    dfuse_struct_cleanup(dfusefile);
+    return ferror(dump->out) ? -1 : 0;
 }
 
 /*
 stmdfu_read_flash() is a wrapper function that reads size bytes of memory
-from address on an stm32 device via dfu.
+from address on an stm32 device via dfu, and writes it to file (or stdout
+if file is NULL) in the given STMDFU_DUMP_... format. Blocks are written
+as they arrive, so the memory used doesn't depend on size.
 */
-void stmdfu_read_flash(dfu_device *dfudev, int address, int size)
+int32_t stmdfu_read_flash(dfu_device *dfudev, int address, int size,
+                          char *file, int format)
 {
-    int i, j;
+    stmdfu_dump dump;
+    dfuse_file *dfusefile = NULL;
+    uint8_t header[STMDFU_TARPREFIXLEN];
+    struct timespec start;
+    int32_t rv;
+
+    memset(&dump, 0, sizeof(dump));
+    dump.format = format;
+    dump.address = address;
+    dump.upper = UINT32_MAX;
+    dump.out = stdout;
 
-    uint8_t *memdump;
+    if (file != NULL) {
+        dump.out = fopen(file, "wb");
+        if (dump.out == NULL) {
+            printf("error opening <%s>\n", file);
+            return -1;
+        }
+    }
 
-    memdump = (uint8_t *)calloc(size, sizeof(uint8_t));
+    // a dfuse file of one element, the sizes are known up front so the
+    // headers can go out before the data
+    if (format == STMDFU_DUMP_DFUSE) {
+        dfu_sector sector;
+        dfuse_image *image;
+        dfuse_image_element *el;
+
+        dfusefile = dfuse_init(0xffff, STM32VENDOR, STM32PRODUCT);
+        if (!dfu_get_sector(dfudev, address, &sector) && sector.region) {
+            image = dfuse_addimage(dfusefile, sector.region->name,
+                                   sector.region->alt_setting);
+        } else {
+            image = dfuse_addimage(dfusefile, "Internal Flash", 0);
+        }
 
-    dfu_set_address_pointer(dfudev, address);
+        // the data goes out as it is read, the element is only headers
+        el = dfuse_addelement_view(dfusefile, image, address, size, NULL);
 
-    dfu_make_idle(dfudev, 0);
+        stmdfu_dump_write(&dump, header, dfuse_packprefix(dfusefile, header));
+        stmdfu_dump_write(&dump, header, dfuse_packtarprefix(image, header));
+        stmdfu_dump_write(&dump, header,
+                          dfuse_packimgelement_meta(el, header));
+    }
 
-    dfu_read_flash(dfudev, memdump, size);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = dfu_read_flash_cb(dfudev, address, size, stmdfu_dump_block, &dump);
+    dfu_phase_add(dfudev, DFU_PHASE_READ, &start, rv < 0 ? 0 : size);
 
-    for (i = 0; i < ceil(size / 10.); i++) {
-        for (j = 0; j < 10; j++) {
-            if ((i * 10 + j) < size) {
-                printf("0x%.2X ", memdump[i * 10 + j]);
-            } else {
-            }
+    if (rv >= 0) {
+        if (format == STMDFU_DUMP_IHEX) {
+            stmdfu_dump_ihex_record(&dump, 0x01, 0, NULL, 0);
+        } else if (format == STMDFU_DUMP_TEXT && dump.column) {
+            fprintf(dump.out, "\n");
+        } else if (format == STMDFU_DUMP_DFUSE) {
+            // the crc covers the suffix too, up to the crc itself
+            dump.crc = crc32_update(
+                dump.crc, header, dfuse_packsuffix(dfusefile, header) - 4);
+            dfusefile->suffix.crc = dump.crc;
+            dfuse_packsuffix(dfusefile, header);
+            fwrite(header, 1, STMDFU_SUFFIXLEN, dump.out);
         }
-        printf("\n");
+    } else {
+        printf("dump of 0x%.8x failed\n", address);
     }
 
-    free(memdump);
+    if (dfusefile != NULL) {
+        dfuse_struct_cleanup(dfusefile);
+    }
+
+    if (file != NULL) {
+        if (fclose(dump.out)) {
+            rv = -1;
+        }
+    } else {
+        fflush(stdout);
+    }
+
+    return rv;
 }
 
 /*
@@ -169,8 +1960,11 @@ void stmdfu_read_optbytes(dfu_device *dfudev)
     int i;
 
     uint8_t optbytes[16];
+    struct timespec start;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     dfu_read_optbytes(dfudev, optbytes);
+    dfu_phase_add(dfudev, DFU_PHASE_READ, &start, sizeof(optbytes));
 
     printf("optbytes:\n");
 
@@ -180,19 +1974,56 @@ void stmdfu_read_optbytes(dfu_device *dfudev)
 }
 
 /*
-stmdfu_erase() is a wrapper function that erases 1 page of flash at a
-time on an stm32 device via dfu.
+stmdfu_erase() is a wrapper function that erases the flash sectors that
+length bytes at address belong to on an stm32 device via dfu.
 */
-void stmdfu_erase(dfu_device *dfudev, int address)
+int32_t stmdfu_erase(dfu_device *dfudev, int address, int length)
 {
-    dfu_erase(dfudev, address);
+    dfu_erase_plan plan;
+    struct timespec start;
+    int32_t rv;
+
+    dfu_erase_plan_init(&plan);
+
+    rv = dfu_erase_plan_add(dfudev, &plan, address, length);
+    if (rv >= 0) {
+        // only mass erase when that is exactly what was asked for
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        dfu_erase_plan_choose(dfudev, &plan, 100);
+        rv = dfu_erase_plan_execute(dfudev, &plan);
+        dfu_phase_add(dfudev, DFU_PHASE_ERASE, &start, plan.bytes);
+        if (rv >= 0) {
+            printf("erased %u sectors (%u bytes)\n", plan.num_sectors,
+                   plan.bytes);
+        }
+    }
+
+    dfu_erase_plan_free(&plan);
+
+    return rv;
 }
 
 /*
 stmdfu_mass_erase() is a wrapper function that erases all flash memory
 of an stm32 device via dfu.
 */
-void stmdfu_mass_erase(dfu_device *dfudev) { dfu_mass_erase(dfudev); }
+void stmdfu_mass_erase(dfu_device *dfudev)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dfu_mass_erase(dfudev);
+    dfu_phase_add(dfudev, DFU_PHASE_ERASE, &start, 0);
+}
+
+/*
+stmdfu_print_layout() prints the memory regions and sectors that the
+attached stm32 device reports for each of its dfu alternate settings.
+*/
+void stmdfu_print_layout(dfu_device *dfudev)
+{
+    dfu_layout_print(dfudev->regions, dfudev->num_regions);
+}
 
 /*
 stmdfu_init_dfu() sets up an attached stm32 dfu device and puts it in
@@ -202,38 +2033,345 @@ dfu_device *stmdfu_init_dfu()
 {
     dfu_device *dfudev = find_dfu_device();
 
-    libusb_set_interface_alt_setting(dfudev->handle, 0, 0);
-
     // now we've got a handle to the DFU device we want to deal with
 
+    stmdfu_prepare_device(dfudev);
+
+    return dfudev;
+}
+
+/*
+stmdfu_prepare_device() selects the internal flash alternate setting of
+an opened stm32 dfu device and puts it in an idle state.
+*/
+void stmdfu_prepare_device(dfu_device *dfudev)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    dfudev->transport->set_altsetting(dfudev, dfudev->altsetting);
+
     if (!dfu_make_idle(dfudev, 0)) {
 #if STMDFU_DEBUG_PRINTFS
         printf("entered dfuIDLE state\n");
 #endif
     }
 
-    return dfudev;
+    dfu_phase_add(dfudev, DFU_PHASE_IDLE, &start, 0);
 }
 
 /*
-find_dfu_device() searches through the tree of attached usb devices,
-and finds any attached stm32 dfu devices (by vendor and product id).
+find_transfer_size() looks through the extra descriptors of a dfu
+interface for the DFU functional descriptor, and returns the wTransferSize
+it advertises (or 0 if there is none).
 */
-dfu_device *find_dfu_device()
+static uint16_t find_transfer_size(const unsigned char *extra, int length)
+{
+    while (length >= 2 && extra[0] >= 2 && extra[0] <= length) {
+        // wTransferSize is at offset 5, DFU 1.0 descriptors stop after it
+        if (extra[1] == DFU_FUNCTIONAL_DESCRIPTOR && extra[0] >= 7) {
+            return extra[5] | (extra[6] << 8);
+        }
+        length -= extra[0];
+        extra += extra[0];
+    }
+
+    return 0;
+}
+
+/*
+stmdfu_parse_selector() reads the -s <serial>, -p <bus-port.port> and
+-d <bus:addr> options in front of the command into sel. Returns the
+number of arguments used, or < 0 if an option can't be parsed.
+*/
+int stmdfu_parse_selector(int argc, char *argv[], stmdfu_selector *sel)
+{
+    char *p;
+    int i;
+
+    memset(sel, 0, sizeof(*sel));
+    sel->bus = -1;
+    sel->address = -1;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-s")) {
+            sel->serial = argv[i + 1];
+        } else if (!strcmp(argv[i], "-p")) {
+            sel->bus = strtol(argv[i + 1], &p, 10);
+            sel->nports = 0;
+            while (*p == (sel->nports ? '.' : '-') &&
+                   sel->nports < STMDFU_MAX_PORTS) {
+                sel->ports[sel->nports++] = strtol(p + 1, &p, 10);
+            }
+            if (*p || !sel->nports) {
+                printf("can't parse port path <%s>, use bus-port.port...\n",
+                       argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-d")) {
+            sel->bus = strtol(argv[i + 1], &p, 10);
+            if (*p != ':') {
+                printf("can't parse usb address <%s>, use bus:addr\n",
+                       argv[i + 1]);
+                return -1;
+            }
+            sel->address = strtol(p + 1, &p, 10);
+        } else {
+            break;
+        }
+    }
+
+    return i - 1;
+}
+
+/*
+stmdfu_select_location() checks a device against the bus, port path and
+address of sel. All of these are known without opening the device.
+*/
+int stmdfu_select_location(libusb_device *dev, stmdfu_selector *sel)
+{
+    uint8_t ports[STMDFU_MAX_PORTS];
+    int nports;
+
+    if (sel == NULL) {
+        return 1;
+    }
+
+    if (sel->bus >= 0 && libusb_get_bus_number(dev) != sel->bus) {
+        return 0;
+    }
+
+    if (sel->address >= 0 && libusb_get_device_address(dev) != sel->address) {
+        return 0;
+    }
+
+    if (sel->nports) {
+        nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+        if (nports != sel->nports || memcmp(ports, sel->ports, nports)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+stmdfu_select_serial() checks the serial number of an opened device
+against sel, this costs a string descriptor request.
+*/
+int stmdfu_select_serial(libusb_device *dev, libusb_device_handle *handle,
+                         stmdfu_selector *sel)
+{
+    struct libusb_device_descriptor devdesc;
+    unsigned char serial[256];
+
+    if (sel == NULL || sel->serial == NULL) {
+        return 1;
+    }
+
+    if (libusb_get_device_descriptor(dev, &devdesc) ||
+        !devdesc.iSerialNumber ||
+        0 > libusb_get_string_descriptor_ascii(handle, devdesc.iSerialNumber,
+                                               serial, sizeof(serial))) {
+        return 0;
+    }
+
+    return !strcmp((const char *)serial, sel->serial);
+}
+
+/*
+compare_location() orders usb devices by bus and port path, for qsort().
+*/
+static int compare_location(const void *a, const void *b)
+{
+    libusb_device *deva = *(libusb_device *const *)a;
+    libusb_device *devb = *(libusb_device *const *)b;
+    uint8_t portsa[STMDFU_MAX_PORTS], portsb[STMDFU_MAX_PORTS];
+    int na, nb, i;
+
+    if (libusb_get_bus_number(deva) != libusb_get_bus_number(devb)) {
+        return libusb_get_bus_number(deva) - libusb_get_bus_number(devb);
+    }
+
+    na = libusb_get_port_numbers(deva, portsa, sizeof(portsa));
+    nb = libusb_get_port_numbers(devb, portsb, sizeof(portsb));
+    for (i = 0; i < na && i < nb; i++) {
+        if (portsa[i] != portsb[i]) {
+            return portsa[i] - portsb[i];
+        }
+    }
+
+    return na - nb;
+}
+
+/*
+probe_dfu_device() opens a usb device, and reads its dfu interface,
+transfer size and memory layout into dfudev. Returns 0 if it is an stm32
+dfu device with internal flash whose dfu interface could be claimed; the
+handle is then left open with the interface claimed. If sel asks for a
+serial number, a device with another one is closed again before anything
+else is read, and 1 is returned.
+*/
+int probe_dfu_device(libusb_device *dev, dfu_device *dfudev,
+                     stmdfu_selector *sel)
 {
-    libusb_device **devlist;
-    libusb_device *dfutemp;
-    dfu_device *dfudev;
     libusb_device_handle *dfuhandle;
     struct libusb_device_descriptor devdesc;
     struct libusb_config_descriptor *cfgdesc;
-    ssize_t nlistdevs;
-    int i, j, k, l;
+    unsigned char strdesc[256];
+    uint16_t transfer_size = 0;
+    uint8_t ports[STMDFU_MAX_PORTS];
+    int nports, len;
+    int found = 0;
+    int j, k, l;
     int err;
+
+    if (libusb_get_device_descriptor(dev, &devdesc)) {
+        printf("failed to get device descriptor\n");
+        return -1;
+    }
+
+    err = libusb_open(dev, &dfuhandle);
+    if (err) {
+        printf("error opening device handle\n");
+        return -1;
+    }
+
+    if (!stmdfu_select_serial(dev, dfuhandle, sel)) {
+        libusb_close(dfuhandle);
+        return 1;
+    }
+
+    dfudev->num_regions = 0;
+
+    // according to DFU 1.1 standard, a DFU device in DFU Mode
+    // will have only one each of a configuration and interface.
+    // but we'll parse as if there are multiple anyways!
+
+    // iterate through available configurations
+    for (j = 0; j < devdesc.bNumConfigurations; j++) {
+        if (libusb_get_config_descriptor(dev, j, &cfgdesc)) {
+            printf("failed to get config descriptor %d\n", j);
+            continue;
+        }
+        // iterate through available interfaces
+        for (k = 0; k < cfgdesc->bNumInterfaces; k++) {
+            // iterate through available alternate settings
+            for (l = 0; l < cfgdesc->interface[k].num_altsetting; l++) {
+                const struct libusb_interface_descriptor *alt =
+                    &cfgdesc->interface[k].altsetting[l];
+
+                if (alt->bInterfaceClass != DFU_ITF_CLASS ||
+                    alt->bInterfaceSubClass != DFU_ITF_SUBCLASS ||
+                    alt->bInterfaceProtocol != DFU_ITF_PROTOCOL) {
+                    continue;
+                }
+
+                // the functional descriptor normally follows the
+                // interface, some bootloaders attach it to the config
+                if (!transfer_size) {
+                    transfer_size =
+                        find_transfer_size(alt->extra, alt->extra_length);
+                }
+                if (!transfer_size) {
+                    transfer_size = find_transfer_size(cfgdesc->extra,
+                                                       cfgdesc->extra_length);
+                }
+
+                if (0 > libusb_get_string_descriptor_ascii(
+                            dfuhandle, alt->iInterface, strdesc,
+                            sizeof(strdesc))) {
+                    continue;
+                }
+
+                // every alternate setting publishes the layout of
+                // one memory region (flash, option bytes, OTP, ...)
+                if (dfudev->num_regions < DFU_MAX_REGIONS &&
+                    !dfu_layout_parse(&dfudev->regions[dfudev->num_regions],
+                                      (const char *)strdesc,
+                                      alt->bAlternateSetting)) {
+                    dfudev->num_regions++;
+                }
+
+                if (!strncmp((const char *)strdesc, "@Internal Flash", 15)) {
+#if STMDFU_DEBUG_PRINTFS
+                    printf("\ndevice:\n");
+                    printf("vendor:product <%x>:<%x>\n", devdesc.idVendor,
+                           devdesc.idProduct);
+                    printf("class:subclass <%x>:<%x>\n", devdesc.bDeviceClass,
+                           devdesc.bDeviceSubClass);
+                    printf("usbspec:configs <%x>:<%x>\n", devdesc.bcdUSB,
+                           devdesc.bNumConfigurations);
+
+                    printf("interface:\n");
+                    printf("<%d>::<%d>::<%d>\n\n", alt->bInterfaceClass,
+                           alt->bInterfaceSubClass, alt->bInterfaceProtocol);
+#endif
+                    found = 1;
+                    dfudev->altsetting = alt->bAlternateSetting;
+                    dfudev->interface = k;
+                }
+            }
+        }
+        libusb_free_config_descriptor(cfgdesc);
+    }
+
+    if (!found) {
+        libusb_close(dfuhandle);
+        return -1;
+    }
+
+    dfudev->transport = &dfu_libusb_transport;
+    dfudev->handle = dfuhandle;
+    dfudev->transfer_size =
+        transfer_size ? transfer_size : DFU_DEFAULT_TRANSFER_SIZE;
+
+    // bus-port.port... names the device in messages
+    len = snprintf(dfudev->path, sizeof(dfudev->path), "%d-",
+                   libusb_get_bus_number(dev));
+    nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (j = 0; j < nports && len < (int)sizeof(dfudev->path); j++) {
+        len += snprintf(&dfudev->path[len], sizeof(dfudev->path) - len,
+                        j ? ".%d" : "%d", ports[j]);
+    }
+
+    err = libusb_claim_interface(dfudev->handle, dfudev->interface);
+
+    if (err == LIBUSB_ERROR_BUSY) {
+        printf("STM32 DFU device: interface already claimed\n");
+    } else if (err) {
+        printf("STM32 DFU device: interface can't be claimed\n");
+    }
+    if (err) {
+        libusb_close(dfuhandle);
+        dfudev->handle = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+find_dfu_devices() searches through the tree of attached usb devices,
+and opens the attached stm32 dfu devices (by vendor and product id)
+that sel selects. Devices that sel rules out by their location aren't
+opened at all. Unless all is set only the last one in bus and port order
+that probes fine is opened and claimed, the others are left to whoever
+else wants them. Returns the number of devices found, the devices are
+returned in a malloc'd array, in bus and port order.
+*/
+int find_dfu_devices(dfu_device ***devices, stmdfu_selector *sel, int all)
+{
+    libusb_device **devlist;
+    struct libusb_device_descriptor devdesc;
+    struct timespec start, end;
+    ssize_t nlistdevs;
+    int i, k;
     int ndfudevs = 0;
-    unsigned char strdesc[100];
+    int candidates = 0;
 
-    dfudev = (dfu_device *)malloc(sizeof(dfu_device));
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     libusb_init(NULL);
 
@@ -243,116 +2381,102 @@ dfu_device *find_dfu_device()
         exit(-1);
     }
 
-    for (i = 0; i < nlistdevs; i++) {
+    *devices = (dfu_device **)calloc(nlistdevs + 1, sizeof(dfu_device *));
+
+    // the last device is the default target, it shouldn't depend on the
+    // order of enumeration
+    qsort(devlist, nlistdevs, sizeof(libusb_device *), compare_location);
+
+    // the last device is the one a single device command takes, so the
+    // list is walked from the end and the walk stops there
+    for (k = 0; k < nlistdevs; k++) {
+        i = all ? k : nlistdevs - 1 - k;
+
         if (libusb_get_device_descriptor(devlist[i], &devdesc)) {
             printf("failed to get device descriptor\n");
+            continue;
         }
 
         if ((devdesc.idVendor == STM32VENDOR) &&
-            (devdesc.idProduct == STM32PRODUCT)) {
-            err = libusb_open(devlist[i], &dfuhandle);
-            if (err) {
-                printf("error opening device handle <%d>\n", i);
-            }
+            (devdesc.idProduct == STM32PRODUCT) &&
+            stmdfu_select_location(devlist[i], sel)) {
+            dfu_device *dfudev;
 
-            // according to DFU 1.1 standard, a DFU device in DFU Mode
-            // will have only one each of a configuration and interface.
-            // but we'll parse as if there are multiple anyways!
+            candidates++;
+            if (!all && ndfudevs) {
+                continue;
+            }
 
-            // iterate through available configurations
-            for (j = 0; j < devdesc.bNumConfigurations; j++) {
-                if (libusb_get_config_descriptor(devlist[i], j, &cfgdesc)) {
-                    printf("failed to get config descriptor %d::%d\n", i, j);
-                }
-                // iterate through available interfaces
-                for (k = 0; k < cfgdesc->bNumInterfaces; k++) {
-                    // iterate through available alternate settings
-                    for (l = 0; l < cfgdesc->interface[k].num_altsetting; l++) {
-                        libusb_get_string_descriptor_ascii(
-                            dfuhandle,
-                            cfgdesc->interface[k].altsetting[l].iInterface,
-                            strdesc, 100);
-                        if (cfgdesc->interface[k]
-                                    .altsetting[l]
-                                    .bInterfaceClass == DFU_ITF_CLASS &&
-                            cfgdesc->interface[k]
-                                    .altsetting[l]
-                                    .bInterfaceSubClass == DFU_ITF_SUBCLASS &&
-                            cfgdesc->interface[k]
-                                    .altsetting[l]
-                                    .bInterfaceProtocol == DFU_ITF_PROTOCOL
-                            && !strncmp((const char*)strdesc, "@Internal Flash", 15)
-                            ) {
-#if STMDFU_DEBUG_PRINTFS
-                            printf("\ndevice:\n");
-                            printf("vendor:product <%x>:<%x>\n",
-                                   devdesc.idVendor, devdesc.idProduct);
-                            printf("class:subclass <%x>:<%x>\n",
-                                   devdesc.bDeviceClass,
-                                   devdesc.bDeviceSubClass);
-                            printf("usbspec:configs <%x>:<%x>\n",
-                                   devdesc.bcdUSB, devdesc.bNumConfigurations);
-
-                            printf("interface:\n");
-                            printf("<%d>::<%d>::<%d>\n\n",
-                                   cfgdesc->interface[k]
-                                       .altsetting[l]
-                                       .bInterfaceClass,
-                                   cfgdesc->interface[k]
-                                       .altsetting[l]
-                                       .bInterfaceSubClass,
-                                   cfgdesc->interface[k]
-                                       .altsetting[l]
-                                       .bInterfaceProtocol);
-#endif
-                            ndfudevs++;
-                            dfutemp = devlist[i];
-                            dfudev->interface = k;
-                        }
-                    }
-                }
-                libusb_free_config_descriptor(cfgdesc);
+            dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+            if (probe_dfu_device(devlist[i], dfudev, sel)) {
+                free(dfudev);
+                continue;
             }
-            libusb_close(dfuhandle);
-        }
-    }
 
-    if (ndfudevs < 1) {
-        printf("No STM32 DFU Device connected. Check boot switches and "
-               "replugin board.\n");
-        exit(-1);
+            (*devices)[ndfudevs++] = dfudev;
+        }
     }
 
-    if (ndfudevs > 1) {
+    // the others aren't opened, so their serial numbers aren't known
+    if (!all && ndfudevs && candidates > 1 &&
+        (sel == NULL || sel->serial == NULL)) {
         printf("More than 1 STM32 DFU device connected. Targetting last "
                "enumerated STM32 DFU device.\n");
     }
 
-    // calling function will need to call libusb_close(dfudev->handle)
-    err = libusb_open(dfutemp, &dfudev->handle);
-    if (err) {
-        printf("error opening dfudev handle \n");
-    }
     libusb_free_device_list(devlist, 1);
 
-    err = libusb_claim_interface(dfudev->handle, dfudev->interface);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stmdfu_enumerate_us = (end.tv_sec - start.tv_sec) * 1000000LL +
+                          (end.tv_nsec - start.tv_nsec) / 1000;
 
-    if (err == LIBUSB_ERROR_BUSY) {
-        printf("STM32 DFU device: interface already claimed\n");
-    } else if (err) {
-        printf("STM32 DFU device: interface can't be claimed\n");
+    return ndfudevs;
+}
+
+/*
+find_dfu_device() searches through the tree of attached usb devices,
+and finds any attached stm32 dfu devices (by vendor and product id).
+*/
+dfu_device *find_dfu_device()
+{
+    dfu_device **devices;
+    dfu_device *dfudev;
+    int i, ndfudevs;
+
+    ndfudevs = find_dfu_devices(&devices, NULL, 0);
+
+    if (ndfudevs < 1) {
+        printf("No STM32 DFU Device connected. Check boot switches and "
+               "replugin board.\n");
+        exit(-1);
+    }
+
+    // calling function will need to call cleanup(dfudev)
+    dfudev = devices[ndfudevs - 1];
+
+    for (i = 0; i < ndfudevs - 1; i++) {
+        close_dfu_device(devices[i]);
     }
+    free(devices);
 
     return dfudev;
 }
 
+/*
+close_dfu_device() releases the usb handle/interface of one device and
+deallocates it.
+*/
+void close_dfu_device(dfu_device *dfudev)
+{
+    dfudev->transport->close(dfudev);
+    free(dfudev);
+}
+
 /*
 cleanup() releases any usb handles/interfaces and deallocates memory.
 */
 void cleanup(dfu_device *dfudev)
 {
-    libusb_release_interface(dfudev->handle, dfudev->interface);
-    libusb_close(dfudev->handle);
-    free(dfudev);
+    close_dfu_device(dfudev);
     libusb_exit(NULL);
-}
\ No newline at end of file
+}
@@ -9,6 +9,54 @@ the operation.
 #define STM32VENDOR 0x0483
 #define STM32PRODUCT 0xdf11
 
+/* longest port path that -p takes */
+#define STMDFU_MAX_PORTS 8
+
+/*
+stmdfu_selector picks a device by serial number (-s), by the bus and
+port path it is plugged into (-p bus-port.port) or by its usb address
+(-d bus:addr). A bus or address of -1, no port numbers or no serial
+number mean that part doesn't matter.
+*/
+typedef struct {
+    const char *serial;
+    int bus;
+    int address;
+    int nports;
+    uint8_t ports[STMDFU_MAX_PORTS];
+} stmdfu_selector;
+
+/*
+stmdfu_run() runs one command (argv[1] onwards, as on the command line)
+against already opened stm32 dfu devices. -s/-p/-d in front of the
+command narrow down the devices. Returns the exit status.
+*/
+int stmdfu_run(dfu_device ** devices, int ndevices, int argc, char * argv[]);
+
+/*
+stmdfu_enumerate_us is how long the last search for devices took (by
+find_dfu_devices(), or the daemon's rescan), for the run report.
+*/
+extern uint64_t stmdfu_enumerate_us;
+
+/*
+stmdfu_write_report() writes the run report of a command as json to file
+("-" is stdout): the time the command and the enumeration before it took,
+then the time and throughput of every phase, the count, bytes and latency
+(min/avg/p99/max) of every request type and the operations waited for, of
+every device the command ran on.
+*/
+int32_t stmdfu_write_report(char * file, char * command,
+                            dfu_device ** devices, int ndevices,
+                            int32_t result, struct timespec * start);
+
+/*
+stmdfu_write_trace() writes every request, poll wait and phase recorded
+since dfu_trace_start() to file in Chrome trace-event format (it opens in
+Perfetto or chrome://tracing), one timeline per device.
+*/
+int32_t stmdfu_write_trace(char * file, dfu_device ** devices, int ndevices);
+
 /*
 stmdfu_...() functions are simply wrapper functions that call
 dfu_...() functions with the necessary parameters. They exist to make
@@ -17,17 +65,276 @@ dfu operation will call just one function, while the stmdfu_...()
 wrapper functions handle setting up the arguments, looping, etc.
 */
 
+/* flags for stmdfu_write_image() */
+#define STMDFU_FLASH_DIFF 0x01
+#define STMDFU_FLASH_ALL 0x02
+#define STMDFU_FLASH_QUIET 0x04
+#define STMDFU_FLASH_STATS 0x08
+#define STMDFU_FLASH_NO_ERASE 0x10
+#define STMDFU_FLASH_VERIFY 0x20
+#define STMDFU_FLASH_DRY_RUN 0x40
+#define STMDFU_FLASH_STREAM 0x80
+
+/* blocks that can be read back ahead of the verify compare thread */
+#define STMDFU_VERIFY_SLOTS 4
+
+/*
+stmdfu_job is the work item of one stmdfu_write_image_all() worker
+thread: the device it flashes, and the result it reports back.
+*/
+typedef struct {
+    dfu_device *dfudev;
+    dfuse_file *dfusefile;
+    int flags;
+    int32_t result;
+    uint32_t bytes;
+    double seconds;
+} stmdfu_job;
+
 /*
 stmdfu_write_image() is a wrapper function that extracts an image from
-a dfuse file, and flashes it to an attached stm32 device via usb dfu.
+a dfuse (or .hex, .bin, .elf) file, and flashes it to an attached stm32
+device via usb dfu. With STMDFU_FLASH_DIFF only the sectors that differ from the image are
+erased and programmed.
+*/
+int32_t stmdfu_write_image(dfu_device * dfudev, char * file, int flags);
+
+/*
+stmdfu_write_image_all() flashes an image to all of the given stm32 dfu
+devices at once. The dfuse file is parsed once, and every device gets
+its own worker thread. A summary of the results is printed at the end.
+*/
+int32_t stmdfu_write_image_all(dfu_device ** devices, int ndevices,
+                               char * file, int flags);
+
+/*
+stmdfu_flash_worker() is the thread body used by stmdfu_write_image_all(),
+it flashes one device and records the result in its stmdfu_job.
+*/
+void * stmdfu_flash_worker(void * arg);
+
+/* station mode: how often a new board is tried to be opened */
+#define STMDFU_STATION_OPEN_TRIES 50
+#define STMDFU_STATION_OPEN_DELAY_US 20000
+
+/* longest wait for usb events before station mode checks on its workers */
+#define STMDFU_STATION_EVENT_US 100000
+
+/*
+stmdfu_station is shared by station mode's hotplug callback and the
+worker threads of the boards in flight.
+*/
+typedef struct {
+    pthread_mutex_t lock;
+    dfuse_file *dfusefile;
+    int flags;
+    int limit;
+    int started;
+    int in_flight;
+    int passed;
+    int failed;
+    stmdfu_selector *sel;
+} stmdfu_station;
+
+/*
+stmdfu_arrival is the work item of one station mode worker thread: the
+board that has been plugged in, and when it arrived.
+*/
+typedef struct {
+    stmdfu_station *station;
+    libusb_device *dev;
+    struct timespec arrived;
+} stmdfu_arrival;
+
+/*
+stmdfu_run_station() is station mode: it flashes file to every stm32 dfu
+device as soon as it is plugged in (and to those already attached), each
+on a thread of its own, and waits for the next one. It stops after limit
+boards (0 means never), or on ctrl-c once the boards in flight are done.
+Only the boards that sel selects are flashed. Returns 0 if every board
+was flashed, or < 0.
+*/
+int32_t stmdfu_run_station(char * file, int flags, int limit,
+                           stmdfu_selector * sel);
+
+/*
+stmdfu_load_image() reads a dfuse, Intel HEX, raw binary (file.bin or
+file.bin@address) or ELF file into memory, and checks it before any
+device is touched. Returns NULL if the file can't be read or is corrupt.
+*/
+dfuse_file * stmdfu_load_image(char * file);
+
+/*
+stmdfu_flash_image() flashes every element of a dfuse file that is
+already in memory, then makes the device leave dfu mode. Returns 0 on
+success, or < 0 if an element couldn't be flashed.
+*/
+int32_t stmdfu_flash_image(dfu_device * dfudev, dfuse_file * dfusefile,
+                           int flags);
+
+/*
+stmdfu_verify is shared by stmdfu_verify_element() and its compare thread:
+a ring of STMDFU_VERIFY_SLOTS blocks that have been read back, and the
+first difference found.
+*/
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const uint8_t *expected;
+    uint8_t *slots;
+    uint32_t slot_size;
+    uint32_t offset[STMDFU_VERIFY_SLOTS];
+    uint32_t length[STMDFU_VERIFY_SLOTS];
+    uint32_t first;
+    uint32_t queued;
+    int done;
+    int mismatch;
+    uint32_t mismatch_offset;
+    uint8_t mismatch_read;
+} stmdfu_verify;
+
+/*
+stmdfu_verify_element() reads an image element back from the device and
+compares it with the image. The compare runs on a thread of its own, so
+the next block is already on its way over usb while a block is checked.
+Returns 0 if the element matches, or < 0 at the first difference.
+*/
+int32_t stmdfu_verify_element(dfu_device * dfudev, dfuse_image_element * el);
+
+/*
+stmdfu_erase_image() erases every sector that the elements of a dfuse
+file cover, in one go before programming starts. If the image covers
+most of the flash and a mass erase is cheaper, it mass erases instead.
 */
-void stmdfu_write_image(dfu_device * dfudev, char * file);
+int32_t stmdfu_erase_image(dfu_device * dfudev, dfuse_file * dfusefile,
+                           int flags);
+
+/*
+stmdfu_span is a run of image elements that is written with one address
+pointer and one sequence of blocks. The elements follow each other, and
+the gaps between them are padded with 0xff. next is where the block
+callback has got to.
+*/
+typedef struct {
+    uint32_t address;
+    uint32_t length;
+    dfuse_image_element **elements;
+    uint32_t num_elements;
+    uint32_t next;
+} stmdfu_span;
+
+/*
+stmdfu_plan_spans() joins the elements of a dfuse file into spans, in file
+order. An element joins the span before it if it starts where the span
+ends in the same region, or (when the sectors are erased first) a gap
+within one sector after it, so that only erased bytes are padded. Returns
+the number of spans, or < 0. The spans and their element pointers are
+one malloc'd block, a single free(spans) releases both.
+*/
+int32_t stmdfu_plan_spans(dfu_device * dfudev, dfuse_file * dfusefile,
+                          int flags, stmdfu_span ** spans);
+
+/*
+stmdfu_write_span() writes a span with dfu_write_flash_cb(), taking every
+block straight from its element where it can.
+*/
+int32_t stmdfu_write_span(dfu_device * dfudev, stmdfu_span * span);
+
+/*
+stmdfu_print_plan() is flash --dry-run: it lists what would be erased, and
+the spans the elements would be written in, without touching the device.
+*/
+int32_t stmdfu_print_plan(dfu_device * dfudev, dfuse_file * dfusefile,
+                          int flags);
+
+/* blocks the reader thread of a streamed flash can be ahead of usb */
+#define STMDFU_STREAM_SLOTS 16
+
+/*
+stmdfu_stream is shared by stmdfu_stream_image() and its reader thread: a
+ring of STMDFU_STREAM_SLOTS blocks of the file, read in order, and the crc
+of the file so far. position is where in the file the first queued block
+is, and used how much of it has been taken. crcs holds the crc32 of the
+data of every element (base is the first of the element pointers of the
+spans), for --verify.
+*/
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    uint32_t file_size;
+    uint8_t *slots;
+    uint32_t slot_size;
+    uint32_t length[STMDFU_STREAM_SLOTS];
+    uint32_t first;
+    uint32_t queued;
+    uint32_t position;
+    uint32_t used;
+    int done;
+    int stop;
+    int error;
+    uint32_t crc;
+    stmdfu_span *span;
+    dfuse_image_element **base;
+    uint32_t *crcs;
+} stmdfu_stream;
+
+/*
+stmdfu_stream_image() is flash --stream: the dfuse file is checked (crc
+and all) through a small window before anything is erased, only its
+headers are kept, and a reader thread feeds the element data through a
+ring of wTransferSize blocks while it is written, so the memory used
+doesn't depend on the size of the image. The reader takes the crc again,
+if the file has changed in the meantime the flash fails and the device is
+left in dfu mode. --verify compares the crc32 of what is read back with
+that of what was written.
+*/
+int32_t stmdfu_stream_image(dfu_device * dfudev, char * file, int flags);
+
+/*
+stmdfu_write_element_diff() reads back every sector that an image element
+covers, and only erases and programs the sectors whose contents differ.
+Bytes of the sectors outside the element are preserved. The number of
+element bytes that were already up to date is added to skipped.
+*/
+int32_t stmdfu_write_element_diff(dfu_device * dfudev,
+                                  dfuse_image_element * el,
+                                  uint32_t * skipped);
+
+/* output formats of stmdfu_read_flash() */
+#define STMDFU_DUMP_BIN 0
+#define STMDFU_DUMP_IHEX 1
+#define STMDFU_DUMP_DFUSE 2
+#define STMDFU_DUMP_TEXT 3
+
+/*
+stmdfu_dump is the output that stmdfu_read_flash() streams blocks into,
+with what each format has to remember from one block to the next.
+*/
+typedef struct {
+    FILE *out;
+    int format;
+    uint32_t address;
+    uint32_t upper;
+    uint32_t column;
+    uint32_t crc;
+} stmdfu_dump;
+
+/*
+stmdfu_dump_format() maps a format name (bin, ihex, dfuse, text) or the
+extension of a file name to an STMDFU_DUMP_... format. Returns -1 if it is
+none of them.
+*/
+int stmdfu_dump_format(const char * name);
 
 /*
 stmdfu_read_flash() is a wrapper function that reads size bytes of memory
-from address on an stm32 device via dfu.
+from address on an stm32 device via dfu, and writes it to file (or stdout
+if file is NULL) in the given STMDFU_DUMP_... format. Blocks are written
+as they arrive, so the memory used doesn't depend on size.
 */
-void stmdfu_read_flash(dfu_device * dfudev, int address, int size);
+int32_t stmdfu_read_flash(dfu_device * dfudev, int address, int size,
+                          char * file, int format);
 
 /*
 stmdfu_read_optbytes() is a wrapper function that reads the option bytes
@@ -36,10 +343,10 @@ from an stm32 device via dfu.
 void stmdfu_read_optbytes(dfu_device * dfudev);
 
 /*
-stmdfu_erase() is a wrapper function that erases 1 page of flash at a
-time on an stm32 device via dfu.
+stmdfu_erase() is a wrapper function that erases the flash sectors that
+length bytes at address belong to on an stm32 device via dfu.
 */
-void stmdfu_erase(dfu_device * dfudev, int address);
+int32_t stmdfu_erase(dfu_device * dfudev, int address, int length);
 
 /*
 stmdfu_mass_erase() is a wrapper function that erases all flash memory
@@ -47,18 +354,77 @@ of an stm32 device via dfu.
 */
 void stmdfu_mass_erase(dfu_device * dfudev);
 
+/*
+stmdfu_print_layout() prints the memory regions and sectors that the
+attached stm32 device reports for each of its dfu alternate settings.
+*/
+void stmdfu_print_layout(dfu_device * dfudev);
+
 /*
 stmdfu_init_dfu() sets up an attached stm32 dfu device and puts it in
 an idle state, so it's ready to handle dfu commands.
 */
 dfu_device * stmdfu_init_dfu();
 
+/*
+stmdfu_prepare_device() selects the internal flash alternate setting of
+an opened stm32 dfu device and puts it in an idle state.
+*/
+void stmdfu_prepare_device(dfu_device * dfudev);
+
+/*
+stmdfu_parse_selector() reads the -s/-p/-d options in front of the
+command into sel. Returns the number of arguments used, or < 0 if an
+option can't be parsed.
+*/
+int stmdfu_parse_selector(int argc, char * argv[], stmdfu_selector * sel);
+
+/*
+stmdfu_select_location() checks a device against the bus, port path and
+address of sel (NULL selects everything), without opening it.
+*/
+int stmdfu_select_location(libusb_device * dev, stmdfu_selector * sel);
+
+/*
+stmdfu_select_serial() checks the serial number of an opened device
+against sel (NULL selects everything).
+*/
+int stmdfu_select_serial(libusb_device * dev, libusb_device_handle * handle,
+                         stmdfu_selector * sel);
+
+/*
+probe_dfu_device() opens a usb device, and reads its dfu interface,
+transfer size and memory layout into dfudev. Returns 0 if it is an stm32
+dfu device with internal flash; the handle is then left open with the
+dfu interface claimed. Returns 1 if the serial number isn't the one sel
+asks for, nothing but the serial number is read then.
+*/
+int probe_dfu_device(libusb_device * dev, dfu_device * dfudev,
+                     stmdfu_selector * sel);
+
+/*
+find_dfu_devices() searches through the tree of attached usb devices,
+and opens the attached stm32 dfu devices (by vendor and product id) that
+sel selects (NULL selects all of them). Devices that sel rules out by
+location are never opened. With all set every one of them is opened and
+claimed (flash --all, the daemon), otherwise only the last one in bus and
+port order that can be. Returns the number of devices found, the devices
+are returned in a malloc'd array, in bus and port order.
+*/
+int find_dfu_devices(dfu_device *** devices, stmdfu_selector * sel, int all);
+
 /*
 find_dfu_device() searches through the tree of attached usb devices,
 and finds any attached stm32 dfu devices (by vendor and product id).
 */
 dfu_device * find_dfu_device();
 
+/*
+close_dfu_device() releases the usb handle/interface of one device and
+deallocates it.
+*/
+void close_dfu_device(dfu_device * dfudev);
+
 /*
 cleanup() releases any usb handles/interfaces and deallocates memory.
 */
@@ -0,0 +1,533 @@
+/*
+stmdfud.{c,h} :
+Keeps stmdfu resident. The daemon holds on to the libusb context and the
+claimed stm32 dfu devices, and runs jobs (the same commands stmdfu takes on
+the command line) that a thin client sends it over a unix domain socket.
+Whatever a job prints is streamed back to the client as it is printed.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libusb-1.0/libusb.h>
+#include "dfulayout.h"
+#include "dfurequests.h"
+#include "dfucommands.h"
+#include "dfuse.h"
+#include "stmdfu.h"
+#include "stmdfud.h"
+
+/*
+        stmdfud_write_all() and stmdfud_read_all() move exactly length
+        bytes, or fail.
+*/
+static int stmdfud_write_all(int fd, const void *data, uint32_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    ssize_t n;
+
+    while (length) {
+        n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int stmdfud_read_all(int fd, void *data, uint32_t length)
+{
+    uint8_t *p = (uint8_t *)data;
+    ssize_t n;
+
+    while (length) {
+        n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/*
+        stmdfud_send_frame() writes one frame.
+*/
+int stmdfud_send_frame(int fd, uint8_t type, const void *data,
+                       uint32_t length)
+{
+    uint8_t header[STMDFUD_FRAME_HEADER];
+
+    header[0] = type;
+    memcpy(&header[1], &length, sizeof(length));
+
+    if (stmdfud_write_all(fd, header, sizeof(header)) ||
+        stmdfud_write_all(fd, data, length)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+        stmdfud_recv_frame() reads one frame, the payload is returned in a
+        malloc'd buffer (with a NUL after it).
+*/
+int stmdfud_recv_frame(int fd, uint8_t *type, uint8_t **data,
+                       uint32_t *length)
+{
+    uint8_t header[STMDFUD_FRAME_HEADER];
+
+    if (stmdfud_read_all(fd, header, sizeof(header))) {
+        return -1;
+    }
+
+    *type = header[0];
+    memcpy(length, &header[1], sizeof(*length));
+    if (*length > STMDFUD_MAX_FRAME) {
+        return -2;
+    }
+
+    *data = (uint8_t *)malloc(*length + 1);
+    (*data)[*length] = 0;
+
+    if (stmdfud_read_all(fd, *data, *length)) {
+        free(*data);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+        stmdfud_listed() checks whether dev is in a device list.
+*/
+static int stmdfud_listed(libusb_device **devlist, ssize_t nlistdevs,
+                          libusb_device *dev)
+{
+    ssize_t i;
+
+    for (i = 0; i < nlistdevs; i++) {
+        if (devlist[i] == dev) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+        stmdfud_rescan() brings the daemon's list of devices up to date.
+        Listing the bus is cheap, only devices that weren't there before get
+        opened and probed.
+*/
+int stmdfud_rescan(dfu_device ***devices, int ndevices)
+{
+    libusb_device **devlist;
+    struct libusb_device_descriptor devdesc;
+    struct timespec start, end;
+    ssize_t nlistdevs;
+    int i, j;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    nlistdevs = libusb_get_device_list(NULL, &devlist);
+    if (nlistdevs < 0) {
+        printf("error getting device list\n");
+        return ndevices;
+    }
+
+    // close the devices that aren't on the bus anymore
+    for (i = 0; i < ndevices;) {
+        libusb_device *dev = libusb_get_device((*devices)[i]->handle);
+
+        if (stmdfud_listed(devlist, nlistdevs, dev)) {
+            i++;
+            continue;
+        }
+
+        printf("%s: gone\n", (*devices)[i]->path);
+        close_dfu_device((*devices)[i]);
+        (*devices)[i] = (*devices)[--ndevices];
+    }
+
+    // and open the ones that have turned up
+    for (j = 0; j < nlistdevs; j++) {
+        dfu_device *dfudev;
+        int known = 0;
+
+        if (libusb_get_device_descriptor(devlist[j], &devdesc) ||
+            devdesc.idVendor != STM32VENDOR ||
+            devdesc.idProduct != STM32PRODUCT) {
+            continue;
+        }
+
+        for (i = 0; i < ndevices; i++) {
+            if (libusb_get_device((*devices)[i]->handle) == devlist[j]) {
+                known = 1;
+            }
+        }
+
+        if (known) {
+            continue;
+        }
+
+        dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+        if (probe_dfu_device(devlist[j], dfudev, NULL)) {
+            free(dfudev);
+            continue;
+        }
+
+        *devices = (dfu_device **)realloc(*devices, (ndevices + 1) *
+                                                        sizeof(dfu_device *));
+        (*devices)[ndevices++] = dfudev;
+        printf("%s: attached\n", dfudev->path);
+    }
+
+    libusb_free_device_list(devlist, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stmdfu_enumerate_us = (end.tv_sec - start.tv_sec) * 1000000LL +
+                          (end.tv_nsec - start.tv_nsec) / 1000;
+
+    return ndevices;
+}
+
+/*
+        stmdfud_relay_output() runs next to a job, and forwards everything
+        the job prints (into a pipe that stands in for stdout) to the client.
+*/
+static void *stmdfud_relay_output(void *arg)
+{
+    stmdfud_relay *relay = (stmdfud_relay *)arg;
+    uint8_t buf[4096];
+    ssize_t n;
+    int connected = 1;
+
+    for (;;) {
+        n = read(relay->pipe, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        // keep draining the pipe if the client has gone, so the job can
+        // still run to the end
+        if (connected &&
+            stmdfud_send_frame(relay->client, STMDFUD_OUTPUT, buf, n)) {
+            connected = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+        stmdfud_resolve() makes the file names in a job (the image of
+        flash, and whatever follows -o, --report or --trace) relative to
+        the client's working directory cwd, rather than the daemon's, and
+        stores the joined names in paths. Returns 0, or < 0 if cwd isn't
+        an absolute path.
+*/
+static int stmdfud_resolve(int argc, char *argv[], const char *cwd,
+                           char *paths[])
+{
+    int cmd, i;
+
+    if (cwd[0] != '/') {
+        return -1;
+    }
+
+    // the command follows the -s/-p/-d selectors, stmdfu_run() parses them
+    for (cmd = 1; cmd + 1 < argc && (!strcmp(argv[cmd], "-s") ||
+                                     !strcmp(argv[cmd], "-p") ||
+                                     !strcmp(argv[cmd], "-d"));
+         cmd += 2) {
+    }
+
+    for (i = cmd + 1; i < argc; i++) {
+        if ((i == cmd + 1 && !strcmp(argv[cmd], "flash")) ||
+            !strcmp(argv[i - 1], "-o") || !strcmp(argv[i - 1], "--report") ||
+            !strcmp(argv[i - 1], "--trace")) {
+            if (argv[i][0] == '/') {
+                continue;
+            }
+            paths[i] = (char *)malloc(strlen(cwd) + strlen(argv[i]) + 2);
+            sprintf(paths[i], "%s/%s", cwd, argv[i]);
+            argv[i] = paths[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+        stmdfud_run_job() runs the job in payload (working directory, then
+        argv) with stdout redirected to the client. The daemon stays in its
+        own working directory, the file names of the job are resolved
+        against the client's.
+*/
+static int stmdfud_run_job(int client, dfu_device ***devices, int *ndevices,
+                           char *payload, uint32_t length)
+{
+    stmdfud_relay relay;
+    pthread_t thread;
+    char **argv, **paths;
+    char *cwd = payload;
+    int argc = 0, fds[2], saved, i;
+    int32_t rv;
+
+    for (i = strlen(cwd) + 1; i < (int)length; i += strlen(&payload[i]) + 1) {
+        argc++;
+    }
+
+    argv = (char **)calloc(argc + 1, sizeof(char *));
+    paths = (char **)calloc(argc + 1, sizeof(char *));
+    argc = 0;
+    for (i = strlen(cwd) + 1; i < (int)length; i += strlen(&payload[i]) + 1) {
+        argv[argc++] = &payload[i];
+    }
+
+    if (pipe(fds)) {
+        free(paths);
+        free(argv);
+        return -1;
+    }
+
+    *ndevices = stmdfud_rescan(devices, *ndevices);
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+
+    relay.pipe = fds[0];
+    relay.client = client;
+    pthread_create(&thread, NULL, stmdfud_relay_output, &relay);
+
+    // relative file names are relative to the client
+    if (stmdfud_resolve(argc, argv, cwd, paths)) {
+        printf("stmdfu: working directory <%s> isn't an absolute path\n",
+               cwd);
+        rv = 1;
+    } else {
+        rv = stmdfu_run(*devices, *ndevices, argc, argv);
+    }
+
+    // the relay sees the end of the pipe once stdout is back
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    for (i = 0; i < argc; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(argv);
+
+    return stmdfud_send_frame(client, STMDFUD_EXIT, &rv, sizeof(rv));
+}
+
+/*
+        stmdfud_peer_allowed() checks that the client on the other end of
+        the socket runs as the same user as the daemon.
+*/
+static int stmdfud_peer_allowed(int client)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+        len != sizeof(cred)) {
+        return 0;
+    }
+
+    return cred.uid == geteuid();
+}
+
+/*
+        stmdfu_daemon() opens every attached stm32 dfu device, listens on
+        the unix domain socket at path and runs the jobs that come in, one at
+        a time. The socket is created 0600, whatever the umask, and only a
+        socket left behind by an earlier daemon is replaced.
+*/
+int stmdfu_daemon(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    dfu_device **devices;
+    char *runtime = getenv("XDG_RUNTIME_DIR");
+    int ndevices, server, client, err;
+    const char *denial = "stmdfu: the daemon only runs jobs of its user\n";
+    int32_t denied = 1;
+    mode_t mask;
+    uint8_t type;
+    uint8_t *payload;
+    uint32_t length;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // progress lines have to reach the client while the job runs
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path != NULL) {
+        err = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    } else if (runtime != NULL && runtime[0] == '/') {
+        err = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+                       runtime, STMDFU_SOCKET_NAME);
+    } else {
+        err = snprintf(addr.sun_path, sizeof(addr.sun_path),
+                       "/tmp/stmdfu-%u.sock", (unsigned)geteuid());
+    }
+    path = addr.sun_path;
+    if (err >= (int)sizeof(addr.sun_path)) {
+        printf("stmdfu: socket path <%s> is too long\n", path);
+        return 1;
+    }
+
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            printf("stmdfu: <%s> is in the way of the socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    mask = umask(0177);
+    err = server < 0 ||
+          bind(server, (struct sockaddr *)&addr, sizeof(addr)) ||
+          listen(server, 16);
+    umask(mask);
+    if (err) {
+        printf("stmdfu: can't listen on <%s>\n", path);
+        return 1;
+    }
+
+    ndevices = find_dfu_devices(&devices, NULL, 1);
+    printf("stmdfu: %d devices, listening on <%s>\n", ndevices, path);
+
+    for (;;) {
+        client = accept(server, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        if (!stmdfud_recv_frame(client, &type, &payload, &length)) {
+            if (type == STMDFUD_JOB && !stmdfud_peer_allowed(client)) {
+                printf("stmdfu: turned away a job from another user\n");
+                stmdfud_send_frame(client, STMDFUD_OUTPUT, denial,
+                                   strlen(denial));
+                stmdfud_send_frame(client, STMDFUD_EXIT, &denied,
+                                   sizeof(denied));
+            } else if (type == STMDFUD_JOB) {
+                stmdfud_run_job(client, &devices, &ndevices, (char *)payload,
+                                length);
+            }
+            free(payload);
+        }
+
+        close(client);
+    }
+
+    return 0;
+}
+
+/*
+        stmdfu_client() sends a command to the daemon listening at path, and
+        copies the output of the job to stdout.
+*/
+int stmdfu_client(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    char cwd[4096];
+    char *job;
+    uint32_t length;
+    uint8_t type;
+    uint8_t *payload;
+    int32_t rv = -1;
+    int fd, i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("stmdfu: no daemon listening on <%s>\n", path);
+        return 1;
+    }
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+
+    length = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+
+    job = (char *)malloc(length);
+    length = 0;
+    strcpy(job, cwd);
+    length += strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        strcpy(&job[length], argv[i]);
+        length += strlen(argv[i]) + 1;
+    }
+
+    if (stmdfud_send_frame(fd, STMDFUD_JOB, job, length)) {
+        printf("stmdfu: can't send the job\n");
+        free(job);
+        close(fd);
+        return 1;
+    }
+    free(job);
+
+    while (rv < 0 && !stmdfud_recv_frame(fd, &type, &payload, &length)) {
+        if (type == STMDFUD_OUTPUT) {
+            stmdfud_write_all(STDOUT_FILENO, payload, length);
+        } else if (type == STMDFUD_EXIT && length == sizeof(rv)) {
+            memcpy(&rv, payload, sizeof(rv));
+        }
+        free(payload);
+    }
+
+    close(fd);
+
+    if (rv < 0) {
+        printf("stmdfu: the daemon went away\n");
+        return 1;
+    }
+
+    return rv;
+}
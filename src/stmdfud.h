@@ -0,0 +1,76 @@
+/*
+stmdfud.{c,h} :
+Keeps stmdfu resident. The daemon holds on to the libusb context and the
+claimed stm32 dfu devices, and runs jobs (the same commands stmdfu takes on
+the command line) that a thin client sends it over a unix domain socket.
+Whatever a job prints is streamed back to the client as it is printed.
+*/
+
+#ifndef __STMDFUD__
+#define __STMDFUD__
+
+/*
+the daemon listens on $XDG_RUNTIME_DIR/stmdfu.sock by default, which only
+its user can get at, or on /tmp/stmdfu-<uid>.sock if that isn't set
+*/
+#define STMDFU_SOCKET_NAME "stmdfu.sock"
+
+/*
+Everything on the socket is a frame: a type byte, a 32 bit (host order)
+length, and that many bytes of payload.
+*/
+#define STMDFUD_FRAME_HEADER 5
+#define STMDFUD_MAX_FRAME (1024 * 1024)
+
+/* client -> daemon: the client's working directory, then argv, each NUL
+ * terminated */
+#define STMDFUD_JOB 'j'
+
+/* daemon -> client: output of the job */
+#define STMDFUD_OUTPUT 'o'
+
+/* daemon -> client: exit status of the job (int32_t), the last frame */
+#define STMDFUD_EXIT 'x'
+
+/*
+stmdfud_relay is what stmdfud_relay_output() needs to forward the output
+of a job from the pipe it is printed into to the client.
+*/
+typedef struct {
+    int pipe;
+    int client;
+} stmdfud_relay;
+
+/*
+stmdfu_daemon() opens every attached stm32 dfu device, listens on the unix
+domain socket at path (NULL for the default) and runs the jobs that come
+in, one at a time. The socket is only accessible to the user the daemon
+runs as, and jobs from any other user are turned away. It only returns if
+the socket can't be set up.
+*/
+int stmdfu_daemon(const char *path);
+
+/*
+stmdfu_client() sends a command (argv[1] onwards) to the daemon listening at
+path, and copies the output of the job to stdout. Returns the exit status of
+the job.
+*/
+int stmdfu_client(const char *path, int argc, char *argv[]);
+
+/*
+stmdfud_rescan() brings the daemon's list of devices up to date: devices
+that have gone away (e.g. after leaving dfu mode) are closed, newly attached
+ones are opened. Returns the new number of devices.
+*/
+int stmdfud_rescan(dfu_device ***devices, int ndevices);
+
+/*
+stmdfud_send_frame() and stmdfud_recv_frame() write and read one frame.
+stmdfud_recv_frame() returns the payload in a malloc'd buffer. Both return
+0 on success, or < 0 if the peer has gone away.
+*/
+int stmdfud_send_frame(int fd, uint8_t type, const void *data,
+                       uint32_t length);
+int stmdfud_recv_frame(int fd, uint8_t *type, uint8_t **data,
+                       uint32_t *length);
+#endif
@@ -0,0 +1,87 @@
+#!/bin/sh
+# make check: flashes, verifies, dumps and erases images on simulated
+# devices (-t sim), and records a session and replays it, so that the
+# whole tool chain is exercised without any hardware attached.
+
+BUILD=${1:-build}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+mkdir "$WORK/sim"
+
+STMDFU="$BUILD/stmdfu"
+SIM="-t sim:dir=$WORK/sim,mass_erase_ms=20"
+FAILED=0
+
+# run <description> <command...> expects the command to succeed
+run() {
+    what=$1
+    shift
+    if "$@" > "$WORK/log" 2>&1; then
+        echo "ok   $what"
+    else
+        echo "FAIL $what"
+        cat "$WORK/log"
+        FAILED=1
+    fi
+}
+
+# fails <description> <command...> expects the command to fail
+fails() {
+    what=$1
+    shift
+    if "$@" > "$WORK/log" 2>&1; then
+        echo "FAIL $what"
+        cat "$WORK/log"
+        FAILED=1
+    else
+        echo "ok   $what"
+    fi
+}
+
+# flash_reads <file> <size> checks that size bytes of flash read back as file
+flash_reads() {
+    "$STMDFU" $SIM dump 0x08000000 "$2" -o "$WORK/read.bin" &&
+        cmp "$WORK/read.bin" "$1"
+}
+
+head -c 300000 /dev/urandom > "$WORK/a.bin"
+cp "$WORK/a.bin" "$WORK/b.bin"
+printf 'changed' | dd of="$WORK/b.bin" bs=1 seek=200000 conv=notrunc \
+    2> /dev/null
+
+run "bin2dfu a" "$BUILD/bin2dfu" "$WORK/a.bin" "$WORK/a.dfu"
+run "bin2dfu b" "$BUILD/bin2dfu" "$WORK/b.bin" "$WORK/b.dfu"
+
+run "flash --verify" "$STMDFU" $SIM flash "$WORK/a.dfu" --verify
+run "dump" flash_reads "$WORK/a.bin" 300000
+
+run "flash --diff --verify" "$STMDFU" $SIM flash "$WORK/b.dfu" --diff --verify
+run "dump after --diff" flash_reads "$WORK/b.bin" 300000
+
+run "flash --stream --verify" "$STMDFU" $SIM flash "$WORK/a.dfu" --stream \
+    --verify
+run "dump after --stream" flash_reads "$WORK/a.bin" 300000
+
+run "dump -o .hex" "$STMDFU" $SIM dump 0x08000000 300000 -o "$WORK/a.hex"
+run "masserase" "$STMDFU" $SIM masserase
+head -c 4096 /dev/zero | tr '\000' '\377' > "$WORK/erased.bin"
+run "dump after masserase" flash_reads "$WORK/erased.bin" 4096
+
+run "flash .hex --verify" "$STMDFU" $SIM flash "$WORK/a.hex" --verify
+run "dump after .hex" flash_reads "$WORK/a.bin" 300000
+
+cp "$WORK/b.dfu" "$WORK/bad.dfu"
+printf 'x' | dd of="$WORK/bad.dfu" bs=1 seek=100000 conv=notrunc 2> /dev/null
+fails "flash of a corrupt file" "$STMDFU" $SIM flash "$WORK/bad.dfu"
+fails "flash --stream of a corrupt file" "$STMDFU" $SIM flash \
+    "$WORK/bad.dfu" --stream
+run "a corrupt file leaves flash alone" flash_reads "$WORK/a.bin" 300000
+
+run "--record" "$STMDFU" $SIM --record "$WORK/session.rec" flash \
+    "$WORK/b.dfu" --verify
+run "--replay" "$STMDFU" --replay "$WORK/session.rec" flash "$WORK/b.dfu" \
+    --verify
+fails "--replay of another image" "$STMDFU" --replay "$WORK/session.rec" \
+    flash "$WORK/a.dfu" --verify
+
+exit $FAILED